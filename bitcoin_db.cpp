@@ -597,7 +597,7 @@ public:
 instance_of_cdbinit;
 
 
-CDB::CDB(const char* pszFile, const char* pszMode) : pdb(NULL)
+CDB::CDB(const char* pszFile, const char* pszMode) : pdb(NULL), fTxnNoSync(false), fSecure(true)
 {
     int ret;
     if (pszFile == NULL)
@@ -780,6 +780,19 @@ void DBFlush(bool fShutdown)
     }
 }
 
+void DBLogFlush()
+{
+    // Write out log records of transactions committed with DB_TXN_NOSYNC
+    CRITICAL_BLOCK(cs_db)
+    {
+        if (!fDbEnvInit)
+            return;
+        int ret = dbenv.log_flush(NULL);
+        if (ret != 0)
+            printf("DBLogFlush() : log_flush failed %d\n", ret);
+    }
+}
+
 
 
 
@@ -840,10 +853,10 @@ bool CTxDB::ReadOwnerTxes(uint160 hash160, int nMinHeight, vector<CTransaction>&
     loop
     {
         // Read next record
-        CDataStream ssKey;
+        CPublicDataStream ssKey;
         if (fFlags == DB_SET_RANGE)
             ssKey << string("owner") << hash160 << CDiskTxPos(0, 0, 0);
-        CDataStream ssValue;
+        CPublicDataStream ssValue;
         int ret = ReadAtCursor(pcursor, ssKey, ssValue, fFlags);
         fFlags = DB_NEXT;
         if (ret == DB_NOTFOUND)
@@ -880,6 +893,199 @@ bool CTxDB::ReadOwnerTxes(uint160 hash160, int nMinHeight, vector<CTransaction>&
     return true;
 }
 
+bool CTxDB::ReadAddrOutput(const COutPoint& outpoint, CAddrIndexKey& keyRet, int64& nValueRet)
+{
+    pair<CAddrIndexKey, int64> value;
+    if (!Read(make_pair(string("addrout"), outpoint), value))
+        return false;
+    keyRet = value.first;
+    nValueRet = value.second;
+    return true;
+}
+
+bool CTxDB::WriteAddrOutput(const COutPoint& outpoint, const CAddrIndexKey& key, int64 nValue)
+{
+    return Write(make_pair(string("addrout"), outpoint), make_pair(key, nValue));
+}
+
+bool CTxDB::EraseAddrOutput(const COutPoint& outpoint)
+{
+    return Erase(make_pair(string("addrout"), outpoint));
+}
+
+bool CTxDB::WriteAddrUnspent(const CAddrIndexKey& key, unsigned int n, int64 nValue)
+{
+    return Write(make_pair(string("addrutxo"), make_pair(key, n)), nValue);
+}
+
+bool CTxDB::EraseAddrUnspent(const CAddrIndexKey& key, unsigned int n)
+{
+    return Erase(make_pair(string("addrutxo"), make_pair(key, n)));
+}
+
+bool CTxDB::ReadAddrUnspent(uint160 hash160, int nMinHeight, int nMaxHeight, vector<CAddrUnspent>& vRet)
+{
+    vRet.clear();
+
+    Dbc* pcursor = GetCursor();
+    if (!pcursor)
+        return false;
+
+    unsigned int fFlags = DB_SET_RANGE;
+    loop
+    {
+        CPublicDataStream ssKey;
+        if (fFlags == DB_SET_RANGE)
+            ssKey << string("addrutxo") << CAddrIndexKey(hash160, nMinHeight, 0);
+        CPublicDataStream ssValue;
+        int ret = ReadAtCursor(pcursor, ssKey, ssValue, fFlags);
+        fFlags = DB_NEXT;
+        if (ret == DB_NOTFOUND)
+            break;
+        else if (ret != 0)
+        {
+            pcursor->close();
+            return false;
+        }
+
+        string strType;
+        ssKey >> strType;
+        if (strType != "addrutxo")
+            break;
+        CAddrUnspent unspent;
+        ssKey >> unspent.key >> unspent.n;
+        if (unspent.key.hash160 != hash160 || unspent.key.nHeight > nMaxHeight)
+            break;
+        ssValue >> unspent.nValue;
+        vRet.push_back(unspent);
+    }
+
+    pcursor->close();
+    return true;
+}
+
+bool CTxDB::WriteAddrHistory(const CAddrIndexKey& key, int64 nChange)
+{
+    return Write(make_pair(string("addrhist"), key), nChange);
+}
+
+bool CTxDB::EraseAddrHistory(const CAddrIndexKey& key)
+{
+    return Erase(make_pair(string("addrhist"), key));
+}
+
+bool CTxDB::ReadAddrHistory(uint160 hash160, int nMinHeight, int nMaxHeight, vector<pair<CAddrIndexKey, int64> >& vRet)
+{
+    vRet.clear();
+
+    Dbc* pcursor = GetCursor();
+    if (!pcursor)
+        return false;
+
+    unsigned int fFlags = DB_SET_RANGE;
+    loop
+    {
+        CPublicDataStream ssKey;
+        if (fFlags == DB_SET_RANGE)
+            ssKey << string("addrhist") << CAddrIndexKey(hash160, nMinHeight, 0);
+        CPublicDataStream ssValue;
+        int ret = ReadAtCursor(pcursor, ssKey, ssValue, fFlags);
+        fFlags = DB_NEXT;
+        if (ret == DB_NOTFOUND)
+            break;
+        else if (ret != 0)
+        {
+            pcursor->close();
+            return false;
+        }
+
+        string strType;
+        CAddrIndexKey key;
+        ssKey >> strType;
+        if (strType != "addrhist")
+            break;
+        ssKey >> key;
+        if (key.hash160 != hash160 || key.nHeight > nMaxHeight)
+            break;
+        int64 nChange;
+        ssValue >> nChange;
+        vRet.push_back(make_pair(key, nChange));
+    }
+
+    pcursor->close();
+    return true;
+}
+
+bool CTxDB::ReadAddrBalance(uint160 hash160, CAddrBalance& balance)
+{
+    balance = CAddrBalance();
+    return Read(make_pair(string("addrbal"), hash160), balance);
+}
+
+bool CTxDB::WriteAddrBalance(uint160 hash160, const CAddrBalance& balance)
+{
+    if (balance.nBalance == 0 && balance.nReceived == 0)
+        return Erase(make_pair(string("addrbal"), hash160));
+    return Write(make_pair(string("addrbal"), hash160), balance);
+}
+
+bool CTxDB::ReadAddrIndexTip(uint256& hashTip)
+{
+    return Read(string("addrIndexTip"), hashTip);
+}
+
+bool CTxDB::WriteAddrIndexTip(uint256 hashTip)
+{
+    return Write(string("addrIndexTip"), hashTip);
+}
+
+bool CTxDB::EraseAddrIndex()
+{
+    const char* pszTypes[] = { "addrhist", "addrutxo", "addrout", "addrbal" };
+    for (int i = 0; i < ARRAYLEN(pszTypes); i++)
+    {
+        // Collect a batch of keys then delete them, the cursor can't stay
+        // open across the deletes
+        loop
+        {
+            Dbc* pcursor = GetCursor();
+            if (!pcursor)
+                return false;
+            vector<vector<char> > vKeys;
+            unsigned int fFlags = DB_SET_RANGE;
+            while (vKeys.size() < 10000)
+            {
+                CPublicDataStream ssKey;
+                if (fFlags == DB_SET_RANGE)
+                    ssKey << string(pszTypes[i]);
+                CPublicDataStream ssValue;
+                int ret = ReadAtCursor(pcursor, ssKey, ssValue, fFlags);
+                fFlags = DB_NEXT;
+                if (ret != 0)
+                    break;
+                vector<char> vchKey(ssKey.begin(), ssKey.end());
+                string strType;
+                ssKey >> strType;
+                if (strType != pszTypes[i])
+                    break;
+                vKeys.push_back(vchKey);
+            }
+            pcursor->close();
+            if (vKeys.empty())
+                break;
+
+            foreach(vector<char>& vchKey, vKeys)
+            {
+                Dbt datKey(&vchKey[0], vchKey.size());
+                int ret = pdb->del(GetTxn(), &datKey, 0);
+                if (ret != 0 && ret != DB_NOTFOUND)
+                    return false;
+            }
+        }
+    }
+    return Erase(string("addrIndexTip"));
+}
+
 bool CTxDB::ReadDiskTx(uint256 hash, CTransaction& tx, CTxIndex& txindex)
 {
     assert(!fClient);
@@ -926,6 +1132,92 @@ bool CTxDB::WriteHashBestChain(uint256 hashBestChain)
     return Write(string("hashBestChain"), hashBestChain);
 }
 
+bool CTxDB::ReadDurableTip(uint256& hashDurableTip)
+{
+    return Read(string("hashDurableTip"), hashDurableTip);
+}
+
+bool CTxDB::WriteDurableTip(uint256 hashDurableTip)
+{
+    return Write(string("hashDurableTip"), hashDurableTip);
+}
+
+bool CTxDB::EraseDurableTip()
+{
+    return Erase(string("hashDurableTip"));
+}
+
+bool CTxDB::EraseTxIndexAtBlocks(const set<pair<unsigned int, unsigned int> >& setBlockPos)
+{
+    assert(!fClient);
+
+    // Used by crash recovery when a block's data didn't make it to disk
+    // but its tx index did.  Without the block we can't DisconnectInputs,
+    // so find its transactions and the spends they made by disk position.
+    vector<uint256> vErase;
+    vector<pair<uint256, CTxIndex> > vUpdate;
+
+    Dbc* pcursor = GetCursor();
+    if (!pcursor)
+        return false;
+
+    unsigned int fFlags = DB_SET_RANGE;
+    loop
+    {
+        CPublicDataStream ssKey;
+        if (fFlags == DB_SET_RANGE)
+            ssKey << make_pair(string("tx"), uint256(0));
+        CPublicDataStream ssValue;
+        int ret = ReadAtCursor(pcursor, ssKey, ssValue, fFlags);
+        fFlags = DB_NEXT;
+        if (ret == DB_NOTFOUND)
+            break;
+        else if (ret != 0)
+        {
+            pcursor->close();
+            return false;
+        }
+
+        string strType;
+        ssKey >> strType;
+        if (strType != "tx")
+            break;
+        uint256 hash;
+        ssKey >> hash;
+        CTxIndex txindex;
+        ssValue >> txindex;
+
+        if (setBlockPos.count(make_pair(txindex.pos.nFile, txindex.pos.nBlockPos)))
+        {
+            vErase.push_back(hash);
+            continue;
+        }
+
+        bool fChanged = false;
+        foreach(CDiskTxPos& pos, txindex.vSpent)
+        {
+            if (!pos.IsNull() && setBlockPos.count(make_pair(pos.nFile, pos.nBlockPos)))
+            {
+                pos.SetNull();
+                fChanged = true;
+            }
+        }
+        if (fChanged)
+            vUpdate.push_back(make_pair(hash, txindex));
+    }
+    pcursor->close();
+
+    foreach(const uint256& hash, vErase)
+        if (!Erase(make_pair(string("tx"), hash)))
+            return false;
+    foreach(const PAIRTYPE(uint256, CTxIndex)& item, vUpdate)
+        if (!UpdateTxIndex(item.first, item.second))
+            return false;
+
+    printf("EraseTxIndexAtBlocks() : erased %d, updated %d\n", (int)vErase.size(), (int)vUpdate.size());
+    return true;
+}
+
 CBlockIndex* InsertBlockIndex(uint256 hash)
 {
     if (hash == 0)
@@ -937,17 +1229,15 @@ CBlockIndex* InsertBlockIndex(uint256 hash)
         return (*mi).second;
 
     // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("LoadBlockIndex() : new CBlockIndex failed");
-    mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
-    pindexNew->phashBlock = &((*mi).first);
-
-    return pindexNew;
+    return mapBlockIndex.insert(hash, CBlockIndex());
 }
 
 bool CTxDB::LoadBlockIndex()
 {
+    // Use the snapshot from the last clean shutdown if it's still current
+    if (LoadBlockIndexSnapshot())
+        return true;
+
     // Get cursor
     Dbc* pcursor = GetCursor();
     if (!pcursor)
@@ -957,10 +1247,10 @@ bool CTxDB::LoadBlockIndex()
     loop
     {
         // Read next record
-        CDataStream ssKey;
+        CPublicDataStream ssKey;
         if (fFlags == DB_SET_RANGE)
             ssKey << make_pair(string("blockindex"), uint256(0));
-        CDataStream ssValue;
+        CPublicDataStream ssValue;
         int ret = ReadAtCursor(pcursor, ssKey, ssValue, fFlags);
         fFlags = DB_NEXT;
         if (ret == DB_NOTFOUND)
@@ -999,6 +1289,7 @@ bool CTxDB::LoadBlockIndex()
         }
     }
     pcursor->close();
+    BuildSkipPointers();
 
     if (!ReadHashBestChain(hashBestChain))
     {
@@ -1007,10 +1298,12 @@ bool CTxDB::LoadBlockIndex()
         return error("CTxDB::LoadBlockIndex() : hashBestChain not found");
     }
 
-    if (!mapBlockIndex.count(hashBestChain))
+    auto mi = mapBlockIndex.find(hashBestChain);
+    if (mi == mapBlockIndex.end())
         return error("CTxDB::LoadBlockIndex() : blockindex for hashBestChain not found");
-    pindexBest = mapBlockIndex[hashBestChain];
+    pindexBest = (*mi).second;
     nBestHeight = pindexBest->nHeight;
+    SetBlockIndexByHeight(pindexBest);
     printf("LoadBlockIndex(): hashBestChain=%s  height=%d\n", hashBestChain.ToString().substr(0,16).c_str(), nBestHeight);
 
     return true;
@@ -1018,81 +1311,302 @@ bool CTxDB::LoadBlockIndex()
 
 
 
-
-
 //
-// CAddrDB
+// Block index snapshot
 //
+// Written at clean shutdown so the next startup can rebuild mapBlockIndex
+// from one sequential file instead of a cursor scan over every blockindex
+// record.  Records are stored in mapBlockIndex iteration order with pprev
+// as a record number, so the rebuild needs no lookups.  The "snapshot" key in
+// blkindex.dat holds the file's checksum and is erased as soon as the
+// snapshot is used, so any later change to the index makes it stale.
+//
+
+#pragma pack(push, 1)
+struct CBlockIndexSnapshotHeader
+{
+    char pchMagic[8];
+    unsigned int nVersion;
+    unsigned int nCount;
+    unsigned char hashBestChain[32];
+};
 
-bool CAddrDB::WriteAddress(const CAddress& addr)
+struct CBlockIndexSnapshotRecord
+{
+    unsigned char hashBlock[32];
+    int nPrev;
+    unsigned int nFile;
+    unsigned int nBlockPos;
+    int nHeight;
+    int nVersion;
+    unsigned char hashMerkleRoot[32];
+    unsigned int nTime;
+    unsigned int nBits;
+    unsigned int nNonce;
+};
+#pragma pack(pop)
+
+static const char pchSnapshotMagic[8] = { 'b', 'i', 't', 'o', 'k', 'i', 'd', 'x' };
+static const unsigned int SNAPSHOT_VERSION = 1;
+
+static string GetSnapshotPath()
 {
-    return Write(make_pair(string("addr"), addr.GetKey()), addr);
+    return GetDataDir() + "/blkindex.snapshot";
 }
 
-bool CAddrDB::LoadAddresses()
+bool CTxDB::WriteBlockIndexSnapshot()
+{
+    if (fClient || pindexBest == NULL)
+        return false;
+    int64 nStart = GetTimeMillis();
+
+    map<CBlockIndex*, int> mapRecord;
+    int n = 0;
+    for (auto mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        mapRecord[(*mi).second] = n++;
+
+    vector<unsigned char> vch(sizeof(CBlockIndexSnapshotHeader) + n * sizeof(CBlockIndexSnapshotRecord));
+    CBlockIndexSnapshotHeader* pheader = (CBlockIndexSnapshotHeader*)&vch[0];
+    memcpy(pheader->pchMagic, pchSnapshotMagic, sizeof(pheader->pchMagic));
+    pheader->nVersion = SNAPSHOT_VERSION;
+    pheader->nCount = n;
+    memcpy(pheader->hashBestChain, BEGIN(hashBestChain), 32);
+
+    CBlockIndexSnapshotRecord* prec = (CBlockIndexSnapshotRecord*)(pheader + 1);
+    for (auto mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi, ++prec)
+    {
+        CBlockIndex* pindex = (*mi).second;
+        memcpy(prec->hashBlock, BEGIN((*mi).first), 32);
+        prec->nPrev = (pindex->pprev ? mapRecord[pindex->pprev] : -1);
+        prec->nFile = pindex->nFile;
+        prec->nBlockPos = pindex->nBlockPos;
+        prec->nHeight = pindex->nHeight;
+        prec->nVersion = pindex->nVersion;
+        memcpy(prec->hashMerkleRoot, BEGIN(pindex->hashMerkleRoot), 32);
+        prec->nTime = pindex->nTime;
+        prec->nBits = pindex->nBits;
+        prec->nNonce = pindex->nNonce;
+    }
+    uint256 hashChecksum = Hash(vch.begin(), vch.end());
+
+    // Write to a temp file and rename so a partial file is never picked up
+    string strFile = GetSnapshotPath();
+    string strTmp = strFile + ".new";
+    FILE* file = fopen(strTmp.c_str(), "wb");
+    if (!file)
+        return error("WriteBlockIndexSnapshot() : open %s failed", strTmp.c_str());
+    bool fOk = (fwrite(&vch[0], 1, vch.size(), file) == vch.size() &&
+                fwrite(BEGIN(hashChecksum), 1, 32, file) == 32);
+    FileCommit(file);
+    fclose(file);
+    if (!fOk)
+    {
+        unlink(strTmp.c_str());
+        return error("WriteBlockIndexSnapshot() : write failed");
+    }
+    unlink(strFile.c_str());
+    if (rename(strTmp.c_str(), strFile.c_str()) != 0)
+        return error("WriteBlockIndexSnapshot() : rename failed");
+
+    if (!Write(string("snapshot"), hashChecksum))
+        return error("WriteBlockIndexSnapshot() : writing snapshot key failed");
+
+    printf("WriteBlockIndexSnapshot() : %d entries %" PRI64d "ms\n", n, GetTimeMillis() - nStart);
+    return true;
+}
+
+bool CTxDB::LoadBlockIndexSnapshot()
+{
+    uint256 hashExpected;
+    if (fClient || fReadOnly || !Read(string("snapshot"), hashExpected))
+        return false;
+
+    // Whatever happens the snapshot is only good for this one load
+    Erase(string("snapshot"));
+
+    string strFile = GetSnapshotPath();
+    FILE* file = fopen(strFile.c_str(), "rb");
+    if (!file)
+        return false;
+    int nSize = GetFilesize(file);
+    if (nSize < (int)(sizeof(CBlockIndexSnapshotHeader) + 32))
+    {
+        fclose(file);
+        return error("LoadBlockIndexSnapshot() : file too small");
+    }
+
+#if defined(_WIN32) || defined(__MINGW32__) || defined(__WXMSW__)
+    vector<unsigned char> vchBuffer(nSize);
+    bool fRead = (fread(&vchBuffer[0], 1, nSize, file) == nSize);
+    fclose(file);
+    if (!fRead)
+        return error("LoadBlockIndexSnapshot() : read failed");
+    const unsigned char* pbegin = &vchBuffer[0];
+#else
+    void* pmap = mmap(NULL, nSize, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+    fclose(file);
+    if (pmap == MAP_FAILED)
+        return error("LoadBlockIndexSnapshot() : mmap failed");
+    madvise(pmap, nSize, MADV_SEQUENTIAL);
+    const unsigned char* pbegin = (const unsigned char*)pmap;
+#endif
+
+    bool fOk = LoadBlockIndexSnapshot(pbegin, nSize, hashExpected);
+
+#if !defined(_WIN32) && !defined(__MINGW32__) && !defined(__WXMSW__)
+    munmap(pmap, nSize);
+#endif
+    unlink(strFile.c_str());
+    return fOk;
+}
+
+bool CTxDB::LoadBlockIndexSnapshot(const unsigned char* pbegin, unsigned int nSize, const uint256& hashExpected)
 {
-    CRITICAL_BLOCK(cs_mapAddresses)
+    int64 nStart = GetTimeMillis();
+    const unsigned char* pend = pbegin + nSize - 32;
+
+    uint256 hashChecksum;
+    memcpy(BEGIN(hashChecksum), pend, 32);
+    if (hashChecksum != hashExpected || Hash(pbegin, pend) != hashChecksum)
+        return error("LoadBlockIndexSnapshot() : checksum mismatch");
+
+    const CBlockIndexSnapshotHeader* pheader = (const CBlockIndexSnapshotHeader*)pbegin;
+    if (memcmp(pheader->pchMagic, pchSnapshotMagic, sizeof(pchSnapshotMagic)) != 0 || pheader->nVersion != SNAPSHOT_VERSION)
+        return error("LoadBlockIndexSnapshot() : unknown format");
+    unsigned int nCount = pheader->nCount;
+    if (nSize != sizeof(CBlockIndexSnapshotHeader) + nCount * sizeof(CBlockIndexSnapshotRecord) + 32)
+        return error("LoadBlockIndexSnapshot() : size mismatch");
+
+    uint256 hashBest;
+    memcpy(BEGIN(hashBest), pheader->hashBestChain, 32);
+    uint256 hashBestDB;
+    if (!ReadHashBestChain(hashBestDB) || hashBestDB != hashBest)
+        return error("LoadBlockIndexSnapshot() : stale, hashBestChain doesn't match");
+
+    const CBlockIndexSnapshotRecord* precBegin = (const CBlockIndexSnapshotRecord*)(pheader + 1);
+    vector<CBlockIndex*> vIndex;
+    vIndex.reserve(nCount);
+    mapBlockIndex.reserve(nCount);
+    for (unsigned int i = 0; i < nCount; i++)
     {
-        // Load user provided addresses
-        CAutoFile filein = fopen((GetDataDir() + "/addr.txt").c_str(), "rt");
-        if (filein)
+        const CBlockIndexSnapshotRecord* prec = precBegin + i;
+        uint256 hash;
+        memcpy(BEGIN(hash), prec->hashBlock, 32);
+        unsigned int nSizePrev = mapBlockIndex.size();
+        CBlockIndex* pindexNew = mapBlockIndex.insert(hash, CBlockIndex());
+        if (prec->nPrev >= (int)nCount || mapBlockIndex.size() == nSizePrev)
         {
-            try
-            {
-                char psz[1000];
-                while (fgets(psz, sizeof(psz), filein))
-                {
-                    CAddress addr(psz, NODE_NETWORK);
-                    addr.nTime = 0; // so it won't relay unless successfully connected
-                    if (addr.IsValid())
-                        AddAddress(addr);
-                }
-            }
-            catch (...) { }
+            mapBlockIndex.clear();
+            return error("LoadBlockIndexSnapshot() : bad record %u", i);
         }
 
-        // Get cursor
-        Dbc* pcursor = GetCursor();
-        if (!pcursor)
-            return false;
+        pindexNew->nFile     = prec->nFile;
+        pindexNew->nBlockPos = prec->nBlockPos;
+        pindexNew->nHeight   = prec->nHeight;
+        pindexNew->nVersion  = prec->nVersion;
+        memcpy(BEGIN(pindexNew->hashMerkleRoot), prec->hashMerkleRoot, 32);
+        pindexNew->nTime     = prec->nTime;
+        pindexNew->nBits     = prec->nBits;
+        pindexNew->nNonce    = prec->nNonce;
+        vIndex.push_back(pindexNew);
+    }
+    for (unsigned int i = 0; i < nCount; i++)
+        if (precBegin[i].nPrev >= 0)
+            vIndex[i]->pprev = vIndex[precBegin[i].nPrev];
+    BuildSkipPointers();
+
+    auto mi = mapBlockIndex.find(hashGenesisBlock);
+    if (mi != mapBlockIndex.end())
+        pindexGenesisBlock = (*mi).second;
+    mi = mapBlockIndex.find(hashBest);
+    if (mi == mapBlockIndex.end())
+    {
+        mapBlockIndex.clear();
+        pindexGenesisBlock = NULL;
+        return error("LoadBlockIndexSnapshot() : blockindex for hashBestChain not found");
+    }
+
+    // Only the main chain has next pointers
+    hashBestChain = hashBest;
+    pindexBest = (*mi).second;
+    nBestHeight = pindexBest->nHeight;
+    for (CBlockIndex* pindex = pindexBest; pindex->pprev; pindex = pindex->pprev)
+        pindex->pprev->pnext = pindex;
+    SetBlockIndexByHeight(pindexBest);
+
+    printf("LoadBlockIndexSnapshot(): %u entries %" PRI64d "ms, hashBestChain=%s  height=%d\n", nCount,
+        GetTimeMillis() - nStart, hashBestChain.ToString().substr(0,16).c_str(), nBestHeight);
+    return true;
+}
+
 
-        loop
-        {
-            // Read next record
-            CDataStream ssKey;
-            CDataStream ssValue;
-            int ret = ReadAtCursor(pcursor, ssKey, ssValue);
-            if (ret == DB_NOTFOUND)
-                break;
-            else if (ret != 0)
-                return false;
 
-            // Unserialize
-            string strType;
-            ssKey >> strType;
-            if (strType == "addr")
-            {
-                CAddress addr;
-                ssValue >> addr;
-                mapAddresses.insert(make_pair(addr.GetKey(), addr));
-            }
-        }
-        pcursor->close();
 
-        printf("Loaded %d addresses\n", mapAddresses.size());
 
-        // Fix for possible bug that manifests in mapAddresses.count in irc.cpp,
-        // just need to call count here and it doesn't happen there.  The bug was the
-        // pack pragma in irc.cpp and has been fixed, but I'm not in a hurry to delete this.
-        mapAddresses.count(vector<unsigned char>(18));
+//
+// CAddrDB
+//
+
+bool CAddrDB::LoadAddresses()
+{
+    // Addresses now live in peers.dat, this only imports an old addr.dat
+    Dbc* pcursor = GetCursor();
+    if (!pcursor)
+        return false;
+
+    int nCount = 0;
+    loop
+    {
+        // Read next record
+        CPublicDataStream ssKey;
+        CPublicDataStream ssValue;
+        int ret = ReadAtCursor(pcursor, ssKey, ssValue);
+        if (ret == DB_NOTFOUND)
+            break;
+        else if (ret != 0)
+            return false;
+
+        // Unserialize
+        string strType;
+        ssKey >> strType;
+        if (strType == "addr")
+        {
+            CAddress addr;
+            ssValue >> addr;
+            if (AddAddress(addr))
+                nCount++;
+        }
     }
+    pcursor->close();
 
+    printf("Imported %d addresses from addr.dat\n", nCount);
     return true;
 }
 
 bool LoadAddresses()
 {
-    return CAddrDB("cr+").LoadAddresses();
+    if (!addrman.Read(GetDataDir() + "/peers.dat"))
+        if (!CAddrDB("cr+").LoadAddresses())
+            return false;
+
+    // Load user provided addresses
+    CAutoFile filein = fopen((GetDataDir() + "/addr.txt").c_str(), "rt");
+    if (filein)
+    {
+        try
+        {
+            char psz[1000];
+            while (fgets(psz, sizeof(psz), filein))
+            {
+                CAddress addr(psz, NODE_NETWORK);
+                addr.nTime = 0; // so it won't relay unless successfully connected
+                if (addr.IsValid())
+                    AddAddress(addr);
+            }
+        }
+        catch (...) { }
+    }
+    return true;
 }
 
 
@@ -1154,6 +1668,7 @@ bool CWalletDB::LoadWallet()
 
                 if (wtx.GetHash() != hash)
                     printf("Error in wallet.dat, hash mismatch\n");
+                AddToWalletIndexes(hash, wtx);
 
                 //// debug print
                 //printf("LoadWallet  %s\n", wtx.GetHash().ToString().c_str());
@@ -1212,6 +1727,9 @@ bool CWalletDB::LoadWallet()
             }
         }
         pcursor->close();
+
+        // Balance is counted again from the loaded txes on first use
+        InvalidateWalletBalance();
     }
 
     printf("nFileVersion = %d\n", nFileVersion);
@@ -1280,7 +1798,8 @@ void ThreadFlushWalletDB(void* parg)
     if (fOneThread)
         return;
     fOneThread = true;
-    if (GetBoolArg("-noflushwallet"))
+    bool fFlushWallet = !GetBoolArg("-noflushwallet");
+    if (!fFlushWallet && !fBatchedDBSync)
         return;
 
     unsigned int nLastSeen = nWalletDBUpdated;
@@ -1290,6 +1809,13 @@ void ThreadFlushWalletDB(void* parg)
     {
         Sleep(500);
 
+        // Batched -dbsync needs the time limit enforced even when no blocks come in
+        TRY_CRITICAL_BLOCK(cs_main)
+            FlushBlockStore();
+
+        if (!fFlushWallet)
+            continue;
+
         if (nLastSeen != nWalletDBUpdated)
         {
             nLastSeen = nWalletDBUpdated;
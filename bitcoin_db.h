@@ -16,6 +16,7 @@ extern map<string, string> mapAddressBook;
 extern CCriticalSection cs_mapAddressBook;
 extern vector<unsigned char> vchDefaultKey;
 extern bool fClient;
+extern bool fBatchedDBSync;
 
 
 
@@ -24,6 +25,7 @@ extern DbEnv dbenv;
 
 
 extern void DBFlush(bool fShutdown);
+extern void DBLogFlush();
 extern bool RecoverDatabaseEnvironment();
 extern bool RecoverWalletKeys();
 
@@ -37,6 +39,8 @@ protected:
     string strFile;
     vector<DbTxn*> vTxn;
     bool fReadOnly;
+    bool fTxnNoSync;
+    bool fSecure;
 
     explicit CDB(const char* pszFile, const char* pszMode="r+");
     ~CDB() { Close(); }
@@ -47,14 +51,47 @@ private:
     void operator=(const CDB&);
 
 protected:
+    // Buffers are wiped unless the store opts out as holding only public data
     template<typename K, typename T>
     bool Read(const K& key, T& value)
+    {
+        if (fSecure)
+            return DoRead<CDataStream>(key, value);
+        return DoRead<CPublicDataStream>(key, value);
+    }
+
+    template<typename K, typename T>
+    bool Write(const K& key, const T& value, bool fOverwrite=true)
+    {
+        if (fSecure)
+            return DoWrite<CDataStream>(key, value, fOverwrite);
+        return DoWrite<CPublicDataStream>(key, value, fOverwrite);
+    }
+
+    template<typename K>
+    bool Erase(const K& key)
+    {
+        if (fSecure)
+            return DoErase<CDataStream>(key);
+        return DoErase<CPublicDataStream>(key);
+    }
+
+    template<typename K>
+    bool Exists(const K& key)
+    {
+        if (fSecure)
+            return DoExists<CDataStream>(key);
+        return DoExists<CPublicDataStream>(key);
+    }
+
+    template<typename Stream, typename K, typename T>
+    bool DoRead(const K& key, T& value)
     {
         if (!pdb)
             return false;
 
         // Key
-        CDataStream ssKey(SER_DISK);
+        Stream ssKey(SER_DISK);
         ssKey.reserve(1000);
         ssKey << key;
         Dbt datKey(&ssKey[0], ssKey.size());
@@ -63,22 +100,24 @@ protected:
         Dbt datValue;
         datValue.set_flags(DB_DBT_MALLOC);
         int ret = pdb->get(GetTxn(), &datKey, &datValue, 0);
-        memset(datKey.get_data(), 0, datKey.get_size());
+        if (fSecure)
+            memset(datKey.get_data(), 0, datKey.get_size());
         if (datValue.get_data() == NULL)
             return false;
 
         // Unserialize value
-        CDataStream ssValue((char*)datValue.get_data(), (char*)datValue.get_data() + datValue.get_size(), SER_DISK);
+        Stream ssValue((char*)datValue.get_data(), (char*)datValue.get_data() + datValue.get_size(), SER_DISK);
         ssValue >> value;
 
         // Clear and free memory
-        memset(datValue.get_data(), 0, datValue.get_size());
+        if (fSecure)
+            memset(datValue.get_data(), 0, datValue.get_size());
         free(datValue.get_data());
         return (ret == 0);
     }
 
-    template<typename K, typename T>
-    bool Write(const K& key, const T& value, bool fOverwrite=true)
+    template<typename Stream, typename K, typename T>
+    bool DoWrite(const K& key, const T& value, bool fOverwrite=true)
     {
         if (!pdb)
             return false;
@@ -86,13 +125,13 @@ protected:
             assert(("Write called on database in read-only mode", false));
 
         // Key
-        CDataStream ssKey(SER_DISK);
+        Stream ssKey(SER_DISK);
         ssKey.reserve(1000);
         ssKey << key;
         Dbt datKey(&ssKey[0], ssKey.size());
 
         // Value
-        CDataStream ssValue(SER_DISK);
+        Stream ssValue(SER_DISK);
         ssValue.reserve(10000);
         ssValue << value;
         Dbt datValue(&ssValue[0], ssValue.size());
@@ -101,13 +140,16 @@ protected:
         int ret = pdb->put(GetTxn(), &datKey, &datValue, (fOverwrite ? 0 : DB_NOOVERWRITE));
 
         // Clear memory in case it was a private key
-        memset(datKey.get_data(), 0, datKey.get_size());
-        memset(datValue.get_data(), 0, datValue.get_size());
+        if (fSecure)
+        {
+            memset(datKey.get_data(), 0, datKey.get_size());
+            memset(datValue.get_data(), 0, datValue.get_size());
+        }
         return (ret == 0);
     }
 
-    template<typename K>
-    bool Erase(const K& key)
+    template<typename Stream, typename K>
+    bool DoErase(const K& key)
     {
         if (!pdb)
             return false;
@@ -115,7 +157,7 @@ protected:
             assert(("Erase called on database in read-only mode", false));
 
         // Key
-        CDataStream ssKey(SER_DISK);
+        Stream ssKey(SER_DISK);
         ssKey.reserve(1000);
         ssKey << key;
         Dbt datKey(&ssKey[0], ssKey.size());
@@ -124,18 +166,19 @@ protected:
         int ret = pdb->del(GetTxn(), &datKey, 0);
 
         // Clear memory
-        memset(datKey.get_data(), 0, datKey.get_size());
+        if (fSecure)
+            memset(datKey.get_data(), 0, datKey.get_size());
         return (ret == 0 || ret == DB_NOTFOUND);
     }
 
-    template<typename K>
-    bool Exists(const K& key)
+    template<typename Stream, typename K>
+    bool DoExists(const K& key)
     {
         if (!pdb)
             return false;
 
         // Key
-        CDataStream ssKey(SER_DISK);
+        Stream ssKey(SER_DISK);
         ssKey.reserve(1000);
         ssKey << key;
         Dbt datKey(&ssKey[0], ssKey.size());
@@ -144,7 +187,8 @@ protected:
         int ret = pdb->exists(GetTxn(), &datKey, 0);
 
         // Clear memory
-        memset(datKey.get_data(), 0, datKey.get_size());
+        if (fSecure)
+            memset(datKey.get_data(), 0, datKey.get_size());
         return (ret == 0);
     }
 
@@ -159,7 +203,8 @@ protected:
         return pcursor;
     }
 
-    int ReadAtCursor(Dbc* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags=DB_NEXT)
+    template<typename Stream>
+    int ReadAtCursor(Dbc* pcursor, Stream& ssKey, Stream& ssValue, unsigned int fFlags=DB_NEXT)
     {
         // Read at cursor
         Dbt datKey;
@@ -191,8 +236,11 @@ protected:
         ssValue.write((char*)datValue.get_data(), datValue.get_size());
 
         // Clear and free memory
-        memset(datKey.get_data(), 0, datKey.get_size());
-        memset(datValue.get_data(), 0, datValue.get_size());
+        if (fSecure)
+        {
+            memset(datKey.get_data(), 0, datKey.get_size());
+            memset(datValue.get_data(), 0, datValue.get_size());
+        }
         free(datKey.get_data());
         free(datValue.get_data());
         return 0;
@@ -225,7 +273,7 @@ public:
             return false;
         if (vTxn.empty())
             return false;
-        int ret = vTxn.back()->commit(0);
+        int ret = vTxn.back()->commit(fTxnNoSync ? DB_TXN_NOSYNC : 0);
         vTxn.pop_back();
         return (ret == 0);
     }
@@ -260,10 +308,89 @@ public:
 
 
 
+//
+// Address index, only kept with -addrindex.  An address's records are
+// keyed by hash160 then height, the height stored big-endian so that a
+// cursor walks them in height order.
+//  ("addrhist", key) -> net change the tx made to the address
+//  ("addrutxo", key, n) -> value of unspent output n
+//  ("addrout", outpoint) -> key and value, kept after the output is spent
+//                           so the spend can be undone
+//  ("addrbal", hash160) -> CAddrBalance
+//
+class CAddrIndexKey
+{
+public:
+    uint160 hash160;
+    int nHeight;
+    uint256 hashTx;
+
+    CAddrIndexKey()
+    {
+        hash160 = 0;
+        nHeight = 0;
+        hashTx = 0;
+    }
+
+    CAddrIndexKey(uint160 hash160In, int nHeightIn, uint256 hashTxIn)
+    {
+        hash160 = hash160In;
+        nHeight = nHeightIn;
+        hashTx = hashTxIn;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(hash160);
+        unsigned char pchHeight[4];
+        if (!fRead)
+        {
+            pchHeight[0] = (nHeight >> 24) & 0xff;
+            pchHeight[1] = (nHeight >> 16) & 0xff;
+            pchHeight[2] = (nHeight >> 8) & 0xff;
+            pchHeight[3] = nHeight & 0xff;
+        }
+        READWRITE(FLATDATA(pchHeight));
+        if (fRead)
+            const_cast<int&>(nHeight) = (pchHeight[0] << 24) | (pchHeight[1] << 16) | (pchHeight[2] << 8) | pchHeight[3];
+        READWRITE(hashTx);
+    )
+};
+
+class CAddrUnspent
+{
+public:
+    CAddrIndexKey key;
+    unsigned int n;
+    int64 nValue;
+};
+
+class CAddrBalance
+{
+public:
+    int64 nBalance;
+    int64 nReceived;
+
+    CAddrBalance()
+    {
+        nBalance = 0;
+        nReceived = 0;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nBalance);
+        READWRITE(nReceived);
+    )
+};
+
+
+
+
 class CTxDB : public CDB
 {
 public:
-    CTxDB(const char* pszMode="r+") : CDB(!fClient ? "blkindex.dat" : NULL, pszMode) { }
+    CTxDB(const char* pszMode="r+") : CDB(!fClient ? "blkindex.dat" : NULL, pszMode) { fTxnNoSync = fBatchedDBSync; fSecure = false; }
 private:
     CTxDB(const CTxDB&);
     void operator=(const CTxDB&);
@@ -274,6 +401,20 @@ public:
     bool EraseTxIndex(const CTransaction& tx);
     bool ContainsTx(uint256 hash);
     bool ReadOwnerTxes(uint160 hash160, int nHeight, vector<CTransaction>& vtx);
+    bool ReadAddrOutput(const COutPoint& outpoint, CAddrIndexKey& keyRet, int64& nValueRet);
+    bool WriteAddrOutput(const COutPoint& outpoint, const CAddrIndexKey& key, int64 nValue);
+    bool EraseAddrOutput(const COutPoint& outpoint);
+    bool WriteAddrUnspent(const CAddrIndexKey& key, unsigned int n, int64 nValue);
+    bool EraseAddrUnspent(const CAddrIndexKey& key, unsigned int n);
+    bool ReadAddrUnspent(uint160 hash160, int nMinHeight, int nMaxHeight, vector<CAddrUnspent>& vRet);
+    bool WriteAddrHistory(const CAddrIndexKey& key, int64 nChange);
+    bool EraseAddrHistory(const CAddrIndexKey& key);
+    bool ReadAddrHistory(uint160 hash160, int nMinHeight, int nMaxHeight, vector<pair<CAddrIndexKey, int64> >& vRet);
+    bool ReadAddrBalance(uint160 hash160, CAddrBalance& balance);
+    bool WriteAddrBalance(uint160 hash160, const CAddrBalance& balance);
+    bool ReadAddrIndexTip(uint256& hashTip);
+    bool WriteAddrIndexTip(uint256 hashTip);
+    bool EraseAddrIndex();
     bool ReadDiskTx(uint256 hash, CTransaction& tx, CTxIndex& txindex);
     bool ReadDiskTx(uint256 hash, CTransaction& tx);
     bool ReadDiskTx(COutPoint outpoint, CTransaction& tx, CTxIndex& txindex);
@@ -282,7 +423,15 @@ public:
     bool EraseBlockIndex(uint256 hash);
     bool ReadHashBestChain(uint256& hashBestChain);
     bool WriteHashBestChain(uint256 hashBestChain);
+    bool ReadDurableTip(uint256& hashDurableTip);
+    bool WriteDurableTip(uint256 hashDurableTip);
+    bool EraseDurableTip();
+    bool EraseTxIndexAtBlocks(const set<pair<unsigned int, unsigned int> >& setBlockPos);
     bool LoadBlockIndex();
+    bool WriteBlockIndexSnapshot();
+private:
+    bool LoadBlockIndexSnapshot();
+    bool LoadBlockIndexSnapshot(const unsigned char* pbegin, unsigned int nSize, const uint256& hashExpected);
 };
 
 
@@ -292,12 +441,11 @@ public:
 class CAddrDB : public CDB
 {
 public:
-    CAddrDB(const char* pszMode="cr+") : CDB("addr.dat", pszMode) { }
+    CAddrDB(const char* pszMode="cr+") : CDB("addr.dat", pszMode) { fSecure = false; }
 private:
     CAddrDB(const CAddrDB&);
     void operator=(const CAddrDB&);
 public:
-    bool WriteAddress(const CAddress& addr);
     bool LoadAddresses();
 };
 
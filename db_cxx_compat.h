@@ -179,6 +179,10 @@ public:
         return dbenv->txn_checkpoint(dbenv, kbyte, min, flags);
     }
 
+    int log_flush(const DB_LSN* lsn) {
+        return dbenv->log_flush(dbenv, lsn);
+    }
+
     int log_archive(char*** listp, u_int32_t flags) {
         return dbenv->log_archive(dbenv, listp, flags);
     }
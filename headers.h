@@ -84,6 +84,7 @@
 #include <set>
 #include <algorithm>
 #include <numeric>
+#include <atomic>
 
 // Suppress Boost bind placeholder deprecation warning
 #ifndef BOOST_BIND_GLOBAL_PLACEHOLDERS
@@ -99,6 +100,7 @@
 #include <boost/array.hpp>
 #include <boost/bind.hpp>
 #include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/algorithm/string.hpp>
 
@@ -123,6 +125,8 @@ inline BOOL PathRemoveFileSpecA(LPSTR pszPath) {
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <unistd.h>
@@ -130,12 +134,18 @@ inline BOOL PathRemoveFileSpecA(LPSTR pszPath) {
 #include <net/if.h>
 #include <ifaddrs.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <dirent.h>
 #endif
 #ifdef __BSD__
 #include <netinet/in.h>
 #endif
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#define USE_EPOLL
+#endif
 
 
 #pragma hdrstop
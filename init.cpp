@@ -36,9 +36,21 @@ void Shutdown(void* parg)
     {
         fShutdown = true;
         nTransactionsUpdated++;
+        FlushBlockStore(true);
         DBFlush(false);
         StopNode();
-        DBFlush(true);
+
+        // Snapshot the block index for a fast restart.  Holding cs_main until
+        // the db environment is closed makes sure nothing changes after it.
+        bool fFlushed = false;
+        TRY_CRITICAL_BLOCK(cs_main)
+        {
+            CTxDB().WriteBlockIndexSnapshot();
+            DBFlush(true);
+            fFlushed = true;
+        }
+        if (!fFlushed)
+            DBFlush(true);
         CreateThread(ExitTimeout, NULL);
         Sleep(50);
         printf("Bitok exiting\n\n");
@@ -59,6 +71,31 @@ void Shutdown(void* parg)
 
 
 
+bool ParseDBSyncArgs(string& strError)
+{
+    string strMode = GetArg("-dbsync", "strict");
+    if (strMode == "batched")
+        fBatchedDBSync = true;
+    else if (strMode == "strict")
+        fBatchedDBSync = false;
+    else
+    {
+        strError = strprintf("Invalid -dbsync mode '%s', use strict or batched", strMode.c_str());
+        return false;
+    }
+    nDBSyncBlocks = (int)max((int64)1, GetIntArg("-dbsyncblocks", 500));
+    nDBSyncInterval = max((int64)1, GetIntArg("-dbsyncinterval", 30));
+    if (fBatchedDBSync)
+        printf("Batched block store sync every %d blocks or %" PRI64d " seconds\n", nDBSyncBlocks, nDBSyncInterval);
+
+    return true;
+}
+
+
+
+
+
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // Startup folder
@@ -380,6 +417,15 @@ bool CMyApp::OnInit2()
             "  -server         \t  " + _("Accept command line and JSON-RPC commands\n") +
             "  -daemon         \t  " + _("Run in the background as a daemon and accept commands\n") +
             "  -recover        \t  " + _("Recover database and extract keys from corrupted wallet\n") +
+            "  -dbsync=<mode>  \t  " + _("Block store durability: strict (default) or batched\n") +
+            "  -dbsyncblocks=<n>\t  " + _("In batched mode, sync at least every n blocks (default: 500)\n") +
+            "  -dbsyncinterval=<n>\t  " + _("In batched mode, sync at least every n seconds (default: 30)\n") +
+            "  -maxrelaycache=<n>\t  " + _("Keep at most n megabytes of relayed messages (default: 32)\n") +
+            "  -addrindex      \t  " + _("Keep an index of balances and history for every address\n") +
+            "  -rpcthreads=<n> \t  " + _("Number of threads serving JSON-RPC calls (default: 4)\n") +
+            "  -rpccachesize=<n>\t  " + _("Keep at most n megabytes of cached RPC replies (default: 16)\n") +
+            "  -rest           \t  " + _("Serve blocks, transactions and headers over REST to local clients\n") +
+            "  -notifysocket=<port|unix:path>\t  " + _("Publish new blocks and transactions to local subscribers\n") +
             "  --help          \t  " + _("This help message\n");
 
 
@@ -405,6 +451,7 @@ bool CMyApp::OnInit2()
         fPrintToConsole = true;
 
     fPrintToDebugger = GetBoolArg("-printtodebugger");
+    fAddrIndex = GetBoolArg("-addrindex");
     if (!fDebug && !pszSetDataDir[0])
         ShrinkDebugFile();
     printf("\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n");
@@ -491,6 +538,12 @@ bool CMyApp::OnInit2()
         return false;
     }
 
+    if (!ParseDBSyncArgs(strErrors))
+    {
+        wxMessageBox(strErrors, "Bitok");
+        return false;
+    }
+
     //
     // Load data files
     //
@@ -628,6 +681,8 @@ bool CMyApp::OnInit2()
         }
     }
 
+    relayCache.SetMaxBytes(max((int64)1, GetIntArg("-maxrelaycache", 32)) * 1000000);
+
     if (mapArgs.count("-addnode"))
     {
         foreach(string strAddr, mapMultiArgs["-addnode"])
@@ -854,6 +909,15 @@ bool AppInit(int argc, char* argv[])
             "  -server           " + _("Accept command line and JSON-RPC commands\n") +
             "  -daemon           " + _("Run in the background as a daemon and accept commands\n") +
             "  -recover          " + _("Recover database and extract keys from corrupted wallet\n") +
+            "  -dbsync=<mode>    " + _("Block store durability: strict (default) or batched\n") +
+            "  -dbsyncblocks=<n> " + _("In batched mode, sync at least every n blocks (default: 500)\n") +
+            "  -dbsyncinterval=<n> " + _("In batched mode, sync at least every n seconds (default: 30)\n") +
+            "  -maxrelaycache=<n> " + _("Keep at most n megabytes of relayed messages (default: 32)\n") +
+            "  -addrindex        " + _("Keep an index of balances and history for every address\n") +
+            "  -rpcthreads=<n>   " + _("Number of threads serving JSON-RPC calls (default: 4)\n") +
+            "  -rpccachesize=<n> " + _("Keep at most n megabytes of cached RPC replies (default: 16)\n") +
+            "  -rest             " + _("Serve blocks, transactions and headers over REST to local clients\n") +
+            "  -notifysocket=<port|unix:path> " + _("Publish new blocks and transactions to local subscribers\n") +
             "  --help            " + _("This help message\n");
         fprintf(stderr, "%s", strUsage.c_str());
         return false;
@@ -867,6 +931,7 @@ bool AppInit(int argc, char* argv[])
         fPrintToConsole = true;
 
     fPrintToDebugger = GetBoolArg("-printtodebugger");
+    fAddrIndex = GetBoolArg("-addrindex");
 
     if (!fDebug && !pszSetDataDir[0])
         ShrinkDebugFile();
@@ -937,6 +1002,12 @@ bool AppInit(int argc, char* argv[])
         }
     }
 
+    if (!ParseDBSyncArgs(strErrors))
+    {
+        fprintf(stderr, "%s\n", strErrors.c_str());
+        return false;
+    }
+
     printf("Loading addresses...\n");
     if (!LoadAddresses())
         fprintf(stderr, "Warning: Error loading addresses\n");
@@ -1017,6 +1088,8 @@ bool AppInit(int argc, char* argv[])
         }
     }
 
+    relayCache.SetMaxBytes(max((int64)1, GetIntArg("-maxrelaycache", 32)) * 1000000);
+
     if (mapArgs.count("-paytxfee"))
     {
         if (!ParseMoney(mapArgs["-paytxfee"], nTransactionFee))
@@ -34,7 +34,7 @@ CCriticalSection cs_mapTransactions;
 unsigned int nTransactionsUpdated = 0;
 map<COutPoint, CInPoint> mapNextTx;
 
-map<uint256, CBlockIndex*> mapBlockIndex;
+CBlockIndexMap mapBlockIndex;
 
 // uint256 hashGenesisBlock("0x0000000000000000000000000000000000000000000000000000000000000000");
 uint256 hashGenesisBlock("0x0290400ea28d3fe79d102ca6b7cd11cee5eba9f17f2046c303d92f65d6ed2617");
@@ -42,17 +42,30 @@ CBlockIndex* pindexGenesisBlock = NULL;
 int nBestHeight = -1;
 uint256 hashBestChain = 0;
 CBlockIndex* pindexBest = NULL;
+vector<CBlockIndex*> vBlockIndexByHeight;
 int64 nTimeBestReceived = 0;
 
 map<uint256, CBlock*> mapOrphanBlocks;
 multimap<uint256, CBlock*> mapOrphanBlocksByPrev;
 
-map<uint256, CDataStream*> mapOrphanTransactions;
-multimap<uint256, CDataStream*> mapOrphanTransactionsByPrev;
+CRollingBloomFilter filterRecentRejects(50000, 0.000001);
+uint256 hashRecentRejectsChainTip;
+CRollingBloomFilter filterRecentConfirmed(24000, 0.000001);
+
+CBlockIndexMap mapHeaderIndex;
+CBlockIndex* pindexBestHeader = NULL;
+map<uint256, pair<CNode*, int64> > mapBlocksInFlight;
+map<uint256, pair<CNode*, CBlock> > mapPartialBlocks;
+
+map<uint256, CPublicDataStream*> mapOrphanTransactions;
+multimap<uint256, CPublicDataStream*> mapOrphanTransactionsByPrev;
 
 map<uint256, CWalletTx> mapWallet;
+set<pair<unsigned int, uint256> > setWalletByTime;
+set<pair<uint160, uint256> > setWalletByAddress;
 vector<uint256> vWalletUpdated;
 CCriticalSection cs_mapWallet;
+unsigned int nWalletTxChanges = 0;
 
 map<vector<unsigned char>, CPrivKey> mapKeys;
 map<uint160, vector<unsigned char> > mapPubKeys;
@@ -76,6 +89,10 @@ int fLimitProcessors = false;
 int nLimitProcessors = 1;
 int fMinimizeToTray = true;
 int fMinimizeOnClose = true;
+bool fBatchedDBSync = false;
+bool fAddrIndex = false;
+int nDBSyncBlocks = 500;
+int64 nDBSyncInterval = 30;
 
 
 //////////////////////////////////////////////////////////////////////////////
@@ -110,7 +127,7 @@ namespace Checkpoints
         return mapCheckpoints.rbegin()->first;
     }
 
-    CBlockIndex* GetLastCheckpoint(const map<uint256, CBlockIndex*>& mapBlockIndex)
+    CBlockIndex* GetLastCheckpoint(const CBlockIndexMap& mapBlockIndex)
     {
         int64 nResult = 0;
         BOOST_REVERSE_FOREACH(const MapCheckpoints::value_type& i, mapCheckpoints)
@@ -208,6 +225,89 @@ vector<unsigned char> GenerateNewKey()
 // mapWallet
 //
 
+//
+// Running balance of mapWallet.  Each tx caches what it has available in
+// nAvailableCredit, so a change to one tx only moves the total by the
+// difference.  Non-final txes and immature coinbases add nothing and are
+// rechecked from setWalletUnsettled by GetBalance until they settle.
+//
+static int64 nWalletBalance = 0;
+static bool fWalletBalanceValid = false;
+static set<uint256> setWalletUnsettled;
+
+static void UpdateWalletBalance(const uint256& hash, const CWalletTx& wtx)
+{
+    if (!fWalletBalanceValid)
+        return;
+    int64 nCredit = 0;
+    if (wtx.fSpent)
+        setWalletUnsettled.erase(hash);
+    else if (!wtx.IsFinal() || (wtx.IsCoinBase() && wtx.GetBlocksToMaturity() > 0))
+        setWalletUnsettled.insert(hash);
+    else
+    {
+        setWalletUnsettled.erase(hash);
+        nCredit = wtx.GetCredit(true);
+    }
+    nWalletBalance += nCredit - wtx.nAvailableCredit;
+    wtx.nAvailableCredit = nCredit;
+}
+
+static void RecalcWalletBalance()
+{
+    nWalletBalance = 0;
+    setWalletUnsettled.clear();
+    fWalletBalanceValid = true;
+    for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+    {
+        (*it).second.nAvailableCredit = 0;
+        UpdateWalletBalance((*it).first, (*it).second);
+    }
+}
+
+// Bring nWalletBalance and every nAvailableCredit up to date
+static void SettleWalletBalance()
+{
+    if (!fWalletBalanceValid)
+        RecalcWalletBalance();
+
+    // Only txes waiting to mature or become final need another look
+    vector<uint256> vUnsettled(setWalletUnsettled.begin(), setWalletUnsettled.end());
+    foreach(const uint256& hash, vUnsettled)
+    {
+        map<uint256, CWalletTx>::iterator mi = mapWallet.find(hash);
+        if (mi != mapWallet.end())
+            UpdateWalletBalance(hash, (*mi).second);
+    }
+}
+
+void InvalidateWalletBalance()
+{
+    CRITICAL_BLOCK(cs_mapWallet)
+        fWalletBalanceValid = false;
+}
+
+// Lookup sets kept beside mapWallet, the tx's contents never change once in
+void AddToWalletIndexes(const uint256& hash, const CWalletTx& wtx)
+{
+    setWalletByTime.insert(make_pair(wtx.nTimeReceived, hash));
+    foreach(const CTxOut& txout, wtx.vout)
+    {
+        uint160 hash160 = txout.scriptPubKey.GetBitcoinAddressHash160();
+        if (hash160 != 0)
+            setWalletByAddress.insert(make_pair(hash160, hash));
+    }
+    nWalletTxChanges++;
+}
+
+static void EraseFromWalletIndexes(const uint256& hash, const CWalletTx& wtx)
+{
+    setWalletByTime.erase(make_pair(wtx.nTimeReceived, hash));
+    foreach(const CTxOut& txout, wtx.vout)
+        setWalletByAddress.erase(make_pair(txout.scriptPubKey.GetBitcoinAddressHash160(), hash));
+    nWalletTxChanges++;
+}
+
 bool AddToWallet(const CWalletTx& wtxIn)
 {
     uint256 hash = wtxIn.GetHash();
@@ -218,7 +318,11 @@ bool AddToWallet(const CWalletTx& wtxIn)
         CWalletTx& wtx = (*ret.first).second;
         bool fInsertedNew = ret.second;
         if (fInsertedNew)
+        {
             wtx.nTimeReceived = GetAdjustedTime();
+            wtx.nAvailableCredit = 0;
+            AddToWalletIndexes(hash, wtx);
+        }
 
         bool fUpdated = false;
         if (!fInsertedNew)
@@ -250,6 +354,9 @@ bool AddToWallet(const CWalletTx& wtxIn)
         if (fDebug)
             printf("[WALLET] AddToWallet %s %s%s\n", wtxIn.GetHash().ToString().substr(0,6).c_str(), (fInsertedNew ? "new" : ""), (fUpdated ? "update" : ""));
 
+        if (fInsertedNew || fUpdated)
+            UpdateWalletBalance(hash, wtx);
+
         // Write to disk
         if (fInsertedNew || fUpdated)
             if (!wtx.WriteToDisk())
@@ -294,8 +401,15 @@ bool EraseFromWallet(uint256 hash)
 {
     CRITICAL_BLOCK(cs_mapWallet)
     {
-        if (mapWallet.erase(hash))
+        map<uint256, CWalletTx>::iterator mi = mapWallet.find(hash);
+        if (mi != mapWallet.end())
+        {
+            EraseFromWalletIndexes(hash, (*mi).second);
+            nWalletBalance -= (*mi).second.nAvailableCredit;
+            setWalletUnsettled.erase(hash);
+            mapWallet.erase(mi);
             CWalletDB().EraseTx(hash);
+        }
     }
     return true;
 }
@@ -316,6 +430,7 @@ void WalletUpdateSpent(const COutPoint& prevout)
                 if (fDebug)
                     printf("[WALLET] Found spent coin %sbc %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
                 wtx.fSpent = true;
+                UpdateWalletBalance(prevout.hash, wtx);
                 wtx.WriteToDisk();
                 vWalletUpdated.push_back(prevout.hash);
             }
@@ -335,14 +450,14 @@ void WalletUpdateSpent(const COutPoint& prevout)
 // mapOrphanTransactions
 //
 
-void AddOrphanTx(const CDataStream& vMsg)
+void AddOrphanTx(const CPublicDataStream& vMsg)
 {
     CTransaction tx;
-    CDataStream(vMsg) >> tx;
+    CPublicDataStream(vMsg) >> tx;
     uint256 hash = tx.GetHash();
     if (mapOrphanTransactions.count(hash))
         return;
-    CDataStream* pvMsg = mapOrphanTransactions[hash] = new CDataStream(vMsg);
+    CPublicDataStream* pvMsg = mapOrphanTransactions[hash] = new CPublicDataStream(vMsg);
     foreach(const CTxIn& txin, tx.vin)
         mapOrphanTransactionsByPrev.insert(make_pair(txin.prevout.hash, pvMsg));
 }
@@ -351,12 +466,12 @@ void EraseOrphanTx(uint256 hash)
 {
     if (!mapOrphanTransactions.count(hash))
         return;
-    const CDataStream* pvMsg = mapOrphanTransactions[hash];
+    const CPublicDataStream* pvMsg = mapOrphanTransactions[hash];
     CTransaction tx;
-    CDataStream(*pvMsg) >> tx;
+    CPublicDataStream(*pvMsg) >> tx;
     foreach(const CTxIn& txin, tx.vin)
     {
-        for (multimap<uint256, CDataStream*>::iterator mi = mapOrphanTransactionsByPrev.lower_bound(txin.prevout.hash);
+        for (multimap<uint256, CPublicDataStream*>::iterator mi = mapOrphanTransactionsByPrev.lower_bound(txin.prevout.hash);
              mi != mapOrphanTransactionsByPrev.upper_bound(txin.prevout.hash);)
         {
             if ((*mi).second == pvMsg)
@@ -678,6 +793,15 @@ bool CTransaction::AcceptTransaction(CTxDB& txdb, bool fCheckInputs, bool* pfMis
 }
 
 
+// Hashes are published in the byte order RPC displays them
+static void PublishHash(const char* pszTopic, uint256 hash)
+{
+    vector<unsigned char> vch(hash.begin(), hash.end());
+    reverse(vch.begin(), vch.end());
+    PublishNotification(pszTopic, (const char*)&vch[0], vch.size());
+}
+
+
 bool CTransaction::AddToMemoryPool()
 {
     // Add to memory pool without checking anything.  Don't call this directly,
@@ -690,6 +814,15 @@ bool CTransaction::AddToMemoryPool()
             mapNextTx[vin[i].prevout] = CInPoint(&mapTransactions[hash], i);
         nTransactionsUpdated++;
     }
+
+    if (NotifyWanted("hashtx"))
+        PublishHash("hashtx", GetHash());
+    if (NotifyWanted("rawtx"))
+    {
+        CPublicDataStream ss(SER_NETWORK);
+        ss << *this;
+        PublishNotification("rawtx", &ss[0], ss.size());
+    }
     return true;
 }
 
@@ -812,6 +945,7 @@ void ReacceptWalletTransactions()
                             if (fDebug)
                                 printf("[WALLET] ReacceptWalletTransactions found spent coin %sbc %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
                             wtx.fSpent = true;
+                            UpdateWalletBalance(item.first, wtx);
                             wtx.WriteToDisk();
                             break;
                         }
@@ -897,11 +1031,239 @@ void ResendWalletTransactions()
 
 
 
+//////////////////////////////////////////////////////////////////////////////
+//
+// CBlockIndexMap
+//
+
+CBlockIndexMap::~CBlockIndexMap()
+{
+    clear();
+}
+
+unsigned int CBlockIndexMap::Bucket(const uint256& hash) const
+{
+    // Salted per process so peers can't line up long probe runs
+    uint64 n[4];
+    memcpy(n, &hash, sizeof(n));
+    uint64 h = nSalt;
+    for (int i = 0; i < 4; i++)
+    {
+        h ^= n[i];
+        h *= 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 32;
+    }
+    return (unsigned int)h & (vTable.size() - 1);
+}
+
+unsigned int CBlockIndexMap::FindSlot(const uint256& hash) const
+{
+    // Returns the slot holding hash, or the empty slot that ends its probe run
+    unsigned int nMask = vTable.size() - 1;
+    unsigned int i = Bucket(hash);
+    while (vTable[i] != NULL && vTable[i]->item.first != hash)
+        i = (i + 1) & nMask;
+    return i;
+}
+
+void CBlockIndexMap::Resize(unsigned int nSlots)
+{
+    if (vTable.empty())
+        nSalt = GetRand(UINT64_MAX);
+    vector<CEntry*> vOld;
+    vOld.swap(vTable);
+    vTable.assign(nSlots, (CEntry*)NULL);
+    foreach(CEntry* pentry, vOld)
+        if (pentry)
+            vTable[FindSlot(pentry->item.first)] = pentry;
+}
+
+void CBlockIndexMap::reserve(unsigned int n)
+{
+    unsigned int nSlots = 1024;
+    while (nSlots * 3 < n * 4)
+        nSlots *= 2;
+    CRITICAL_BLOCK(cs_table)
+        if (nSlots > vTable.size())
+            Resize(nSlots);
+}
+
+CBlockIndex* CBlockIndexMap::insert(const uint256& hash, const CBlockIndex& index)
+{
+    CRITICAL_BLOCK(cs_table)
+    {
+        // Keep the load factor under 3/4
+        if ((nSize + 1) * 4 > vTable.size() * 3)
+            Resize(vTable.empty() ? 1024 : vTable.size() * 2);
+
+        unsigned int i = FindSlot(hash);
+        if (vTable[i] != NULL)
+            return &vTable[i]->index;
+
+        CEntry* pentry;
+        if (!vFree.empty())
+        {
+            pentry = vFree.back();
+            vFree.pop_back();
+        }
+        else
+        {
+            if (nSlabUsed == ENTRIES_PER_SLAB)
+            {
+                CEntry* pslab = (CEntry*)malloc(sizeof(CEntry) * ENTRIES_PER_SLAB);
+                if (!pslab)
+                    throw bad_alloc();
+                vSlabs.push_back(pslab);
+                nSlabUsed = 0;
+            }
+            pentry = vSlabs.back() + nSlabUsed++;
+        }
+        new (pentry) CEntry(hash, index);
+        vTable[i] = pentry;
+        nSize++;
+        return &pentry->index;
+    }
+    return NULL;
+}
+
+void CBlockIndexMap::erase(const uint256& hash)
+{
+    CRITICAL_BLOCK(cs_table)
+    {
+        if (nSize == 0)
+            return;
+        unsigned int i = FindSlot(hash);
+        CEntry* pentry = vTable[i];
+        if (pentry == NULL)
+            return;
+        pentry->~CEntry();
+        vFree.push_back(pentry);
+        nSize--;
+
+        // Shift the rest of the probe run back over the hole so lookups
+        // that pass through it don't stop early
+        unsigned int nMask = vTable.size() - 1;
+        unsigned int j = i;
+        loop
+        {
+            vTable[i] = NULL;
+            loop
+            {
+                j = (j + 1) & nMask;
+                if (vTable[j] == NULL)
+                    return;
+                unsigned int k = Bucket(vTable[j]->item.first);
+                if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+                    continue;
+                break;
+            }
+            vTable[i] = vTable[j];
+            i = j;
+        }
+    }
+}
+
+void CBlockIndexMap::clear()
+{
+    CRITICAL_BLOCK(cs_table)
+    {
+        foreach(CEntry* pentry, vTable)
+            if (pentry)
+                pentry->~CEntry();
+        foreach(CEntry* pslab, vSlabs)
+            free(pslab);
+        vTable.clear();
+        vSlabs.clear();
+        vFree.clear();
+        nSlabUsed = ENTRIES_PER_SLAB;
+        nSize = 0;
+    }
+}
+
+
+
+
+
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // CBlock and CBlockIndex
 //
 
+void SetBlockIndexByHeight(CBlockIndex* pindexTip)
+{
+    // Only the part above the fork with the previous main chain is rewritten.
+    // A resize can move the vector, so it's only read or written under cs_main
+    vBlockIndexByHeight.resize(pindexTip ? pindexTip->nHeight + 1 : 0);
+    for (CBlockIndex* pindex = pindexTip; pindex && vBlockIndexByHeight[pindex->nHeight] != pindex; pindex = pindex->pprev)
+        vBlockIndexByHeight[pindex->nHeight] = pindex;
+}
+
+// Turns the lowest set bit off
+static inline int InvertLowestOne(int n) { return n & (n - 1); }
+
+// Height pskip points to: far enough back to give O(log n) walks, but
+// chosen so neighbouring entries' skips lead to different places
+static inline int GetSkipHeight(int nHeight)
+{
+    if (nHeight < 2)
+        return 0;
+    return (nHeight & 1) ? InvertLowestOne(InvertLowestOne(nHeight - 1)) + 1 : InvertLowestOne(nHeight);
+}
+
+CBlockIndex* CBlockIndex::GetAncestor(int nHeightTarget)
+{
+    if (nHeightTarget > nHeight || nHeightTarget < 0)
+        return NULL;
+
+    CBlockIndex* pindexWalk = this;
+    int nHeightWalk = nHeight;
+    while (nHeightWalk > nHeightTarget)
+    {
+        // Take the skip unless the next entry's skip gets closer without overshooting
+        int nHeightSkip = GetSkipHeight(nHeightWalk);
+        int nHeightSkipPrev = GetSkipHeight(nHeightWalk - 1);
+        if (pindexWalk->pskip != NULL &&
+            (nHeightSkip == nHeightTarget ||
+             (nHeightSkip > nHeightTarget && !(nHeightSkipPrev < nHeightSkip - 2 && nHeightSkipPrev >= nHeightTarget))))
+        {
+            pindexWalk = pindexWalk->pskip;
+            nHeightWalk = nHeightSkip;
+        }
+        else
+        {
+            pindexWalk = pindexWalk->pprev;
+            nHeightWalk--;
+        }
+    }
+    return pindexWalk;
+}
+
+void CBlockIndex::BuildSkip()
+{
+    if (pprev)
+        pskip = pprev->GetAncestor(GetSkipHeight(nHeight));
+}
+
+void BuildSkipPointers()
+{
+    // Parents first, so each entry's walk can use the skips below it
+    vector<pair<int, CBlockIndex*> > vSortedByHeight;
+    vSortedByHeight.reserve(mapBlockIndex.size());
+    for (auto mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        vSortedByHeight.push_back(make_pair((*mi).second->nHeight, (*mi).second));
+    sort(vSortedByHeight.begin(), vSortedByHeight.end());
+    for (unsigned int i = 0; i < vSortedByHeight.size(); i++)
+        vSortedByHeight[i].second->BuildSkip();
+}
+
+CBlockIndex* FindBlockByHeight(int nHeight)
+{
+    if (nHeight < 0 || nHeight >= (int)vBlockIndexByHeight.size())
+        return NULL;
+    return vBlockIndexByHeight[nHeight];
+}
+
 bool CBlock::ReadFromDisk(const CBlockIndex* pblockindex, bool fReadTransactions)
 {
     return ReadFromDisk(pblockindex->nFile, pblockindex->nBlockPos, fReadTransactions);
@@ -939,9 +1301,7 @@ unsigned int GetNextWorkRequired(const CBlockIndex* pindexLast)
         return pindexLast->nBits;
 
     // Go back by what we want to be 7 blocks worth
-    const CBlockIndex* pindexFirst = pindexLast;
-    for (int i = 0; pindexFirst && i < nInterval-1; i++)
-        pindexFirst = pindexFirst->pprev;
+    const CBlockIndex* pindexFirst = pindexLast->GetAncestor(pindexLast->nHeight - (nInterval-1));
     assert(pindexFirst);
 
     // Limit adjustment step
@@ -974,6 +1334,299 @@ unsigned int GetNextWorkRequired(const CBlockIndex* pindexLast)
 
 
 
+//
+// Header chain
+//
+// Headers we've validated but don't have the block for yet live in
+// mapHeaderIndex.  Their pprev may point into either map.  When a block
+// is added to mapBlockIndex its header entry is dropped and the headers
+// built on it are re-pointed at the new entry.  Blocks along the best
+// header chain are then fetched from all headers-capable peers at once,
+// a window at a time.
+//
+
+// Header entries whose pprev or pskip points at another header entry,
+// keyed by the entry pointed at
+static multimap<CBlockIndex*, CBlockIndex*> mapHeaderRefs;
+
+static void AddHeaderRef(CBlockIndex* pindexTo, CBlockIndex* pindexFrom)
+{
+    if (pindexTo && mapHeaderIndex.count(pindexTo->GetBlockHash()))
+        mapHeaderRefs.insert(make_pair(pindexTo, pindexFrom));
+}
+
+static void EraseHeaderRef(CBlockIndex* pindexTo, CBlockIndex* pindexFrom)
+{
+    multimap<CBlockIndex*, CBlockIndex*>::iterator mi = mapHeaderRefs.lower_bound(pindexTo);
+    for (; mi != mapHeaderRefs.end() && (*mi).first == pindexTo; ++mi)
+    {
+        if ((*mi).second == pindexFrom)
+        {
+            mapHeaderRefs.erase(mi);
+            return;
+        }
+    }
+}
+
+static void ReplaceHeaderEntry(CBlockIndex* pindexNew)
+{
+    // The block arrived, retire its header entry in favour of pindexNew
+    uint256 hash = pindexNew->GetBlockHash();
+    auto mi = mapHeaderIndex.find(hash);
+    if (mi == mapHeaderIndex.end())
+        return;
+    CBlockIndex* pindexOld = (*mi).second;
+
+    multimap<CBlockIndex*, CBlockIndex*>::iterator miRef = mapHeaderRefs.lower_bound(pindexOld);
+    while (miRef != mapHeaderRefs.end() && (*miRef).first == pindexOld)
+    {
+        CBlockIndex* pindex = (*miRef).second;
+        if (pindex->pprev == pindexOld)
+            pindex->pprev = pindexNew;
+        if (pindex->pskip == pindexOld)
+            pindex->pskip = pindexNew;
+        mapHeaderRefs.erase(miRef++);
+    }
+    EraseHeaderRef(pindexOld->pprev, pindexOld);
+    EraseHeaderRef(pindexOld->pskip, pindexOld);
+
+    if (pindexBestHeader == pindexOld)
+        pindexBestHeader = pindexNew;
+    mapHeaderIndex.erase(hash);
+}
+
+CBlockIndex* LookupBlockIndex(const uint256& hash)
+{
+    auto mi = mapBlockIndex.find(hash);
+    if (mi != mapBlockIndex.end())
+        return (*mi).second;
+    mi = mapHeaderIndex.find(hash);
+    if (mi != mapHeaderIndex.end())
+        return (*mi).second;
+    return NULL;
+}
+
+CBlockIndex* GetBestHeader()
+{
+    if (!pindexBestHeader || pindexBestHeader->nHeight < nBestHeight)
+        pindexBestHeader = pindexBest;
+    return pindexBestHeader;
+}
+
+static bool IsOnMainChain(const CBlockIndex* pindex)
+{
+    // Header entries are separate from the block index, so compare by hash
+    return (pindex->nHeight < (int)vBlockIndexByHeight.size() &&
+            vBlockIndexByHeight[pindex->nHeight]->GetBlockHash() == pindex->GetBlockHash());
+}
+
+CBlockIndex* AcceptBlockHeader(const CBlock& block)
+{
+    uint256 hash = block.GetHash();
+    CBlockIndex* pindex = LookupBlockIndex(hash);
+    if (pindex)
+        return pindex;
+
+    CBlockIndex* pindexPrev = LookupBlockIndex(block.hashPrevBlock);
+    if (!pindexPrev)
+    {
+        error("AcceptBlockHeader() : prev block not found");
+        return NULL;
+    }
+    int nHeight = pindexPrev->nHeight + 1;
+
+    // Same context-free and header checks as CheckBlock and AcceptBlock
+    if (block.nTime > GetAdjustedTime() + 2 * 60 * 60)
+    {
+        error("AcceptBlockHeader() : block timestamp too far in the future");
+        return NULL;
+    }
+    if (block.nTime <= pindexPrev->GetMedianTimePast())
+    {
+        error("AcceptBlockHeader() : block's timestamp is too early");
+        return NULL;
+    }
+    if (block.nBits != GetNextWorkRequired(pindexPrev))
+    {
+        error("AcceptBlockHeader() : incorrect proof of work");
+        return NULL;
+    }
+    if (!Checkpoints::CheckBlock(nHeight, hash))
+    {
+        error("AcceptBlockHeader() : rejected by checkpoint lockin at %d", nHeight);
+        return NULL;
+    }
+    if (block.GetPoWHash() > CBigNum().SetCompact(block.nBits).getuint256())
+    {
+        error("AcceptBlockHeader() : hash doesn't match nBits");
+        return NULL;
+    }
+
+    // Chains are compared by height, so a fork from far back could be
+    // grown cheaply at the low difficulty of the time.  Only follow forks
+    // that leave the main chain within MAX_HEADER_FORK_DEPTH of the tip
+    int nForkCheck = nBestHeight - MAX_HEADER_FORK_DEPTH;
+    if (nForkCheck > 0 && !IsOnMainChain(pindexPrev->GetAncestor(min(pindexPrev->nHeight, nForkCheck))))
+    {
+        error("AcceptBlockHeader() : forks more than %d blocks below the best chain", MAX_HEADER_FORK_DEPTH);
+        return NULL;
+    }
+
+    CBlock header = block;
+    pindex = mapHeaderIndex.insert(hash, CBlockIndex(0, 0, header));
+    pindex->pprev = pindexPrev;
+    pindex->nHeight = nHeight;
+    pindex->BuildSkip();
+    AddHeaderRef(pindex->pprev, pindex);
+    AddHeaderRef(pindex->pskip, pindex);
+
+    if (nHeight > GetBestHeader()->nHeight)
+        pindexBestHeader = pindex;
+    return pindex;
+}
+
+static void InvalidateHeaders(CBlockIndex* pindexBad)
+{
+    // Drop pindexBad's header entry and every header built on it.  Match
+    // by hash, pindexBad may be either the header or the block index entry
+    uint256 hashBad = pindexBad->GetBlockHash();
+    int nHeightBad = pindexBad->nHeight;
+    vector<CBlockIndex*> vErase;
+    for (auto mi = mapHeaderIndex.begin(); mi != mapHeaderIndex.end(); ++mi)
+    {
+        CBlockIndex* pancestor = (*mi).second->GetAncestor(nHeightBad);
+        if (pancestor && pancestor->GetBlockHash() == hashBad)
+            vErase.push_back((*mi).second);
+    }
+    CBlockIndex* pancestorBest = (pindexBestHeader ? pindexBestHeader->GetAncestor(nHeightBad) : NULL);
+    bool fResetBest = (pancestorBest && pancestorBest->GetBlockHash() == hashBad);
+    if (vErase.empty() && !fResetBest)
+        return;
+
+    if (fDebug)
+        printf("[BLOCK] Invalidating %d headers from %s\n", (int)vErase.size(), pindexBad->GetBlockHash().ToString().substr(0,16).c_str());
+    if (fResetBest)
+        pindexBestHeader = NULL;
+    foreach(CBlockIndex* pindex, vErase)
+    {
+        mapHeaderRefs.erase(pindex);
+        EraseHeaderRef(pindex->pprev, pindex);
+        EraseHeaderRef(pindex->pskip, pindex);
+    }
+    foreach(CBlockIndex* pindex, vErase)
+        mapHeaderIndex.erase(pindex->GetBlockHash());
+
+    if (!pindexBestHeader)
+    {
+        pindexBestHeader = pindexBest;
+        for (auto mi = mapHeaderIndex.begin(); mi != mapHeaderIndex.end(); ++mi)
+            if (!pindexBestHeader || (*mi).second->nHeight > pindexBestHeader->nHeight)
+                pindexBestHeader = (*mi).second;
+    }
+}
+
+static void InvalidateHeaders(const uint256& hash)
+{
+    auto mi = mapHeaderIndex.find(hash);
+    if (mi != mapHeaderIndex.end())
+        InvalidateHeaders((*mi).second);
+}
+
+static void MarkBlockReceived(const uint256& hash)
+{
+    map<uint256, pair<CNode*, int64> >::iterator mi = mapBlocksInFlight.find(hash);
+    if (mi == mapBlocksInFlight.end())
+        return;
+    (*mi).second.first->nBlocksInFlight--;
+    mapBlocksInFlight.erase(mi);
+    mapPartialBlocks.erase(hash);
+}
+
+void ReleaseBlocksInFlight(CNode* pnode)
+{
+    map<uint256, pair<CNode*, int64> >::iterator mi = mapBlocksInFlight.begin();
+    while (mi != mapBlocksInFlight.end())
+    {
+        if ((*mi).second.first == pnode)
+        {
+            mapPartialBlocks.erase((*mi).first);
+            mapBlocksInFlight.erase(mi++);
+        }
+        else
+            ++mi;
+    }
+    pnode->nBlocksInFlight = 0;
+}
+
+static void ExpireBlocksInFlight()
+{
+    // Give up on slow or departed peers so someone else can be asked
+    int64 nNow = GetTime();
+    map<uint256, pair<CNode*, int64> >::iterator mi = mapBlocksInFlight.begin();
+    while (mi != mapBlocksInFlight.end())
+    {
+        CNode* pnode = (*mi).second.first;
+        if (pnode->fDisconnect || nNow - (*mi).second.second > BLOCK_DOWNLOAD_TIMEOUT)
+        {
+            if (fDebug)
+                printf("[NET] Block download of %s from %s timed out\n", (*mi).first.ToString().substr(0,16).c_str(), pnode->addr.ToString().c_str());
+            pnode->nBlocksInFlight--;
+            mapPartialBlocks.erase((*mi).first);
+            mapBlocksInFlight.erase(mi++);
+        }
+        else
+            ++mi;
+    }
+}
+
+static void FindBlocksToDownload(CNode* pto, int nCount, vector<CBlockIndex*>& vBlocks)
+{
+    if (nCount <= 0)
+        return;
+    CBlockIndex* pindexHeader = GetBestHeader();
+    if (pindexHeader->nHeight <= nBestHeight)
+        return;
+
+    // Find the fork, the highest header chain block still on the main chain
+    int nLow = 0;
+    int nHigh = nBestHeight;
+    while (nLow < nHigh)
+    {
+        int nMid = (nLow + nHigh + 1) / 2;
+        if (IsOnMainChain(pindexHeader->GetAncestor(nMid)))
+            nLow = nMid;
+        else
+            nHigh = nMid - 1;
+    }
+    CBlockIndex* pfork = pindexHeader->GetAncestor(nLow);
+
+    // Don't ask for blocks the peer told us it doesn't have yet
+    int nWindowEnd = min(pfork->nHeight + BLOCK_DOWNLOAD_WINDOW, pindexHeader->nHeight);
+    if (pto->nStartingHeight != -1)
+        nWindowEnd = min(nWindowEnd, pto->nStartingHeight);
+    if (nWindowEnd <= pfork->nHeight)
+        return;
+
+    vector<CBlockIndex*> vWindow;
+    vWindow.reserve(nWindowEnd - pfork->nHeight);
+    for (CBlockIndex* pindex = pindexHeader->GetAncestor(nWindowEnd); pindex != pfork; pindex = pindex->pprev)
+        vWindow.push_back(pindex);
+
+    // Lowest first, so the chain can keep connecting while the rest arrive
+    BOOST_REVERSE_FOREACH(CBlockIndex* pindex, vWindow)
+    {
+        uint256 hash = pindex->GetBlockHash();
+        if (mapBlockIndex.count(hash) || mapOrphanBlocks.count(hash) || mapBlocksInFlight.count(hash))
+            continue;
+        vBlocks.push_back(pindex);
+        if ((int)vBlocks.size() >= nCount)
+            break;
+    }
+}
+
+
+
+
 
 
 
@@ -1158,6 +1811,85 @@ bool CTransaction::ClientConnectInputs()
 
 
 
+// Applies a block to the address index, or takes it back out in reverse
+// order.  Spends are found through the "addrout" record of the output
+// they spend, so no previous transactions are read.
+static bool UpdateAddressIndex(CTxDB& txdb, const CBlock& block, int nHeight, bool fConnect)
+{
+    map<uint160, CAddrBalance> mapBalanceChange;
+    for (int n = 0; n < block.vtx.size(); n++)
+    {
+        const CTransaction& tx = block.vtx[fConnect ? n : block.vtx.size() - 1 - n];
+        uint256 hashTx = tx.GetHash();
+        map<uint160, int64> mapChange;
+
+        if (!tx.IsCoinBase())
+        {
+            foreach(const CTxIn& txin, tx.vin)
+            {
+                // Outputs that don't pay to an address have no record
+                CAddrIndexKey key;
+                int64 nValue;
+                if (!txdb.ReadAddrOutput(txin.prevout, key, nValue))
+                    continue;
+                mapChange[key.hash160] -= nValue;
+                bool fOk = (fConnect ? txdb.EraseAddrUnspent(key, txin.prevout.n) : txdb.WriteAddrUnspent(key, txin.prevout.n, nValue));
+                if (!fOk)
+                    return error("UpdateAddressIndex() : updating spent output failed");
+            }
+        }
+
+        for (unsigned int i = 0; i < tx.vout.size(); i++)
+        {
+            uint160 hash160;
+            if (!ExtractAddressHash160(tx.vout[i].scriptPubKey, hash160))
+                continue;
+            int64 nValue = tx.vout[i].nValue;
+            CAddrIndexKey key(hash160, nHeight, hashTx);
+            COutPoint outpoint(hashTx, i);
+            mapChange[hash160] += nValue;
+            mapBalanceChange[hash160].nReceived += nValue;
+            bool fOk;
+            if (fConnect)
+                fOk = (txdb.WriteAddrOutput(outpoint, key, nValue) && txdb.WriteAddrUnspent(key, i, nValue));
+            else
+                fOk = (txdb.EraseAddrOutput(outpoint) && txdb.EraseAddrUnspent(key, i));
+            if (!fOk)
+                return error("UpdateAddressIndex() : updating output failed");
+        }
+
+        foreach(PAIRTYPE(const uint160, int64)& item, mapChange)
+        {
+            CAddrIndexKey key(item.first, nHeight, hashTx);
+            mapBalanceChange[item.first].nBalance += item.second;
+            bool fOk = (fConnect ? txdb.WriteAddrHistory(key, item.second) : txdb.EraseAddrHistory(key));
+            if (!fOk)
+                return error("UpdateAddressIndex() : updating history failed");
+        }
+    }
+
+    // One read and write per address for the whole block
+    foreach(PAIRTYPE(const uint160, CAddrBalance)& item, mapBalanceChange)
+    {
+        CAddrBalance balance;
+        txdb.ReadAddrBalance(item.first, balance);
+        if (fConnect)
+        {
+            balance.nBalance += item.second.nBalance;
+            balance.nReceived += item.second.nReceived;
+        }
+        else
+        {
+            balance.nBalance -= item.second.nBalance;
+            balance.nReceived -= item.second.nReceived;
+        }
+        if (!txdb.WriteAddrBalance(item.first, balance))
+            return error("UpdateAddressIndex() : WriteAddrBalance failed");
+    }
+
+    return txdb.WriteAddrIndexTip(fConnect ? block.GetHash() : block.hashPrevBlock);
+}
+
 bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
 {
     // Disconnect in reverse order
@@ -1165,6 +1897,9 @@ bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
         if (!vtx[i].DisconnectInputs(txdb))
             return false;
 
+    if (fAddrIndex && !UpdateAddressIndex(txdb, *this, pindex->nHeight, false))
+        return false;
+
     // Update block index on disk without changing it in memory.
     // The memory index structure will be changed after the db commits.
     if (pindex->pprev)
@@ -1196,6 +1931,9 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex)
     if (vtx[0].GetValueOut() > GetBlockValue(nFees))
         return false;
 
+    if (fAddrIndex && !UpdateAddressIndex(txdb, *this, pindex->nHeight, true))
+        return false;
+
     // Update block index on disk without changing it in memory.
     // The memory index structure will be changed after the db commits.
     if (pindex->pprev)
@@ -1219,17 +1957,20 @@ bool Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
     if (fDebug)
         printf("[BLOCK] REORGANIZE\n");
 
-    // Find the fork
-    CBlockIndex* pfork = pindexBest;
-    CBlockIndex* plonger = pindexNew;
-    while (pfork != plonger)
+    // Find the fork, the highest ancestor of pindexNew still on the main chain
+    int nLow = 0;
+    int nHigh = min(pindexNew->nHeight, pindexBest->nHeight);
+    while (nLow < nHigh)
     {
-        if (!(pfork = pfork->pprev))
-            return error("Reorganize() : pfork->pprev is null");
-        while (plonger->nHeight > pfork->nHeight)
-            if (!(plonger = plonger->pprev))
-                return error("Reorganize() : plonger->pprev is null");
+        int nMid = (nLow + nHigh + 1) / 2;
+        if (pindexNew->GetAncestor(nMid)->IsInMainChain())
+            nLow = nMid;
+        else
+            nHigh = nMid - 1;
     }
+    CBlockIndex* pfork = pindexNew->GetAncestor(nLow);
+    if (!pfork || !pfork->IsInMainChain())
+        return error("Reorganize() : no common ancestor with the main chain");
 
     // Reorganize is costly in terms of db load, as it works in a single db transaction.
     // Try to limit how much needs to be done inside
@@ -1285,8 +2026,8 @@ bool Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
                 CBlockIndex* pindex = vConnect[j];
                 pindex->EraseBlockFromDisk();
                 txdb.EraseBlockIndex(pindex->GetBlockHash());
+                InvalidateHeaders(pindex);
                 mapBlockIndex.erase(pindex->GetBlockHash());
-                delete pindex;
             }
             return error("Reorganize() : ConnectBlock failed");
         }
@@ -1310,6 +2051,13 @@ bool Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
     foreach(CBlockIndex* pindex, vConnect)
         if (pindex->pprev)
             pindex->pprev->pnext = pindex;
+    SetBlockIndexByHeight(pindexNew);
+
+    // Cached RPC replies about the old branch are no longer true
+    RPCCacheInvalidate(pfork->nHeight);
+
+    // Coinbases in the old branch are immature again
+    InvalidateWalletBalance();
 
     // Resurrect memory transactions that were in the disconnected branch
     foreach(CTransaction& tx, vResurrect)
@@ -1317,7 +2065,10 @@ bool Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
 
     // Delete redundant memory transactions that are in the connected branch
     foreach(CTransaction& tx, vDelete)
+    {
         tx.RemoveFromMemoryPool();
+        filterRecentConfirmed.insert(tx.GetHash());
+    }
 
     return true;
 }
@@ -1329,12 +2080,7 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
     if (mapBlockIndex.count(hash))
         return error("AddToBlockIndex() : %s already exists", hash.ToString().substr(0,16).c_str());
 
-    CBlockIndex* pindexNew = new CBlockIndex(nFile, nBlockPos, *this);
-    if (!pindexNew)
-        return error("AddToBlockIndex() : new CBlockIndex failed");
-
-    auto mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
-    pindexNew->phashBlock = &((*mi).first);
+    CBlockIndex* pindexNew = mapBlockIndex.insert(hash, CBlockIndex(nFile, nBlockPos, *this));
 
     auto miPrev = mapBlockIndex.find(hashPrevBlock);
     if (miPrev != mapBlockIndex.end())
@@ -1342,6 +2088,8 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
         pindexNew->pprev = (*miPrev).second;
         pindexNew->nHeight = pindexNew->pprev->nHeight + 1;
     }
+    pindexNew->BuildSkip();
+    ReplaceHeaderEntry(pindexNew);
 
     // Check against checkpoints
     if (!Checkpoints::CheckBlock(pindexNew->nHeight, hash))
@@ -1364,8 +2112,8 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
             {
                 txdb.TxnAbort();
                 pindexNew->EraseBlockFromDisk();
-                mapBlockIndex.erase(pindexNew->GetBlockHash());
-                delete pindexNew;
+                InvalidateHeaders(pindexNew);
+                mapBlockIndex.erase(hash);
                 return error("AddToBlockIndex() : ConnectBlock failed");
             }
             txdb.TxnCommit();
@@ -1376,7 +2124,10 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
                 pindexGenesisBlock = pindexNew;
 
             foreach(CTransaction& tx, vtx)
+            {
                 tx.RemoveFromMemoryPool();
+                filterRecentConfirmed.insert(tx.GetHash());
+            }
         }
         else
         {
@@ -1390,6 +2141,7 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
         hashBestChain = hash;
         pindexBest = pindexNew;
         nBestHeight = pindexBest->nHeight;
+        SetBlockIndexByHeight(pindexBest);
         nTimeBestReceived = GetTime();
         nTransactionsUpdated++;
         if (fDebug)
@@ -1398,6 +2150,7 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
 
     txdb.TxnCommit();
     txdb.Close();
+    FlushBlockStore();
 
     if (pindexNew == pindexBest)
     {
@@ -1405,6 +2158,15 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
         CRITICAL_BLOCK(cs_mapWallet)
             vWalletUpdated.push_back(hashPrevBestCoinBase);
         hashPrevBestCoinBase = vtx[0].GetHash();
+
+        if (NotifyWanted("hashblock"))
+            PublishHash("hashblock", hash);
+        if (NotifyWanted("rawblock"))
+        {
+            CPublicDataStream ss(SER_NETWORK);
+            ss << *this;
+            PublishNotification("rawblock", &ss[0], ss.size());
+        }
     }
 
     MainFrameRepaint();
@@ -1534,13 +2296,123 @@ bool CBlock::AcceptBlock()
     {
         if (fDebug)
             printf("[BLOCK] New best block %s at height %d\n", hash.ToString().substr(0,16).c_str(), nBestHeight);
+        CInv inv(MSG_BLOCK, hash);
+        bool fAnnounced = false;
+        CSharedNetMessage pmsgCompact;
         CRITICAL_BLOCK(cs_vNodes)
             foreach(CNode* pnode, vNodes)
                 if (nBestHeight > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : 55000))
-                    pnode->PushInventory(CInv(MSG_BLOCK, hash));
+                {
+                    // Push it straight to peers that can rebuild it from their memory pool
+                    if ((pnode->nServices & NODE_COMPACT) && !pnode->IsInventoryKnown(inv))
+                    {
+                        if (!pmsgCompact)
+                        {
+                            CPublicDataStream ss(SER_NETWORK);
+                            ss << CCompactBlock(*this);
+                            pmsgCompact = MakeSharedMessage("cmpctblock", ss);
+                        }
+                        pnode->AddInventoryKnown(inv);
+                        pnode->PushSharedMessage(pmsgCompact);
+                    }
+                    else
+                        pnode->PushInventory(inv);
+                    fAnnounced = true;
+                }
+
+        // Serialize it once for all the peers that will ask for it
+        if (fAnnounced)
+        {
+            CPublicDataStream ss(SER_NETWORK);
+            ss.reserve(::GetSerializeSize(*this, SER_NETWORK));
+            ss << *this;
+            SaveRelayMessage(inv, ss);
+        }
     }
 
-    return true;
+    return true;
+}
+
+bool CCompactBlock::FillBlock(CBlock& block) const
+{
+    unsigned int nTx = vPrefilled.size() + vShortID.size();
+    if (nTx == 0 || nTx > MAX_BLOCK_SIZE / 60)
+        return error("CCompactBlock::FillBlock() : bad transaction count %u", nTx);
+
+    block = header;
+    block.vtx.assign(nTx, CTransaction());
+    foreach(const CPrefilledTx& prefilled, vPrefilled)
+    {
+        if (prefilled.nIndex >= nTx || !block.vtx[prefilled.nIndex].IsNull() || prefilled.tx.IsNull())
+            return error("CCompactBlock::FillBlock() : bad prefilled index %u", prefilled.nIndex);
+        block.vtx[prefilled.nIndex] = prefilled.tx;
+    }
+
+    // The short ids fill the remaining slots in order
+    map<uint64, unsigned int> mapSlot;
+    unsigned int j = 0;
+    for (unsigned int i = 0; i < nTx; i++)
+        if (block.vtx[i].IsNull())
+            if (!mapSlot.insert(make_pair(vShortID[j++], i)).second)
+                return error("CCompactBlock::FillBlock() : duplicate short id");
+
+    // Two pool transactions with the same short id, ask for that slot instead
+    uint256 hashSalt = GetSalt();
+    set<unsigned int> setCollision;
+    CRITICAL_BLOCK(cs_mapTransactions)
+    {
+        for (map<uint256, CTransaction>::iterator mi = mapTransactions.begin(); mi != mapTransactions.end(); ++mi)
+        {
+            map<uint64, unsigned int>::iterator it = mapSlot.find(GetShortID(hashSalt, (*mi).first));
+            if (it == mapSlot.end())
+                continue;
+            if (!block.vtx[(*it).second].IsNull())
+                setCollision.insert((*it).second);
+            block.vtx[(*it).second] = (*mi).second;
+        }
+    }
+    foreach(unsigned int nIndex, setCollision)
+        block.vtx[nIndex].SetNull();
+
+    return true;
+}
+
+static void RequestFullBlock(CNode* pfrom, const uint256& hash)
+{
+    pfrom->PushMessage("getdata", vector<CInv>(1, CInv(MSG_BLOCK, hash)));
+}
+
+static void ProcessCompactBlock(CNode* pfrom, CBlock& block)
+{
+    uint256 hash = block.GetHash();
+
+    // A short id matching the wrong transaction shows up as a bad merkle root
+    if (block.hashMerkleRoot != block.BuildMerkleTree())
+    {
+        if (fDebug)
+            printf("[BLOCK] Compact block %s did not rebuild, fetching in full\n", hash.ToString().substr(0,16).c_str());
+        RequestFullBlock(pfrom, hash);
+        return;
+    }
+
+    CInv inv(MSG_BLOCK, hash);
+    MarkBlockReceived(hash);
+    if (ProcessBlock(pfrom, new CBlock(block)))
+        mapAlreadyAskedFor.erase(inv);
+}
+
+void RequestOrphanAncestors(CNode* pfrom, const CBlock* pblockOrphan)
+{
+    // Nothing to ask for if the gap is already on our header chain,
+    // the download window will get to it
+    const CBlock* pblockRoot = mapOrphanBlocks[GetOrphanRoot(pblockOrphan)];
+    if (mapHeaderIndex.count(pblockRoot->hashPrevBlock))
+        return;
+
+    if (pfrom->nServices & NODE_HEADERS)
+        pfrom->PushGetHeaders(GetBestHeader());
+    else
+        pfrom->PushGetBlocks(pindexBest, pblockRoot->GetHash());
 }
 
 bool ProcessBlock(CNode* pfrom, CBlock* pblock)
@@ -1548,7 +2420,7 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
     // Check for duplicate
     uint256 hash = pblock->GetHash();
     if (mapBlockIndex.count(hash))
-        return error("ProcessBlock() : already have block %d %s", mapBlockIndex[hash]->nHeight, hash.ToString().substr(0,16).c_str());
+        return error("ProcessBlock() : already have block %d %s", mapBlockIndex.find(hash)->second->nHeight, hash.ToString().substr(0,16).c_str());
     if (mapOrphanBlocks.count(hash))
         return error("ProcessBlock() : already have block (orphan) %s", hash.ToString().substr(0,16).c_str());
 
@@ -1569,7 +2441,7 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
 
         // Ask this guy to fill in what we're missing
         if (pfrom)
-            pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(pblock));
+            RequestOrphanAncestors(pfrom, pblock);
         return true;
     }
 
@@ -1577,6 +2449,7 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
     if (!pblock->AcceptBlock())
     {
         delete pblock;
+        InvalidateHeaders(hash);
         return error("ProcessBlock() : AcceptBlock FAILED");
     }
     delete pblock;
@@ -1594,6 +2467,8 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
             CBlock* pblockOrphan = (*mi).second;
             if (pblockOrphan->AcceptBlock())
                 vWorkQueue.push_back(pblockOrphan->GetHash());
+            else
+                InvalidateHeaders(pblockOrphan->GetHash());
             mapOrphanBlocks.erase(pblockOrphan->GetHash());
             delete pblockOrphan;
         }
@@ -1717,6 +2592,205 @@ FILE* AppendBlockFile(unsigned int& nFileRet)
     }
 }
 
+
+
+//
+// Durability policy for block files and the block index.
+//
+// In strict mode (the default) every block is fsynced as it's written and
+// every blkindex.dat transaction waits for its log records to reach the disk.
+// With -dbsync=batched blocks are only fflushed, CTxDB transactions commit
+// with DB_TXN_NOSYNC, and FlushBlockStore syncs the block files and then the
+// db log every nDBSyncBlocks blocks or nDBSyncInterval seconds.  After each
+// sync it records the tip it made durable, and after a crash CheckDurableTip
+// rolls the index back to below any block whose data didn't survive.
+//
+static set<unsigned int> setDirtyBlockFiles;
+static int nBlocksSinceSync = 0;
+static int64 nLastBlockStoreSync = 0;
+static uint256 hashLastDurableTip = 0;
+
+bool RollbackToDurableTip(CTxDB& txdb, uint256 hashDurableTip);
+
+void FileCommit(FILE* file)
+{
+    fflush(file);
+#if defined(_WIN32) || defined(__MINGW32__) || defined(__WXMSW__)
+    _commit(_fileno(file));
+#else
+    fsync(fileno(file));
+#endif
+}
+
+void SetBlockFileDirty(unsigned int nFile)
+{
+    CRITICAL_BLOCK(cs_main)
+    {
+        setDirtyBlockFiles.insert(nFile);
+        nBlocksSinceSync++;
+    }
+}
+
+void FlushBlockStore(bool fForce)
+{
+    if (!fBatchedDBSync || fClient)
+        return;
+
+    CRITICAL_BLOCK(cs_main)
+    {
+        if (nLastBlockStoreSync == 0)
+            nLastBlockStoreSync = GetTime();
+        if (hashBestChain == hashLastDurableTip && setDirtyBlockFiles.empty())
+            return;
+        if (!fForce && hashLastDurableTip != 0 && nBlocksSinceSync < nDBSyncBlocks && GetTime() - nLastBlockStoreSync < nDBSyncInterval)
+            return;
+
+        int64 nStart = GetTimeMillis();
+        int nBlocks = nBlocksSinceSync;
+
+        // Block data has to be on disk before the index that points to it
+        foreach(unsigned int nFile, setDirtyBlockFiles)
+        {
+            FILE* file = OpenBlockFile(nFile, 0, "ab");
+            if (!file)
+            {
+                printf("ERROR: FlushBlockStore() : OpenBlockFile %u failed\n", nFile);
+                continue;
+            }
+            FileCommit(file);
+            fclose(file);
+        }
+        DBLogFlush();
+
+        // Written with a synchronous commit, so this is durable when it returns
+        if (hashBestChain != 0)
+            CTxDB().WriteDurableTip(hashBestChain);
+
+        setDirtyBlockFiles.clear();
+        hashLastDurableTip = hashBestChain;
+        nBlocksSinceSync = 0;
+        nLastBlockStoreSync = GetTime();
+        if (fDebug)
+            printf("[DBSYNC] synced %d blocks, durable tip height=%d %" PRI64d "ms\n", nBlocks, nBestHeight, GetTimeMillis() - nStart);
+    }
+}
+
+bool CheckDurableTip(CTxDB& txdb)
+{
+    if (fClient || pindexBest == NULL)
+        return true;
+
+    // No marker means the last run was in strict mode and everything is durable
+    uint256 hashDurableTip;
+    if (!txdb.ReadDurableTip(hashDurableTip))
+        hashDurableTip = hashBestChain;
+    if (hashDurableTip != hashBestChain && !RollbackToDurableTip(txdb, hashDurableTip))
+        return false;
+
+    if (fBatchedDBSync)
+        txdb.WriteDurableTip(hashBestChain);
+    else
+        txdb.EraseDurableTip();
+    hashLastDurableTip = hashBestChain;
+    return true;
+}
+
+bool RollbackToDurableTip(CTxDB& txdb, uint256 hashDurableTip)
+{
+    // Everything above the point where the durable tip meets the best chain
+    // was committed after the last sync, so its block data may be missing
+    CBlockIndex* pindexDurable = NULL;
+    auto mi = mapBlockIndex.find(hashDurableTip);
+    if (mi != mapBlockIndex.end())
+    {
+        pindexDurable = (*mi).second;
+        while (pindexDurable && !pindexDurable->IsInMainChain())
+            pindexDurable = pindexDurable->pprev;
+    }
+
+    printf("RollbackToDurableTip() : last durable tip %s, checking blocks above height %d\n",
+        hashDurableTip.ToString().substr(0,16).c_str(), pindexDurable ? pindexDurable->nHeight : -1);
+
+    CBlockIndex* pindexLost = NULL;
+    for (CBlockIndex* pindex = pindexBest; pindex && pindex != pindexDurable; pindex = pindex->pprev)
+    {
+        bool fHave = false;
+        try
+        {
+            CBlock block;
+            fHave = (block.ReadFromDisk(pindex->nFile, pindex->nBlockPos) && block.GetHash() == pindex->GetBlockHash());
+        }
+        catch (std::exception& e) { }
+        if (!fHave)
+            pindexLost = pindex;
+    }
+
+    if (pindexLost)
+    {
+        if (pindexLost->pprev == NULL)
+            return error("RollbackToDurableTip() : genesis block data is missing");
+        CBlockIndex* pindexNewBest = pindexLost->pprev;
+        printf("RollbackToDurableTip() : block %d data lost, rolling back from height %d to %d\n",
+            pindexLost->nHeight, nBestHeight, pindexNewBest->nHeight);
+
+        // Drop the blocks above the new tip from the index so they can be
+        // downloaded again, along with any side branches built on them
+        set<CBlockIndex*> setErase;
+        set<pair<unsigned int, unsigned int> > setBlockPos;
+        for (CBlockIndex* pindex = pindexBest; pindex != pindexNewBest; pindex = pindex->pprev)
+        {
+            setErase.insert(pindex);
+            setBlockPos.insert(make_pair(pindex->nFile, pindex->nBlockPos));
+        }
+        bool fFound = true;
+        while (fFound)
+        {
+            fFound = false;
+            for (mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+            {
+                CBlockIndex* pindex = (*mi).second;
+                if (pindex->pprev && setErase.count(pindex->pprev) && !setErase.count(pindex))
+                {
+                    setErase.insert(pindex);
+                    fFound = true;
+                }
+            }
+        }
+
+        // Undo the tx index by disk position, the lost blocks can't be
+        // read back to run DisconnectInputs
+        txdb.TxnBegin();
+        if (!txdb.EraseTxIndexAtBlocks(setBlockPos))
+        {
+            txdb.TxnAbort();
+            return error("RollbackToDurableTip() : EraseTxIndexAtBlocks failed");
+        }
+        CDiskBlockIndex blockindexPrev(pindexNewBest);
+        blockindexPrev.hashNext = 0;
+        txdb.WriteBlockIndex(blockindexPrev);
+        foreach(CBlockIndex* pindex, setErase)
+            txdb.EraseBlockIndex(pindex->GetBlockHash());
+        if (!txdb.WriteHashBestChain(pindexNewBest->GetBlockHash()))
+        {
+            txdb.TxnAbort();
+            return error("RollbackToDurableTip() : WriteHashBestChain failed");
+        }
+        if (!txdb.TxnCommit())
+            return error("RollbackToDurableTip() : TxnCommit failed");
+
+        pindexNewBest->pnext = NULL;
+        foreach(CBlockIndex* pindex, setErase)
+        {
+            mapBlockIndex.erase(pindex->GetBlockHash());
+        }
+        hashBestChain = pindexNewBest->GetBlockHash();
+        pindexBest = pindexNewBest;
+        SetBlockIndexByHeight(pindexBest);
+        nBestHeight = pindexBest->nHeight;
+    }
+    return true;
+}
+
 //
 // Multi-threaded Genesis Mining
 //
@@ -1737,6 +2811,54 @@ void InitSHA256();
 void ThreadGenesisMiner(void* parg);
 
 
+// Brings the address index up to the current best chain.  It picks up
+// where it left off if the node ran without -addrindex for a while, and is
+// rebuilt from scratch if the blocks it covered are no longer the best chain.
+static bool SyncAddressIndex()
+{
+    if (!fAddrIndex || fClient || !pindexGenesisBlock)
+        return true;
+
+    CTxDB txdb;
+    CBlockIndex* pindex = pindexGenesisBlock;
+    uint256 hashTip;
+    if (txdb.ReadAddrIndexTip(hashTip))
+    {
+        auto mi = mapBlockIndex.find(hashTip);
+        if (mi != mapBlockIndex.end() && (*mi).second->IsInMainChain())
+            pindex = (*mi).second;
+        else
+        {
+            printf("Address index is not on the best chain, rebuilding\n");
+            if (!txdb.EraseAddrIndex())
+                return error("SyncAddressIndex() : EraseAddrIndex failed");
+        }
+    }
+    if (pindex == pindexBest)
+        return true;
+
+    printf("Building address index from height %d to %d\n", pindex->nHeight + 1, nBestHeight);
+    int64 nStart = GetTimeMillis();
+    for (pindex = pindex->pnext; pindex && !fShutdown; pindex = pindex->pnext)
+    {
+        CBlock block;
+        if (!block.ReadFromDisk(pindex))
+            return error("SyncAddressIndex() : ReadFromDisk failed at height %d", pindex->nHeight);
+        txdb.TxnBegin();
+        if (!UpdateAddressIndex(txdb, block, pindex->nHeight, true))
+        {
+            txdb.TxnAbort();
+            return error("SyncAddressIndex() : UpdateAddressIndex failed at height %d", pindex->nHeight);
+        }
+        if (!txdb.TxnCommit())
+            return error("SyncAddressIndex() : TxnCommit failed");
+        if (pindex->nHeight % 10000 == 0)
+            printf("Address index at height %d\n", pindex->nHeight);
+    }
+    printf("Address index built in %" PRI64d "ms\n", GetTimeMillis() - nStart);
+    return true;
+}
+
 bool LoadBlockIndex(bool fAllowNew)
 {
     //
@@ -1745,6 +2867,8 @@ bool LoadBlockIndex(bool fAllowNew)
     CTxDB txdb("cr");
     if (!txdb.LoadBlockIndex())
         return false;
+    if (!CheckDurableTip(txdb))
+        return false;
     txdb.Close();
 
     //
@@ -1859,7 +2983,7 @@ bool LoadBlockIndex(bool fAllowNew)
             return error("LoadBlockIndex() : genesis block not accepted");
     }
 
-    return true;
+    return SyncAddressIndex();
 }
 
 
@@ -1964,8 +3088,20 @@ bool AlreadyHave(CTxDB& txdb, const CInv& inv)
 {
     switch (inv.type)
     {
-    case MSG_TX:    return mapTransactions.count(inv.hash) || txdb.ContainsTx(inv.hash);
-    case MSG_BLOCK: return mapBlockIndex.count(inv.hash) || mapOrphanBlocks.count(inv.hash);
+    case MSG_TX:
+        {
+            // A new block can make rejected transactions valid
+            if (hashBestChain != hashRecentRejectsChainTip)
+            {
+                filterRecentRejects.reset();
+                hashRecentRejectsChainTip = hashBestChain;
+            }
+
+            // Older confirmed ones get fetched once and land in the rejects,
+            // so an inv flood never turns into database reads
+            return mapTransactions.count(inv.hash) || filterRecentRejects.contains(inv.hash) || filterRecentConfirmed.contains(inv.hash);
+        }
+    case MSG_BLOCK: return mapBlockIndex.count(inv.hash) || mapOrphanBlocks.count(inv.hash) || mapBlocksInFlight.count(inv.hash);
     }
     // Don't know what it is, just say we already got one
     return true;
@@ -1979,12 +3115,6 @@ bool AlreadyHave(CTxDB& txdb, const CInv& inv)
 
 bool ProcessMessages(CNode* pfrom)
 {
-    CDataStream& vRecv = pfrom->vRecv;
-    if (vRecv.empty())
-        return true;
-    //if (fDebug)
-    //    printf("ProcessMessages(%d bytes)\n", vRecv.size());
-
     //
     // Message format
     //  (4) message start
@@ -1993,52 +3123,22 @@ bool ProcessMessages(CNode* pfrom)
     //  (4) checksum
     //  (x) data
     //
+    // The socket thread has already split the stream into messages,
+    // each payload in its own buffer.
+    //
 
-    loop
+    // Leave the rest for a later pass so one busy peer can't starve the others
+    int nMessages = 0;
+    while (nMessages++ < 50 && !pfrom->vRecvMsg.empty() && pfrom->vRecvMsg.front().Complete())
     {
-        // Scan for message start
-        CDataStream::iterator pstart = search(vRecv.begin(), vRecv.end(), BEGIN(pchMessageStart), END(pchMessageStart));
-        int nHeaderSize = vRecv.GetSerializeSize(CMessageHeader());
-        if (vRecv.end() - pstart < nHeaderSize)
-        {
-            if (vRecv.size() > nHeaderSize)
-            {
-                printf("\n\nPROCESSMESSAGE MESSAGESTART NOT FOUND\n\n");
-                vRecv.erase(vRecv.begin(), vRecv.end() - nHeaderSize);
-            }
-            break;
-        }
-        if (pstart - vRecv.begin() > 0)
-            printf("\n\nPROCESSMESSAGE SKIPPED %d BYTES\n\n", pstart - vRecv.begin());
-        vRecv.erase(vRecv.begin(), pstart);
-
-        // Read header
-        vector<char> vHeaderSave(vRecv.begin(), vRecv.begin() + nHeaderSize);
-        CMessageHeader hdr;
-        vRecv >> hdr;
-        if (!hdr.IsValid())
-        {
-            printf("\n\nPROCESSMESSAGE: ERRORS IN HEADER %s\n\n\n", hdr.GetCommand().c_str());
-            continue;
-        }
+        CNetMessage& msg = pfrom->vRecvMsg.front();
+        CMessageHeader& hdr = msg.hdr;
         string strCommand = hdr.GetCommand();
-
-        // Message size
         unsigned int nMessageSize = hdr.nMessageSize;
-        if (nMessageSize > vRecv.size())
-        {
-            // Rewind and wait for rest of message
-            ///// need a mechanism to give up waiting for overlong message size error
-            vRecv.insert(vRecv.begin(), &vHeaderSave[0], &vHeaderSave[0] + vHeaderSave.size());
-            break;
-        }
-
-        // Copy message to its own buffer
-        CDataStream vMsg(vRecv.begin(), vRecv.begin() + nMessageSize, vRecv.nType, vRecv.nVersion);
-        vRecv.ignore(nMessageSize);
 
         // Checksum
-        if (vRecv.GetVersion() >= 209)
+        CPublicDataStream& vMsg = msg.vRecv;
+        if (vMsg.GetVersion() >= 209)
         {
             uint256 hash = Hash(vMsg.begin(), vMsg.end());
             unsigned int nChecksum = 0;
@@ -2047,10 +3147,15 @@ bool ProcessMessages(CNode* pfrom)
             {
                 printf("ProcessMessage(%s, %d bytes) : CHECKSUM ERROR nChecksum=%08x hdr.nChecksum=%08x\n",
                        strCommand.c_str(), nMessageSize, nChecksum, hdr.nChecksum);
+                pfrom->vRecvMsg.pop_front();
                 continue;
             }
         }
 
+        // The version message may have changed these since the bytes arrived
+        vMsg.SetType(pfrom->nRecvType);
+        vMsg.SetVersion(pfrom->nRecvVersion);
+
         // Process message
         bool fRet = false;
         try
@@ -2085,16 +3190,16 @@ bool ProcessMessages(CNode* pfrom)
 
         if (!fRet)
             printf("ProcessMessage(%s, %d bytes) FAILED\n", strCommand.c_str(), nMessageSize);
+        pfrom->vRecvMsg.pop_front();
     }
 
-    vRecv.Compact();
     return true;
 }
 
 
 
 
-bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
+bool ProcessMessage(CNode* pfrom, string strCommand, CPublicDataStream& vRecv)
 {
     static map<unsigned int, vector<unsigned char> > mapReuseKey;
     RandAddSeedPerfmon();
@@ -2149,7 +3254,7 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         if (pfrom->fClient)
         {
             pfrom->vSend.nType |= SER_BLOCKHEADERONLY;
-            pfrom->vRecv.nType |= SER_BLOCKHEADERONLY;
+            pfrom->nRecvType |= SER_BLOCKHEADERONLY;
         }
 
         AddTimeData(pfrom->addr.ip, nTime);
@@ -2159,16 +3264,23 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             pfrom->PushMessage("verack");
         pfrom->vSend.SetVersion(min(pfrom->nVersion, VERSION));
         if (pfrom->nVersion < 209)
-            pfrom->vRecv.SetVersion(min(pfrom->nVersion, VERSION));
+            pfrom->nRecvVersion = min(pfrom->nVersion, VERSION);
 
         // Ask the first connected node for block updates
         static int nAskedForBlocks;
         if (!pfrom->fClient && (nAskedForBlocks < 1 || vNodes.size() <= 1))
         {
             nAskedForBlocks++;
-            pfrom->PushGetBlocks(pindexBest, uint256(0));
+            if (pfrom->nServices & NODE_HEADERS)
+                pfrom->PushGetHeaders(GetBestHeader());
+            else
+                pfrom->PushGetBlocks(pindexBest, uint256(0));
         }
 
+        // An outbound peer that got this far is a good address
+        if (!pfrom->fInbound)
+            addrman.Good(pfrom->addr);
+
         pfrom->fSuccessfullyConnected = true;
 
         if (fDebug)
@@ -2185,7 +3297,7 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
     else if (strCommand == "verack")
     {
-        pfrom->vRecv.SetVersion(min(pfrom->nVersion, VERSION));
+        pfrom->nRecvVersion = min(pfrom->nVersion, VERSION);
     }
 
 
@@ -2206,7 +3318,7 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             addr.nTime = GetAdjustedTime() - 2 * 60 * 60;
             if (pfrom->fGetAddr || vAddr.size() > 10)
                 addr.nTime -= 5 * 24 * 60 * 60;
-            AddAddress(addr);
+            AddAddress(addr, pfrom->addr.ip);
             pfrom->AddAddressKnown(addr);
             if (!pfrom->fGetAddr && addr.IsRoutable())
             {
@@ -2248,12 +3360,13 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             pfrom->AddInventoryKnown(inv);
 
             bool fAlreadyHave = AlreadyHave(txdb, inv);
-            printf("  got inventory: %s  %s\n", inv.ToString().c_str(), fAlreadyHave ? "have" : "new");
+            if (fDebug)
+                printf("[NET] got inventory: %s  %s\n", inv.ToString().c_str(), fAlreadyHave ? "have" : "new");
 
             if (!fAlreadyHave)
                 pfrom->AskFor(inv);
             else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash))
-                pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(mapOrphanBlocks[inv.hash]));
+                RequestOrphanAncestors(pfrom, mapOrphanBlocks[inv.hash]);
 
             // Track requests for our stuff
             CRITICAL_BLOCK(cs_mapRequestCount)
@@ -2286,10 +3399,19 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 auto mi = mapBlockIndex.find(inv.hash);
                 if (mi != mapBlockIndex.end())
                 {
-                    //// could optimize this to send header straight from blockindex for client
-                    CBlock block;
-                    block.ReadFromDisk((*mi).second, !pfrom->fClient);
-                    pfrom->PushMessage("block", block);
+                    // A block we just announced is still serialized in relay memory
+                    CSharedNetMessage pmsg;
+                    if (!pfrom->fClient)
+                        pmsg = relayCache.Find(inv);
+                    if (pmsg)
+                        pfrom->PushSharedMessage(pmsg);
+                    else
+                    {
+                        //// could optimize this to send header straight from blockindex for client
+                        CBlock block;
+                        block.ReadFromDisk((*mi).second, !pfrom->fClient);
+                        pfrom->PushMessage("block", block);
+                    }
 
                     // Trigger them to send a getblocks request for the next batch of inventory
                     if (inv.hash == pfrom->hashContinue)
@@ -2307,11 +3429,25 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             else if (inv.IsKnownType())
             {
                 // Send stream from relay memory
-                CRITICAL_BLOCK(cs_mapRelay)
+                CSharedNetMessage pmsg = relayCache.Find(inv);
+                if (pmsg)
+                    pfrom->PushSharedMessage(pmsg);
+                else if (inv.type == MSG_TX)
                 {
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
-                    if (mi != mapRelay.end())
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
+                    // Dropped from relay memory, the memory pool still has it
+                    CTransaction tx;
+                    bool fFound = false;
+                    CRITICAL_BLOCK(cs_mapTransactions)
+                    {
+                        map<uint256, CTransaction>::iterator mi = mapTransactions.find(inv.hash);
+                        if (mi != mapTransactions.end())
+                        {
+                            tx = (*mi).second;
+                            fFound = true;
+                        }
+                    }
+                    if (fFound)
+                        pfrom->PushMessage("tx", tx);
                 }
             }
 
@@ -2360,10 +3496,175 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     }
 
 
+    else if (strCommand == "getheaders")
+    {
+        CBlockLocator locator;
+        uint256 hashStop;
+        vRecv >> locator >> hashStop;
+
+        // Find the first block the caller has in the main chain
+        CBlockIndex* pindex = locator.GetBlockIndex();
+
+        // Send the headers that follow it
+        if (pindex)
+            pindex = pindex->pnext;
+        vector<CBlock> vHeaders;
+        for (; pindex; pindex = pindex->pnext)
+        {
+            vHeaders.push_back(pindex->GetBlockHeader());
+            if (vHeaders.size() >= MAX_HEADERS_RESULTS || pindex->GetBlockHash() == hashStop)
+                break;
+        }
+        if (fDebug)
+            printf("[NET] getheaders: sending %d headers\n", (int)vHeaders.size());
+        pfrom->PushMessage("headers", vHeaders);
+    }
+
+
+    else if (strCommand == "headers")
+    {
+        vector<CBlock> vHeaders;
+        vRecv >> vHeaders;
+        if (vHeaders.size() > MAX_HEADERS_RESULTS)
+            return error("message headers size() = %d", vHeaders.size());
+        if (vHeaders.empty())
+            return true;
+
+        // Doesn't connect to anything we know, start again from our best header
+        if (!LookupBlockIndex(vHeaders[0].hashPrevBlock))
+        {
+            pfrom->PushGetHeaders(GetBestHeader());
+            return true;
+        }
+
+        CBlockIndex* pindexLast = NULL;
+        foreach(const CBlock& header, vHeaders)
+        {
+            if (pindexLast && header.hashPrevBlock != pindexLast->GetBlockHash())
+                return error("message headers not continuous");
+            pindexLast = AcceptBlockHeader(header);
+            if (!pindexLast)
+                return error("message headers : AcceptBlockHeader failed");
+        }
+        pfrom->nStartingHeight = max(pfrom->nStartingHeight, pindexLast->nHeight);
+        if (fDebug)
+            printf("[NET] headers: received %d, best header height %d\n", (int)vHeaders.size(), GetBestHeader()->nHeight);
+
+        // A full batch means there are probably more
+        if (vHeaders.size() == MAX_HEADERS_RESULTS)
+            pfrom->PushGetHeaders(pindexLast);
+    }
+
+
+    else if (strCommand == "cmpctblock")
+    {
+        CCompactBlock cmpctblock;
+        vRecv >> cmpctblock;
+
+        uint256 hash = cmpctblock.header.GetHash();
+        CInv inv(MSG_BLOCK, hash);
+        pfrom->AddInventoryKnown(inv);
+        if (mapBlockIndex.count(hash) || mapOrphanBlocks.count(hash) || mapPartialBlocks.count(hash))
+            return true;
+
+        // Without its parent it can't be checked, take the long way round
+        if (!mapBlockIndex.count(cmpctblock.header.hashPrevBlock))
+        {
+            pfrom->AskFor(inv);
+            return true;
+        }
+        if (!AcceptBlockHeader(cmpctblock.header))
+            return error("message cmpctblock : AcceptBlockHeader failed");
+
+        CBlock block;
+        if (!cmpctblock.FillBlock(block))
+        {
+            RequestFullBlock(pfrom, hash);
+            return true;
+        }
+
+        CBlockTransactionsRequest req;
+        req.hashBlock = hash;
+        for (unsigned int i = 0; i < block.vtx.size(); i++)
+            if (block.vtx[i].IsNull())
+                req.vIndex.push_back(i);
+        if (fDebug)
+            printf("[BLOCK] Compact block %s, %d of %d transactions missing\n", hash.ToString().substr(0,16).c_str(), (int)req.vIndex.size(), (int)block.vtx.size());
+
+        if (req.vIndex.empty())
+        {
+            ProcessCompactBlock(pfrom, block);
+            return true;
+        }
+
+        // Wait for the rest, the download timeout covers a peer that never answers
+        MarkBlockReceived(hash);
+        mapBlocksInFlight[hash] = make_pair(pfrom, GetTime());
+        pfrom->nBlocksInFlight++;
+        mapPartialBlocks[hash] = make_pair(pfrom, block);
+        pfrom->PushMessage("getblocktxn", req);
+    }
+
+
+    else if (strCommand == "getblocktxn")
+    {
+        CBlockTransactionsRequest req;
+        vRecv >> req;
+
+        auto mi = mapBlockIndex.find(req.hashBlock);
+        if (mi == mapBlockIndex.end())
+            return true;
+        CBlock block;
+        if (!block.ReadFromDisk((*mi).second))
+            return error("message getblocktxn : ReadFromDisk failed");
+
+        CBlockTransactions resp;
+        resp.hashBlock = req.hashBlock;
+        foreach(unsigned int nIndex, req.vIndex)
+        {
+            if (nIndex >= block.vtx.size())
+                return error("message getblocktxn index %u out of range", nIndex);
+            resp.vtx.push_back(block.vtx[nIndex]);
+        }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
+
+    else if (strCommand == "blocktxn")
+    {
+        CBlockTransactions resp;
+        vRecv >> resp;
+
+        map<uint256, pair<CNode*, CBlock> >::iterator mi = mapPartialBlocks.find(resp.hashBlock);
+        if (mi == mapPartialBlocks.end() || (*mi).second.first != pfrom)
+            return true;
+        CBlock block = (*mi).second.second;
+        MarkBlockReceived(resp.hashBlock);
+
+        unsigned int j = 0;
+        bool fMissing = false;
+        for (unsigned int i = 0; i < block.vtx.size(); i++)
+        {
+            if (!block.vtx[i].IsNull())
+                continue;
+            if (j < resp.vtx.size())
+                block.vtx[i] = resp.vtx[j++];
+            else
+                fMissing = true;
+        }
+        if (fMissing || j != resp.vtx.size())
+        {
+            RequestFullBlock(pfrom, resp.hashBlock);
+            return error("message blocktxn : wrong number of transactions");
+        }
+        ProcessCompactBlock(pfrom, block);
+    }
+
+
     else if (strCommand == "tx")
     {
         vector<uint256> vWorkQueue;
-        CDataStream vMsg(vRecv);
+        CPublicDataStream vMsg(vRecv);
         CTransaction tx;
         vRecv >> tx;
 
@@ -2386,13 +3687,13 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             for (int i = 0; i < vWorkQueue.size(); i++)
             {
                 uint256 hashPrev = vWorkQueue[i];
-                for (multimap<uint256, CDataStream*>::iterator mi = mapOrphanTransactionsByPrev.lower_bound(hashPrev);
+                for (multimap<uint256, CPublicDataStream*>::iterator mi = mapOrphanTransactionsByPrev.lower_bound(hashPrev);
                      mi != mapOrphanTransactionsByPrev.upper_bound(hashPrev);
                      ++mi)
                 {
-                    const CDataStream& vMsg = *((*mi).second);
+                    const CPublicDataStream& vMsg = *((*mi).second);
                     CTransaction tx;
-                    CDataStream(vMsg) >> tx;
+                    CPublicDataStream(vMsg) >> tx;
                     CInv inv(MSG_TX, tx.GetHash());
 
                     if (tx.AcceptTransaction(true))
@@ -2416,6 +3717,8 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 printf("[TX] Storing orphan tx %s\n", inv.hash.ToString().substr(0,6).c_str());
             AddOrphanTx(vMsg);
         }
+        else
+            filterRecentRejects.insert(inv.hash);
     }
 
 
@@ -2433,6 +3736,7 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         CInv inv(MSG_BLOCK, pblock->GetHash());
         pfrom->AddInventoryKnown(inv);
 
+        MarkBlockReceived(inv.hash);
         if (ProcessBlock(pfrom, pblock.release()))
             mapAlreadyAskedFor.erase(inv);
     }
@@ -2444,18 +3748,8 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         // since they rebroadcast an addr every 24 hours
         pfrom->vAddrToSend.clear();
         int64 nSince = GetAdjustedTime() - 24 * 60 * 60; // in the last 24 hours
-        CRITICAL_BLOCK(cs_mapAddresses)
-        {
-            unsigned int nSize = mapAddresses.size();
-            foreach(const PAIRTYPE(vector<unsigned char>, CAddress)& item, mapAddresses)
-            {
-                if (fShutdown)
-                    return true;
-                const CAddress& addr = item.second;
-                if (addr.nTime > nSince)
-                    pfrom->PushAddress(addr);
-            }
-        }
+        foreach(const CAddress& addr, addrman.GetAddr(nSince))
+            pfrom->PushAddress(addr);
     }
 
 
@@ -2558,7 +3852,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             return true;
 
         // Keep-alive ping
-        if (pto->nLastSend && GetTime() - pto->nLastSend > 30 * 60 && pto->vSend.empty())
+        if (pto->nLastSend && GetTime() - pto->nLastSend > 30 * 60 && pto->IsSendQueueEmpty())
             pto->PushMessage("ping");
 
         // Address refresh broadcast
@@ -2580,6 +3874,24 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             }
         }
 
+        // Forget requests old enough that they'd go out right away anyway,
+        // and relay messages past their time even when nothing new is relayed
+        static int64 nLastAskedForPrune;
+        if (GetTime() - nLastAskedForPrune > 60)
+        {
+            nLastAskedForPrune = GetTime();
+            relayCache.Expire();
+            int64 nOld = (GetTime() - 15 * 60) * 1000000;
+            map<CInv, int64>::iterator mi = mapAlreadyAskedFor.begin();
+            while (mi != mapAlreadyAskedFor.end())
+            {
+                if ((*mi).second < nOld)
+                    mapAlreadyAskedFor.erase(mi++);
+                else
+                    ++mi;
+            }
+        }
+
         // Resend wallet transactions that haven't gotten in a block yet
         ResendWalletTransactions();
 
@@ -2622,7 +3934,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             vInvWait.reserve(pto->vInventoryToSend.size());
             foreach(const CInv& inv, pto->vInventoryToSend)
             {
-                if (pto->setInventoryKnown.count(inv))
+                if (pto->filterInventoryKnown.contains(inv.hash))
                     continue;
 
                 // trickle out tx inv to protect privacy
@@ -2658,15 +3970,12 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                     }
                 }
 
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second)
+                pto->filterInventoryKnown.insert(inv.hash);
+                vInv.push_back(inv);
+                if (vInv.size() >= 1000)
                 {
-                    vInv.push_back(inv);
-                    if (vInv.size() >= 1000)
-                    {
-                        pto->PushMessage("inv", vInv);
-                        vInv.clear();
-                    }
+                    pto->PushMessage("inv", vInv);
+                    vInv.clear();
                 }
             }
             pto->vInventoryToSend = vInvWait;
@@ -2686,7 +3995,8 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             const CInv& inv = (*pto->mapAskFor.begin()).second;
             if (!AlreadyHave(txdb, inv))
             {
-                printf("sending getdata: %s\n", inv.ToString().c_str());
+                if (fDebug)
+                    printf("[NET] sending getdata: %s\n", inv.ToString().c_str());
                 vGetData.push_back(inv);
                 if (vGetData.size() >= 1000)
                 {
@@ -2696,6 +4006,20 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             }
             pto->mapAskFor.erase(pto->mapAskFor.begin());
         }
+
+        // Fill this peer's share of the download window along the header chain
+        if ((pto->nServices & NODE_HEADERS) && !pto->fClient && !pto->fDisconnect)
+        {
+            ExpireBlocksInFlight();
+            vector<CBlockIndex*> vToFetch;
+            FindBlocksToDownload(pto, MAX_BLOCKS_IN_TRANSIT_PER_PEER - pto->nBlocksInFlight, vToFetch);
+            foreach(CBlockIndex* pindex, vToFetch)
+            {
+                vGetData.push_back(CInv(MSG_BLOCK, pindex->GetBlockHash()));
+                mapBlocksInFlight[pindex->GetBlockHash()] = make_pair(pto, GetTime());
+                pto->nBlocksInFlight++;
+            }
+        }
         if (!vGetData.empty())
             pto->PushMessage("getdata", vGetData);
 
@@ -3371,21 +4695,21 @@ int64 GetNetworkHashPS(int lookup)
 {
     CBlockIndex *pb = pindexBest;
 
-    if (pb == NULL || nBestHeight < 2)
+    if (pb == NULL || pb->nHeight < 2)
         return 0;
 
     // Adjust lookup to available blocks
-    int actualLookup = (nBestHeight < lookup) ? (int)nBestHeight : lookup;
+    int actualLookup = (pb->nHeight < lookup) ? pb->nHeight : lookup;
 
     // Store the last block
     CBlockIndex *pbLast = pb;
     int64 timeLast = pbLast->nTime;
 
-    // Go back actualLookup blocks
-    for (int i = 0; i < actualLookup && pb->pprev != NULL; i++)
-    {
-        pb = pb->pprev;
-    }
+    // GetAncestor only follows pprev/pskip, which are fixed once a block
+    // index entry is built, so a reorg on another thread can't move them
+    pb = pbLast->GetAncestor(pbLast->nHeight - actualLookup);
+    if (pb == NULL)
+        return 0;
 
     int64 timeFirst = pb->nTime;
 
@@ -3444,13 +4768,8 @@ int64 GetBalance()
     int64 nTotal = 0;
     CRITICAL_BLOCK(cs_mapWallet)
     {
-        for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            CWalletTx* pcoin = &(*it).second;
-            if (!pcoin->IsFinal() || pcoin->fSpent)
-                continue;
-            nTotal += pcoin->GetCredit(true);
-        }
+        SettleWalletBalance();
+        nTotal = nWalletBalance;
     }
 
     //printf("GetBalance() %"PRI64d"ms\n", GetTimeMillis() - nStart);
@@ -3471,12 +4790,11 @@ bool SelectCoins(int64 nTargetValue, set<CWalletTx*>& setCoinsRet)
 
     CRITICAL_BLOCK(cs_mapWallet)
     {
+        SettleWalletBalance();
         for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
         {
             CWalletTx* pcoin = &(*it).second;
-            if (!pcoin->IsFinal() || pcoin->fSpent)
-                continue;
-            int64 n = pcoin->GetCredit();
+            int64 n = pcoin->nAvailableCredit;
             if (n <= 0)
                 continue;
             if (n < nTargetValue)
@@ -3681,9 +4999,11 @@ bool CommitTransaction(CWalletTx& wtxNew, const CKey& key)
                 setCoins.insert(&mapWallet[txin.prevout.hash]);
             foreach(CWalletTx* pcoin, setCoins)
             {
+                uint256 hashCoin = pcoin->GetHash();
                 pcoin->fSpent = true;
+                UpdateWalletBalance(hashCoin, *pcoin);
                 pcoin->WriteToDisk();
-                vWalletUpdated.push_back(pcoin->GetHash());
+                vWalletUpdated.push_back(hashCoin);
             }
         }
 
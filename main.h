@@ -13,12 +13,18 @@ class CTxOut;
 class CTransaction;
 class CBlock;
 class CBlockIndex;
+class CBlockIndexMap;
 class CWalletTx;
 class CKeyItem;
 
 static const unsigned int MAX_BLOCK_SIZE = 1000000;
 static const unsigned int MAX_SIZE = 0x02000000;
 static const unsigned int MAX_INV_SZ = 50000;
+static const unsigned int MAX_HEADERS_RESULTS = 2000;
+static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+static const int BLOCK_DOWNLOAD_WINDOW = 1024;
+static const int64 BLOCK_DOWNLOAD_TIMEOUT = 2 * 60;
+static const int MAX_HEADER_FORK_DEPTH = 288;
 static const int64 COIN = 100000000;
 static const int64 CENT = 1000000;
 static const int COINBASE_MATURITY = 100;
@@ -38,18 +44,20 @@ static const CBigNum bnProofOfWorkLimit(~uint256(0) >> 17);
 
 
 extern CCriticalSection cs_main;
-extern map<uint256, CBlockIndex*> mapBlockIndex;
+extern CBlockIndexMap mapBlockIndex;
 extern uint256 hashGenesisBlock;
 extern CBlockIndex* pindexGenesisBlock;
 extern int nBestHeight;
 extern uint256 hashBestChain;
 extern CBlockIndex* pindexBest;
+extern vector<CBlockIndex*> vBlockIndexByHeight;
 extern unsigned int nTransactionsUpdated;
 extern map<uint256, int> mapRequestCount;
 extern CCriticalSection cs_mapRequestCount;
 extern map<string, string> mapAddressBook;
 extern CCriticalSection cs_mapAddressBook;
 extern vector<unsigned char> vchDefaultKey;
+extern unsigned int nWalletTxChanges;
 
 // Settings
 extern int fGenerateBitcoins;
@@ -59,6 +67,10 @@ extern int fLimitProcessors;
 extern int nLimitProcessors;
 extern int fMinimizeToTray;
 extern int fMinimizeOnClose;
+extern bool fBatchedDBSync;
+extern bool fAddrIndex;
+extern int nDBSyncBlocks;
+extern int64 nDBSyncInterval;
 
 
 
@@ -69,17 +81,25 @@ extern int fMinimizeOnClose;
 bool CheckDiskSpace(int64 nAdditionalBytes=0);
 FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode="rb");
 FILE* AppendBlockFile(unsigned int& nFileRet);
+void FileCommit(FILE* file);
+void SetBlockFileDirty(unsigned int nFile);
+void FlushBlockStore(bool fForce=false);
 bool AddKey(const CKey& key);
 vector<unsigned char> GenerateNewKey();
 bool AddToWallet(const CWalletTx& wtxIn);
+void AddToWalletIndexes(const uint256& hash, const CWalletTx& wtx);
 void WalletUpdateSpent(const COutPoint& prevout);
 void ReacceptWalletTransactions();
 bool LoadBlockIndex(bool fAllowNew=true);
 void PrintBlockTree();
+void SetBlockIndexByHeight(CBlockIndex* pindexTip);
+void BuildSkipPointers();
+CBlockIndex* FindBlockByHeight(int nHeight);
 bool ProcessMessages(CNode* pfrom);
-bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv);
+bool ProcessMessage(CNode* pfrom, string strCommand, CPublicDataStream& vRecv);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 int64 GetBalance();
+void InvalidateWalletBalance();
 bool CreateTransaction(CScript scriptPubKey, int64 nValue, CWalletTx& wtxNew, CKey& keyRet, int64& nFeeRequiredRet);
 bool CommitTransaction(CWalletTx& wtxNew, const CKey& key);
 bool BroadcastTransaction(CWalletTx& wtxNew);
@@ -92,6 +112,7 @@ void BitcoinMiner();
 CBlock* CreateNewBlock(CKey& key);
 int64 GetNetworkHashPS(int lookup = 30);
 bool ProcessBlock(CNode* pfrom, CBlock* pblock);
+void ReleaseBlocksInFlight(CNode* pnode);
 
 
 
@@ -741,6 +762,12 @@ public:
     mutable unsigned int nTimeDisplayed;
     mutable int nLinesDisplayed;
 
+    // memory only
+    mutable bool fGetDebitCached;
+    mutable int64 nGetDebitCached;
+    mutable unsigned int nGetDebitChanges;
+    mutable int64 nAvailableCredit;  // unspent mature credit, counted into GetBalance
+
 
     CWalletTx()
     {
@@ -765,6 +792,10 @@ public:
         fSpent = false;
         nTimeDisplayed = 0;
         nLinesDisplayed = 0;
+        fGetDebitCached = false;
+        nGetDebitCached = 0;
+        nGetDebitChanges = 0;
+        nAvailableCredit = 0;
     }
 
     IMPLEMENT_SERIALIZE
@@ -785,6 +816,17 @@ public:
         return CWalletDB().WriteTx(GetHash(), *this);
     }
 
+    int64 GetDebit(bool fUseCache=false) const
+    {
+        // Debit can only change when a tx it spends from joins or leaves the wallet
+        if (fUseCache && fGetDebitCached && nGetDebitChanges == nWalletTxChanges)
+            return nGetDebitCached;
+        nGetDebitCached = CTransaction::GetDebit();
+        nGetDebitChanges = nWalletTxChanges;
+        fGetDebitCached = true;
+        return nGetDebitCached;
+    }
+
 
     int64 GetTxTime() const;
     int GetRequestCount() const;
@@ -1015,12 +1057,16 @@ public:
 
         fileout << *this;
 
-        fflush(fileout);
-#if defined(_WIN32) || defined(__MINGW32__) || defined(__WXMSW__)
-        _commit(_fileno(fileout));
-#else
-        fsync(fileno(fileout));
-#endif
+        // Flush stdio buffers, in batched -dbsync mode FlushBlockStore fsyncs later
+        if (fBatchedDBSync)
+        {
+            fflush(fileout);
+            SetBlockFileDirty(nFileRet);
+        }
+        else
+        {
+            FileCommit(fileout);
+        }
 
         return true;
     }
@@ -1101,6 +1147,7 @@ public:
     const uint256* phashBlock;
     CBlockIndex* pprev;
     CBlockIndex* pnext;
+    CBlockIndex* pskip;
     unsigned int nFile;
     unsigned int nBlockPos;
     int nHeight;
@@ -1118,6 +1165,7 @@ public:
         phashBlock = NULL;
         pprev = NULL;
         pnext = NULL;
+        pskip = NULL;
         nFile = 0;
         nBlockPos = 0;
         nHeight = 0;
@@ -1134,6 +1182,7 @@ public:
         phashBlock = NULL;
         pprev = NULL;
         pnext = NULL;
+        pskip = NULL;
         nFile = nFileIn;
         nBlockPos = nBlockPosIn;
         nHeight = 0;
@@ -1150,11 +1199,31 @@ public:
         return *phashBlock;
     }
 
+    CBlock GetBlockHeader() const
+    {
+        CBlock block;
+        block.nVersion       = nVersion;
+        if (pprev)
+            block.hashPrevBlock = pprev->GetBlockHash();
+        block.hashMerkleRoot = hashMerkleRoot;
+        block.nTime          = nTime;
+        block.nBits          = nBits;
+        block.nNonce         = nNonce;
+        return block;
+    }
+
     bool IsInMainChain() const
     {
         return (pnext || this == pindexBest);
     }
 
+    CBlockIndex* GetAncestor(int nHeightTarget);
+    const CBlockIndex* GetAncestor(int nHeightTarget) const
+    {
+        return const_cast<CBlockIndex*>(this)->GetAncestor(nHeightTarget);
+    }
+    void BuildSkip();
+
     bool EraseBlockFromDisk()
     {
         // Open history file
@@ -1293,6 +1362,114 @@ public:
 
 
 
+//
+// Container for the in-memory block index.  Entries are carved out of
+// contiguous slabs so they never move and cost no heap call each, and the
+// key is stored next to its entry so phashBlock can point at it.  Lookup
+// is linear-probing open addressing over a salted hash of the block hash.
+//
+// Growing reallocates the slot table and erase shifts slots around, so
+// find, count, insert and erase take cs_table.  That makes lookups safe
+// from threads that don't hold cs_main, and the entry find returns stays
+// valid until it is erased.  Walking from begin() to end() reads the slot
+// table directly and needs cs_main held for the whole walk.
+//
+class CBlockIndexMap
+{
+public:
+    typedef pair<const uint256, CBlockIndex*> value_type;
+
+private:
+    struct CEntry
+    {
+        value_type item;
+        CBlockIndex index;
+
+        CEntry(const uint256& hash, const CBlockIndex& indexIn) : item(hash, (CBlockIndex*)NULL), index(indexIn)
+        {
+            item.second = &index;
+            index.phashBlock = &item.first;
+        }
+    };
+
+    enum { ENTRIES_PER_SLAB = 4096 };
+
+    mutable CCriticalSection cs_table;
+    vector<CEntry*> vTable;
+    vector<CEntry*> vSlabs;
+    vector<CEntry*> vFree;
+    unsigned int nSlabUsed;
+    unsigned int nSize;
+    uint64 nSalt;
+
+    unsigned int Bucket(const uint256& hash) const;
+    unsigned int FindSlot(const uint256& hash) const;
+    void Resize(unsigned int nSlots);
+
+    CBlockIndexMap(const CBlockIndexMap&);
+    void operator=(const CBlockIndexMap&);
+
+public:
+    class iterator
+    {
+    private:
+        CEntry* const* p;
+        CEntry* const* pend;
+        CEntry* pentry;  // held directly so a table resize can't strand it
+
+        void Skip() { while (p != pend && *p == NULL) ++p; pentry = (p != pend ? *p : NULL); }
+    public:
+        iterator(CEntry* const* pIn, CEntry* const* pendIn) : p(pIn), pend(pendIn) { Skip(); }
+        value_type& operator*() const { return pentry->item; }
+        value_type* operator->() const { return &pentry->item; }
+        iterator& operator++() { ++p; Skip(); return *this; }
+        bool operator==(const iterator& b) const { return pentry == b.pentry; }
+        bool operator!=(const iterator& b) const { return pentry != b.pentry; }
+    };
+    typedef iterator const_iterator;
+
+    CBlockIndexMap() : nSlabUsed(ENTRIES_PER_SLAB), nSize(0), nSalt(0) { }
+    ~CBlockIndexMap();
+
+    iterator begin() const { return iterator(vTable.empty() ? NULL : &vTable[0], vTable.empty() ? NULL : &vTable[0] + vTable.size()); }
+    iterator end() const   { return iterator(vTable.empty() ? NULL : &vTable[0] + vTable.size(), vTable.empty() ? NULL : &vTable[0] + vTable.size()); }
+    unsigned int size() const { return nSize; }
+    bool empty() const { return nSize == 0; }
+
+    iterator find(const uint256& hash) const
+    {
+        CRITICAL_BLOCK(cs_table)
+        {
+            if (nSize == 0)
+                return iterator(NULL, NULL);
+            unsigned int i = FindSlot(hash);
+            if (vTable[i] == NULL)
+                return iterator(NULL, NULL);
+            return iterator(&vTable[i], &vTable[0] + vTable.size());
+        }
+        return iterator(NULL, NULL);
+    }
+
+    unsigned int count(const uint256& hash) const
+    {
+        CRITICAL_BLOCK(cs_table)
+            return (nSize != 0 && vTable[FindSlot(hash)] != NULL) ? 1 : 0;
+        return 0;
+    }
+
+    // Copies index into a new entry keyed by hash and returns it,
+    // or returns the existing entry if hash is already present
+    CBlockIndex* insert(const uint256& hash, const CBlockIndex& index);
+
+    // Removes the entry and frees its CBlockIndex
+    void erase(const uint256& hash);
+    void clear();
+    void reserve(unsigned int n);
+};
+
+
+
+
 //
 // Describes a place in the block chain to another node such that if the
 // other node doesn't have the same branch, it can find a recent common trunk.
@@ -1336,8 +1513,7 @@ public:
             vHave.push_back(pindex->GetBlockHash());
 
             // Exponentially larger steps back
-            for (int i = 0; pindex && i < nStep; i++)
-                pindex = pindex->pprev;
+            pindex = pindex->GetAncestor(pindex->nHeight - nStep);
             if (vHave.size() > 10)
                 nStep *= 2;
         }
@@ -1411,6 +1587,115 @@ public:
 
 
 
+//
+// Compact block: the header, the coinbase, and a short salted id for each
+// of the other transactions, which the receiver looks up in its memory pool.
+//
+class CPrefilledTx
+{
+public:
+    unsigned int nIndex;
+    CTransaction tx;
+
+    CPrefilledTx()
+    {
+        nIndex = 0;
+    }
+
+    CPrefilledTx(unsigned int nIndexIn, const CTransaction& txIn) : nIndex(nIndexIn), tx(txIn)
+    {
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nIndex);
+        READWRITE(tx);
+    )
+};
+
+class CCompactBlock
+{
+public:
+    CBlock header;
+    uint64 nNonce;
+    vector<uint64> vShortID;
+    vector<CPrefilledTx> vPrefilled;
+
+    CCompactBlock()
+    {
+        nNonce = 0;
+    }
+
+    CCompactBlock(const CBlock& block)
+    {
+        header = block;
+        header.vtx.clear();
+        header.vMerkleTree.clear();
+        RAND_bytes((unsigned char*)&nNonce, sizeof(nNonce));
+
+        // The coinbase is never in anyone's memory pool
+        vPrefilled.push_back(CPrefilledTx(0, block.vtx[0]));
+        uint256 hashSalt = GetSalt();
+        for (int i = 1; i < block.vtx.size(); i++)
+            vShortID.push_back(GetShortID(hashSalt, block.vtx[i].GetHash()));
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(header);
+        READWRITE(nNonce);
+        READWRITE(vShortID);
+        READWRITE(vPrefilled);
+    )
+
+    uint256 GetSalt() const
+    {
+        uint256 hashBlock = header.GetHash();
+        return Hash(BEGIN(hashBlock), END(hashBlock), BEGIN(nNonce), END(nNonce));
+    }
+
+    static uint64 GetShortID(const uint256& hashSalt, const uint256& hashTx)
+    {
+        uint256 hash = Hash(BEGIN(hashSalt), END(hashSalt), BEGIN(hashTx), END(hashTx));
+        uint64 nShortID;
+        memcpy(&nShortID, hash.begin(), sizeof(nShortID));
+        return nShortID;
+    }
+
+    bool FillBlock(CBlock& block) const;
+};
+
+class CBlockTransactionsRequest
+{
+public:
+    uint256 hashBlock;
+    vector<unsigned int> vIndex;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(hashBlock);
+        READWRITE(vIndex);
+    )
+};
+
+class CBlockTransactions
+{
+public:
+    uint256 hashBlock;
+    vector<CTransaction> vtx;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(hashBlock);
+        READWRITE(vtx);
+    )
+};
+
+
+
+
+
+
 //
 // Private key that includes an expiration date in case it never gets used.
 //
@@ -1449,6 +1734,8 @@ public:
 extern map<uint256, CTransaction> mapTransactions;
 extern CCriticalSection cs_mapTransactions;
 extern map<uint256, CWalletTx> mapWallet;
+extern set<pair<unsigned int, uint256> > setWalletByTime;
+extern set<pair<uint160, uint256> > setWalletByAddress;
 extern vector<uint256> vWalletUpdated;
 extern CCriticalSection cs_mapWallet;
 extern map<vector<unsigned char>, CPrivKey> mapKeys;
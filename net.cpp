@@ -7,6 +7,7 @@
 void ThreadMessageHandler2(void* parg);
 void ThreadSocketHandler2(void* parg);
 void ThreadOpenConnections2(void* parg);
+void ThreadNotifyPublisher2(void* parg);
 bool OpenNetworkConnection(const CAddress& addrConnect);
 
 
@@ -17,7 +18,7 @@ bool OpenNetworkConnection(const CAddress& addrConnect);
 // Global state variables
 //
 bool fClient = false;
-uint64 nLocalServices = (fClient ? 0 : NODE_NETWORK);
+uint64 nLocalServices = (fClient ? 0 : NODE_NETWORK | NODE_HEADERS | NODE_COMPACT);
 CAddress addrLocalHost(0, DEFAULT_PORT, nLocalServices);
 CNode* pnodeLocalHost = NULL;
 uint64 nLocalHostNonce = 0;
@@ -27,13 +28,15 @@ int64 nThreadSocketHandlerHeartbeat = INT64_MAX;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<vector<unsigned char>, CAddress> mapAddresses;
-CCriticalSection cs_mapAddresses;
-map<CInv, CDataStream> mapRelay;
-deque<pair<int64, CInv> > vRelayExpiration;
-CCriticalSection cs_mapRelay;
+CAddrMan addrman;
+CRelayCache relayCache;
 map<CInv, int64> mapAlreadyAskedFor;
 
+// Nodes with a complete message waiting, guarded by cs_vNodes
+static deque<CNode*> vMessageReady;
+static CWaitEvent eventMessageHandler;
+static std::atomic<bool> fRelayPending(false);
+
 // Settings
 int fUseProxy = false;
 CAddress addrProxy("127.0.0.1:9050");
@@ -172,6 +175,16 @@ void CNode::PushGetBlocks(CBlockIndex* pindexBegin, uint256 hashEnd)
     PushMessage("getblocks", CBlockLocator(pindexBegin), hashEnd);
 }
 
+void CNode::PushGetHeaders(CBlockIndex* pindexBegin)
+{
+    // Filter out duplicate requests
+    if (pindexBegin == pindexLastGetHeadersBegin)
+        return;
+    pindexLastGetHeadersBegin = pindexBegin;
+
+    PushMessage("getheaders", CBlockLocator(pindexBegin), uint256(0));
+}
+
 
 
 
@@ -260,74 +273,453 @@ bool GetMyExternalIP(unsigned int& ipRet)
 
 
 
-bool AddAddress(CAddress addr)
+//
+// CAddrInfo
+//
+
+bool CAddrInfo::IsTerrible(int64 nNow) const
 {
-    if (!addr.IsRoutable())
-        return false;
-    if (addr.ip == addrLocalHost.ip)
+    // Tried in the last minute, give it a chance to answer
+    if (nLastTry && nLastTry >= nNow - 60)
         return false;
-    CRITICAL_BLOCK(cs_mapAddresses)
+
+    // Timestamp from the future
+    if (nTime > nNow + 10 * 60)
+        return true;
+
+    // Not seen in a month
+    if (nTime == 0 || nNow - nTime > 30 * 24 * 60 * 60)
+        return true;
+
+    // Never connected after several tries
+    if (nLastSuccess == 0 && nAttempts >= 3)
+        return true;
+
+    // Failing for a week
+    if (nNow - nLastSuccess > 7 * 24 * 60 * 60 && nAttempts >= 10)
+        return true;
+
+    return false;
+}
+
+double CAddrInfo::GetChance(int64 nNow) const
+{
+    double fChance = 1.0;
+
+    // Back off recently tried addresses
+    if (nNow - (int64)nLastTry < 10 * 60)
+        fChance *= 0.01;
+
+    // Each failed attempt makes it less likely, down to 1/28
+    fChance *= pow(0.66, min(nAttempts, 8));
+
+    return fChance;
+}
+
+
+
+
+//
+// CAddrMan
+//
+
+CAddrMan::CAddrMan()
+{
+    RAND_bytes((unsigned char*)&nKey, sizeof(nKey));
+    nIdCount = 0;
+    vNewSlots.assign(NEW_BUCKET_COUNT * BUCKET_SIZE, -1);
+    vTriedSlots.assign(TRIED_BUCKET_COUNT * BUCKET_SIZE, -1);
+}
+
+uint64 CAddrMan::KeyedHash(const CPublicDataStream& ss) const
+{
+    uint256 hash = Hash((const char*)&nKey, (const char*)&nKey + sizeof(nKey), ss.begin(), ss.end());
+    uint64 n;
+    memcpy(&n, &hash, sizeof(n));
+    return n;
+}
+
+int CAddrMan::GetNewBucket(const CAddress& addr, unsigned int ipSource) const
+{
+    // A source group can only reach a few buckets, so one peer feeding
+    // us addresses can't take over the new table
+    uint16_t nSourceGroup = CAddress(ipSource).GetGroup();
+    CPublicDataStream ss1(SER_GETHASH);
+    ss1 << addr.GetGroup() << nSourceGroup;
+    uint64 nHash1 = KeyedHash(ss1) % NEW_BUCKETS_PER_SOURCE_GROUP;
+    CPublicDataStream ss2(SER_GETHASH);
+    ss2 << nSourceGroup << nHash1;
+    return KeyedHash(ss2) % NEW_BUCKET_COUNT;
+}
+
+int CAddrMan::GetTriedBucket(const CAddress& addr) const
+{
+    CPublicDataStream ss1(SER_GETHASH);
+    ss1 << addr.GetKey();
+    uint64 nHash1 = KeyedHash(ss1) % TRIED_BUCKETS_PER_GROUP;
+    CPublicDataStream ss2(SER_GETHASH);
+    ss2 << addr.GetGroup() << nHash1;
+    return KeyedHash(ss2) % TRIED_BUCKET_COUNT;
+}
+
+int CAddrMan::GetBucketPosition(bool fNew, int nBucket, const CAddress& addr) const
+{
+    CPublicDataStream ss(SER_GETHASH);
+    ss << (unsigned char)(fNew ? 'N' : 'K') << nBucket << addr.GetKey();
+    return KeyedHash(ss) % BUCKET_SIZE;
+}
+
+void CAddrMan::RandomListAdd(int nId)
+{
+    CAddrInfo& info = mapInfo[nId];
+    vector<int>& vRandom = (info.fInTried ? vRandomTried : vRandomNew);
+    info.nRandomPos = vRandom.size();
+    vRandom.push_back(nId);
+}
+
+void CAddrMan::RandomListRemove(int nId)
+{
+    // Swap the last entry into the hole so removal stays constant time
+    CAddrInfo& info = mapInfo[nId];
+    vector<int>& vRandom = (info.fInTried ? vRandomTried : vRandomNew);
+    int nLast = vRandom.back();
+    vRandom[info.nRandomPos] = nLast;
+    mapInfo[nLast].nRandomPos = info.nRandomPos;
+    vRandom.pop_back();
+    info.nRandomPos = -1;
+}
+
+void CAddrMan::Unplace(int nId)
+{
+    CAddrInfo& info = mapInfo[nId];
+    if (info.nBucket < 0)
+        return;
+    vector<int>& vSlots = (info.fInTried ? vTriedSlots : vNewSlots);
+    vSlots[info.nBucket * BUCKET_SIZE + info.nBucketPos] = -1;
+    RandomListRemove(nId);
+    info.nBucket = -1;
+    info.nBucketPos = -1;
+}
+
+bool CAddrMan::PlaceNew(int nId)
+{
+    CAddrInfo& info = mapInfo[nId];
+    int nBucket = GetNewBucket(info, info.ipSource);
+    int nPos = GetBucketPosition(true, nBucket, info);
+    int& nSlot = vNewSlots[nBucket * BUCKET_SIZE + nPos];
+    if (nSlot != -1)
     {
-        map<vector<unsigned char>, CAddress>::iterator it = mapAddresses.find(addr.GetKey());
-        if (it == mapAddresses.end())
-        {
-            // New address
-            printf("AddAddress(%s)\n", addr.ToStringLog().c_str());
-            mapAddresses.insert(make_pair(addr.GetKey(), addr));
-            CAddrDB().WriteAddress(addr);
-            return true;
-        }
-        else
+        // Only push out an entry that isn't worth keeping
+        if (!mapInfo[nSlot].IsTerrible(GetAdjustedTime()))
+            return false;
+        Delete(nSlot);
+    }
+    info.fInTried = false;
+    info.nBucket = nBucket;
+    info.nBucketPos = nPos;
+    nSlot = nId;
+    RandomListAdd(nId);
+    return true;
+}
+
+void CAddrMan::PlaceTried(int nId)
+{
+    CAddrInfo& info = mapInfo[nId];
+    int nBucket = GetTriedBucket(info);
+    int nPos = GetBucketPosition(false, nBucket, info);
+    int nSlot = nBucket * BUCKET_SIZE + nPos;
+    int nOld = vTriedSlots[nSlot];
+    if (nOld != -1)
+    {
+        // Demote whoever was there back to the new table
+        Unplace(nOld);
+        if (!PlaceNew(nOld))
+            Delete(nOld);
+    }
+    info.fInTried = true;
+    info.nBucket = nBucket;
+    info.nBucketPos = nPos;
+    vTriedSlots[nSlot] = nId;
+    RandomListAdd(nId);
+}
+
+void CAddrMan::Delete(int nId)
+{
+    Unplace(nId);
+    mapAddr.erase(mapInfo[nId]);
+    mapInfo.erase(nId);
+}
+
+int CAddrMan::Create(const CAddrInfo& info)
+{
+    int nId = nIdCount++;
+    mapInfo[nId] = info;
+    mapAddr[info] = nId;
+    return nId;
+}
+
+bool CAddrMan::Add(const CAddress& addr, unsigned int ipSource)
+{
+    CRITICAL_BLOCK(cs)
+    {
+        map<CAddress, int>::iterator mi = mapAddr.find(addr);
+        if (mi != mapAddr.end())
         {
-            bool fUpdated = false;
-            CAddress& addrFound = (*it).second;
-            if ((addrFound.nServices | addr.nServices) != addrFound.nServices)
-            {
-                // Services have been added
-                addrFound.nServices |= addr.nServices;
-                fUpdated = true;
-            }
+            CAddrInfo& info = mapInfo[(*mi).second];
+
+            // Services have been added
+            info.nServices |= addr.nServices;
+
+            // Periodically update most recently seen time
             bool fCurrentlyOnline = (GetAdjustedTime() - addr.nTime < 24 * 60 * 60);
             int64 nUpdateInterval = (fCurrentlyOnline ? 60 * 60 : 24 * 60 * 60);
-            if (addrFound.nTime < addr.nTime - nUpdateInterval)
-            {
-                // Periodically update most recently seen time
-                addrFound.nTime = addr.nTime;
-                fUpdated = true;
-            }
-            if (fUpdated)
-                CAddrDB().WriteAddress(addrFound);
+            if (info.nTime < addr.nTime - nUpdateInterval)
+                info.nTime = addr.nTime;
+            return false;
+        }
+
+        int nId = Create(CAddrInfo(addr, ipSource));
+        if (!PlaceNew(nId))
+        {
+            Delete(nId);
+            return false;
         }
+        return true;
     }
     return false;
 }
 
-void AddressCurrentlyConnected(const CAddress& addr)
+void CAddrMan::Good(const CAddress& addr)
+{
+    CRITICAL_BLOCK(cs)
+    {
+        map<CAddress, int>::iterator mi = mapAddr.find(addr);
+        if (mi == mapAddr.end())
+            return;
+        int nId = (*mi).second;
+        CAddrInfo& info = mapInfo[nId];
+        info.nLastSuccess = GetAdjustedTime();
+        info.nLastTry = info.nLastSuccess;
+        info.nAttempts = 0;
+        if (info.fInTried)
+            return;
+        Unplace(nId);
+        PlaceTried(nId);
+        if (fDebug)
+            printf("[ADDRMAN] Moved %s to tried\n", addr.ToStringLog().c_str());
+    }
+}
+
+void CAddrMan::Attempt(const CAddress& addr)
+{
+    CRITICAL_BLOCK(cs)
+    {
+        map<CAddress, int>::iterator mi = mapAddr.find(addr);
+        if (mi == mapAddr.end())
+            return;
+        CAddrInfo& info = mapInfo[(*mi).second];
+        info.nLastTry = GetAdjustedTime();
+        info.nAttempts++;
+    }
+}
+
+void CAddrMan::Connected(const CAddress& addr)
+{
+    CRITICAL_BLOCK(cs)
+    {
+        map<CAddress, int>::iterator mi = mapAddr.find(addr);
+        if (mi == mapAddr.end())
+            return;
+        CAddrInfo& info = mapInfo[(*mi).second];
+        int64 nNow = GetAdjustedTime();
+        if (info.nTime < nNow - 20 * 60)
+            info.nTime = nNow;
+    }
+}
+
+CAddress CAddrMan::Select()
+{
+    CRITICAL_BLOCK(cs)
+    {
+        if (vRandomNew.empty() && vRandomTried.empty())
+            return CAddress();
+
+        // Pick a table, then a random entry from it, and keep it with a
+        // probability based on its history.  The bar drops each round so
+        // this ends quickly even if every entry is a poor candidate.
+        int64 nNow = GetAdjustedTime();
+        double fChanceFactor = 1.0;
+        loop
+        {
+            bool fTried = (!vRandomTried.empty() && (vRandomNew.empty() || GetRand(2) == 0));
+            const vector<int>& vRandom = (fTried ? vRandomTried : vRandomNew);
+            const CAddrInfo& info = mapInfo[vRandom[GetRand(vRandom.size())]];
+            if (GetRand(1 << 30) < fChanceFactor * info.GetChance(nNow) * (1 << 30))
+                return info;
+            fChanceFactor *= 1.2;
+        }
+    }
+    return CAddress();
+}
+
+vector<CAddress> CAddrMan::GetAddr(int64 nSince)
+{
+    vector<CAddress> vAddr;
+    CRITICAL_BLOCK(cs)
+    {
+        vector<int> vId(vRandomTried);
+        vId.insert(vId.end(), vRandomNew.begin(), vRandomNew.end());
+
+        // Partial shuffle, stopping once we have enough
+        int64 nNow = GetAdjustedTime();
+        for (unsigned int i = 0; i < vId.size() && vAddr.size() < 2500; i++)
+        {
+            swap(vId[i], vId[i + GetRand(vId.size() - i)]);
+            const CAddrInfo& info = mapInfo[vId[i]];
+            if (info.nTime > nSince && !info.IsTerrible(nNow))
+                vAddr.push_back(info);
+        }
+    }
+    return vAddr;
+}
+
+int CAddrMan::size()
+{
+    CRITICAL_BLOCK(cs)
+        return mapInfo.size();
+    return 0;
+}
+
+bool CAddrMan::Write(const string& strFile)
+{
+    CPublicDataStream ss(SER_DISK);
+    CRITICAL_BLOCK(cs)
+    {
+        ss << (unsigned char)1 << nKey << (int)mapInfo.size();
+        for (map<int, CAddrInfo>::iterator mi = mapInfo.begin(); mi != mapInfo.end(); ++mi)
+            ss << (*mi).second;
+    }
+    uint256 hashChecksum = Hash(ss.begin(), ss.end());
+
+    // Write to a temp file and rename so a partial file is never picked up
+    string strTmp = strFile + ".new";
+    FILE* file = fopen(strTmp.c_str(), "wb");
+    if (!file)
+        return error("CAddrMan::Write() : open %s failed", strTmp.c_str());
+    bool fOk = (fwrite(&ss[0], 1, ss.size(), file) == ss.size() &&
+                fwrite(BEGIN(hashChecksum), 1, 32, file) == 32);
+    FileCommit(file);
+    fclose(file);
+    if (!fOk)
+    {
+        unlink(strTmp.c_str());
+        return error("CAddrMan::Write() : write failed");
+    }
+    unlink(strFile.c_str());
+    if (rename(strTmp.c_str(), strFile.c_str()) != 0)
+        return error("CAddrMan::Write() : rename failed");
+    return true;
+}
+
+bool CAddrMan::Read(const string& strFile)
 {
-    CRITICAL_BLOCK(cs_mapAddresses)
+    FILE* file = fopen(strFile.c_str(), "rb");
+    if (!file)
+        return false;
+    int nSize = GetFilesize(file);
+    if (nSize < 32)
+    {
+        fclose(file);
+        return error("CAddrMan::Read() : %s too small", strFile.c_str());
+    }
+    vector<char> vch(nSize);
+    bool fRead = (fread(&vch[0], 1, nSize, file) == nSize);
+    fclose(file);
+    if (!fRead)
+        return error("CAddrMan::Read() : read failed");
+    uint256 hashChecksum;
+    memcpy(&hashChecksum, &vch[nSize - 32], 32);
+    if (Hash(vch.begin(), vch.end() - 32) != hashChecksum)
+        return error("CAddrMan::Read() : checksum mismatch");
+
+    CPublicDataStream ss(vch.begin(), vch.end() - 32, SER_DISK);
+    CRITICAL_BLOCK(cs)
     {
-        // Only if it's been published already
-        map<vector<unsigned char>, CAddress>::iterator it = mapAddresses.find(addr.GetKey());
-        if (it != mapAddresses.end())
+        try
         {
-            CAddress& addrFound = (*it).second;
-            int64 nUpdateInterval = 20 * 60;
-            if (addrFound.nTime < GetAdjustedTime() - nUpdateInterval)
+            unsigned char nFileVersion;
+            int nCount;
+            ss >> nFileVersion >> nKey >> nCount;
+            if (nFileVersion != 1)
+                return error("CAddrMan::Read() : unknown version %d", nFileVersion);
+
+            // Bucket positions depend on the key, so rebuild them by placing
+            // the tried entries first and the rest after
+            vector<int> vNew;
+            for (int i = 0; i < nCount; i++)
             {
-                // Periodically update most recently seen time
-                addrFound.nTime = GetAdjustedTime();
-                CAddrDB addrdb;
-                addrdb.WriteAddress(addrFound);
+                CAddrInfo info;
+                ss >> info;
+                if (mapAddr.count(info))
+                    continue;
+                int nId = Create(info);
+                mapInfo[nId].fInTried = false;
+                if (info.fInTried)
+                {
+                    int nBucket = GetTriedBucket(info);
+                    if (vTriedSlots[nBucket * BUCKET_SIZE + GetBucketPosition(false, nBucket, info)] == -1)
+                    {
+                        PlaceTried(nId);
+                        continue;
+                    }
+                }
+                vNew.push_back(nId);
             }
+            foreach(int nId, vNew)
+                if (!PlaceNew(nId))
+                    Delete(nId);
+        }
+        catch (std::exception& e)
+        {
+            return error("CAddrMan::Read() : %s", e.what());
         }
+        printf("Loaded %d addresses from %s (%d tried)\n", (int)mapInfo.size(), strFile.c_str(), (int)vRandomTried.size());
     }
+    return true;
 }
 
+void DumpAddresses()
+{
+    int64 nStart = GetTimeMillis();
+    if (addrman.Write(GetDataDir() + "/peers.dat"))
+        printf("Flushed %d addresses to peers.dat %" PRI64d "ms\n", addrman.size(), GetTimeMillis() - nStart);
+}
+
+
+
+
+bool AddAddress(CAddress addr, unsigned int ipSource)
+{
+    if (!addr.IsRoutable())
+        return false;
+    if (addr.ip == addrLocalHost.ip)
+        return false;
+    if (!addrman.Add(addr, ipSource))
+        return false;
+    printf("AddAddress(%s)\n", addr.ToStringLog().c_str());
+    return true;
+}
+
+void AddressCurrentlyConnected(const CAddress& addr)
+{
+    addrman.Connected(addr);
+}
 
 
 
 
-void AbandonRequests(void (*fn)(void*, CDataStream&), void* param1)
+
+void AbandonRequests(void (*fn)(void*, CPublicDataStream&), void* param1)
 {
     // If the dialog might get closed before the reply comes back,
     // call this in the destructor so it doesn't get called after it's deleted.
@@ -477,8 +869,7 @@ CNode* ConnectNode(CAddress addrConnect, int64 nTimeout)
             hoursSinceSeen,
             hoursSinceTry);
 
-    CRITICAL_BLOCK(cs_mapAddresses)
-        mapAddresses[addrConnect.GetKey()].nLastTry = GetAdjustedTime();
+    addrman.Attempt(addrConnect);
 
     // Connect
     SOCKET hSocket;
@@ -545,6 +936,153 @@ void CNode::Cleanup()
             CancelSubscribe(nChannel);
 }
 
+bool CNode::ReceiveMsgBytes(const char* pch, unsigned int nBytes)
+{
+    // Caller holds cs_vRecv
+    while (nBytes > 0)
+    {
+        if (vRecvMsg.empty() || vRecvMsg.back().Complete())
+            vRecvMsg.push_back(CNetMessage(nRecvType, nRecvVersion));
+
+        CNetMessage& msg = vRecvMsg.back();
+        int nUsed;
+        if (!msg.InData())
+            nUsed = msg.ReadHeader(pch, nBytes);
+        else
+            nUsed = msg.ReadData(pch, nBytes);
+        if (nUsed < 0)
+            return false;
+
+        pch += nUsed;
+        nBytes -= nUsed;
+    }
+    return true;
+}
+
+CSharedNetMessage MakeSharedMessage(const char* pszCommand, const CPublicDataStream& ssPayload)
+{
+    CMessageHeader hdr(pszCommand, ssPayload.size());
+    uint256 hash = Hash(ssPayload.begin(), ssPayload.end());
+    memcpy(&hdr.nChecksum, &hash, sizeof(hdr.nChecksum));
+
+    CPublicDataStream* pmsg = new CPublicDataStream(SER_NETWORK, 209);
+    pmsg->reserve(sizeof(hdr) + ssPayload.size());
+    *pmsg << hdr;
+    pmsg->insert(pmsg->end(), ssPayload.begin(), ssPayload.end());
+    return CSharedNetMessage(pmsg);
+}
+
+
+
+
+CRelayCache::CRelayCache()
+{
+    nBytes = 0;
+    nMaxBytes = 32 * 1000000;
+    nHits = 0;
+    nMisses = 0;
+    nEvicted = 0;
+    nExpired = 0;
+}
+
+// Rough cost of an entry beyond its buffer: map and list nodes, shared_ptr
+static const unsigned int RELAY_ENTRY_OVERHEAD = 160;
+
+void CRelayCache::Erase(map<CInv, CEntry>::iterator mi)
+{
+    nBytes -= (*mi).second.pmsg->size() + RELAY_ENTRY_OVERHEAD;
+    listLRU.erase((*mi).second.itLRU);
+    mapEntries.erase(mi);
+}
+
+void CRelayCache::ExpireOld()
+{
+    int64 nNow = GetTime();
+    while (!vExpiration.empty() && vExpiration.front().first < nNow)
+    {
+        // Skip entries that were saved again since
+        map<CInv, CEntry>::iterator mi = mapEntries.find(vExpiration.front().second);
+        if (mi != mapEntries.end() && (*mi).second.nExpire < nNow)
+        {
+            Erase(mi);
+            nExpired++;
+        }
+        vExpiration.pop_front();
+    }
+}
+
+void CRelayCache::SetMaxBytes(uint64 nMaxBytesIn)
+{
+    CRITICAL_BLOCK(cs)
+        nMaxBytes = nMaxBytesIn;
+}
+
+void CRelayCache::Insert(const CInv& inv, const CSharedNetMessage& pmsg)
+{
+    CRITICAL_BLOCK(cs)
+    {
+        ExpireOld();
+
+        map<CInv, CEntry>::iterator mi = mapEntries.find(inv);
+        if (mi != mapEntries.end())
+            Erase(mi);
+
+        CEntry& entry = mapEntries[inv];
+        entry.pmsg = pmsg;
+        entry.nExpire = GetTime() + 15 * 60;
+        entry.itLRU = listLRU.insert(listLRU.begin(), inv);
+        nBytes += pmsg->size() + RELAY_ENTRY_OVERHEAD;
+        vExpiration.push_back(make_pair(entry.nExpire, inv));
+
+        // Over budget, drop the least recently used but never the new one
+        while (nBytes > nMaxBytes && listLRU.size() > 1)
+        {
+            Erase(mapEntries.find(listLRU.back()));
+            nEvicted++;
+        }
+    }
+}
+
+CSharedNetMessage CRelayCache::Find(const CInv& inv)
+{
+    CSharedNetMessage pmsg;
+    CRITICAL_BLOCK(cs)
+    {
+        map<CInv, CEntry>::iterator mi = mapEntries.find(inv);
+        if (mi != mapEntries.end() && (*mi).second.nExpire >= GetTime())
+        {
+            listLRU.splice(listLRU.begin(), listLRU, (*mi).second.itLRU);
+            pmsg = (*mi).second.pmsg;
+            nHits++;
+        }
+        else
+            nMisses++;
+    }
+    return pmsg;
+}
+
+void CRelayCache::Expire()
+{
+    CRITICAL_BLOCK(cs)
+        ExpireOld();
+}
+
+CRelayCacheStats CRelayCache::GetStats()
+{
+    CRelayCacheStats stats;
+    CRITICAL_BLOCK(cs)
+    {
+        stats.nEntries = mapEntries.size();
+        stats.nBytes = nBytes;
+        stats.nMaxBytes = nMaxBytes;
+        stats.nHits = nHits;
+        stats.nMisses = nMisses;
+        stats.nEvicted = nEvicted;
+        stats.nExpired = nExpired;
+    }
+    return stats;
+}
+
 
 
 
@@ -576,62 +1114,544 @@ void ThreadSocketHandler(void* parg)
     printf("ThreadSocketHandler exiting\n");
 }
 
-void ThreadSocketHandler2(void* parg)
+static void DisconnectNodes(list<CNode*>& vNodesDisconnected);
+static bool AcceptConnection();
+static bool SocketRecvData(CNode* pnode);
+static bool SocketSendData(CNode* pnode);
+static void CheckInactivity(CNode* pnode);
+
+#ifdef USE_EPOLL
+//
+// Edge-triggered epoll reactor.  Every peer socket is registered for input;
+// output interest is only added while a send would block.  Threads that
+// queue a message on an idle vSend put the node on vSendReady and poke
+// hWakeEvent, so sends go out right away instead of on the next poll.
+//
+static int hEpoll = -1;
+static int hWakeEvent = -1;
+static vector<CNode*> vSendReady;
+static CCriticalSection cs_vSendReady;
+static set<CNode*> setSocketRetry;
+
+static void SetPollEvents(CNode* pnode, unsigned int nEvents)
 {
-    printf("ThreadSocketHandler started\n");
-    list<CNode*> vNodesDisconnected;
-    int nPrevNodeCount = 0;
+    if (pnode->hSocket == INVALID_SOCKET || pnode->nPollEvents == nEvents)
+        return;
+    struct epoll_event event;
+    event.events = nEvents;
+    event.data.ptr = pnode;
+    if (epoll_ctl(hEpoll, pnode->nPollEvents ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, pnode->hSocket, &event) != 0 &&
+        epoll_ctl(hEpoll, pnode->nPollEvents ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, pnode->hSocket, &event) != 0)
+    {
+        printf("epoll_ctl failed for %s, error %d\n", pnode->addr.ToStringLog().c_str(), errno);
+        pnode->CloseSocketDisconnect();
+        return;
+    }
+    pnode->nPollEvents = nEvents;
+}
+#endif
 
-    loop
+void WakeSocketHandler(CNode* pnodeSend)
+{
+#ifdef USE_EPOLL
+    // Callers with a node hold its cs_vSend, which keeps it from being deleted
+    if (pnodeSend)
+        CRITICAL_BLOCK(cs_vSendReady)
+            vSendReady.push_back(pnodeSend);
+    if (hWakeEvent != -1)
     {
-        //
-        // Disconnect nodes
-        //
-        CRITICAL_BLOCK(cs_vNodes)
+        uint64 n = 1;
+        if (write(hWakeEvent, &n, sizeof(n)) != sizeof(n) && errno != EAGAIN)
+            printf("WakeSocketHandler() : write to eventfd failed %d\n", errno);
+    }
+#endif
+}
+
+static void DisconnectNodes(list<CNode*>& vNodesDisconnected)
+{
+    CRITICAL_BLOCK(cs_vNodes)
+    {
+        // Disconnect unused nodes
+        vector<CNode*> vNodesCopy = vNodes;
+        foreach(CNode* pnode, vNodesCopy)
         {
-            // Disconnect unused nodes
-            vector<CNode*> vNodesCopy = vNodes;
-            foreach(CNode* pnode, vNodesCopy)
+            if (pnode->fDisconnect ||
+                (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->IsSendQueueEmpty()))
+            {
+                // remove from vNodes
+                vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+
+                // close socket and cleanup
+                pnode->CloseSocketDisconnect();
+                pnode->Cleanup();
+
+                // hold in disconnected pool until all refs are released
+                pnode->nReleaseTime = max(pnode->nReleaseTime, GetTime() + 15 * 60);
+                if (pnode->fNetworkNode || pnode->fInbound)
+                    pnode->Release();
+                vNodesDisconnected.push_back(pnode);
+            }
+        }
+
+        // Delete disconnected nodes
+        list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+        foreach(CNode* pnode, vNodesDisconnectedCopy)
+        {
+            // wait until threads are done using it
+            if (pnode->GetRefCount() <= 0)
             {
-                if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecv.empty() && pnode->vSend.empty()))
+                bool fDelete = false;
+                TRY_CRITICAL_BLOCK(cs_main)
+                TRY_CRITICAL_BLOCK(pnode->cs_vSend)
+                 TRY_CRITICAL_BLOCK(pnode->cs_vRecv)
+                  TRY_CRITICAL_BLOCK(pnode->cs_mapRequests)
+                   TRY_CRITICAL_BLOCK(pnode->cs_inventory)
+                   {
+                    ReleaseBlocksInFlight(pnode);
+#ifdef USE_EPOLL
+                    CRITICAL_BLOCK(cs_vSendReady)
+                        vSendReady.erase(remove(vSendReady.begin(), vSendReady.end(), pnode), vSendReady.end());
+                    setSocketRetry.erase(pnode);
+#endif
+                    vMessageReady.erase(remove(vMessageReady.begin(), vMessageReady.end(), pnode), vMessageReady.end());
+                    fDelete = true;
+                   }
+                if (fDelete)
                 {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+                    vNodesDisconnected.remove(pnode);
+                    delete pnode;
+                }
+            }
+        }
+    }
+}
 
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
-                    pnode->Cleanup();
+static bool AcceptConnection()
+{
+    struct sockaddr_in sockaddr;
+    socklen_t len = sizeof(sockaddr);
+    SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
+    CAddress addr(sockaddr);
+    if (hSocket == INVALID_SOCKET)
+    {
+        if (WSAGetLastError() != WSAEWOULDBLOCK)
+            printf("socket error accept failed: %d\n", WSAGetLastError());
+        return false;
+    }
+
+    uint16_t nGroup = addr.GetGroup();
+    int nGroupCount = GetInboundGroupCount(nGroup);
+    if (nGroupCount >= MAX_INBOUND_PER_GROUP)
+    {
+        if (fDebug)
+            printf("[NET] Rejecting inbound from %s: too many from network group %u.%u.x.x (%d/%d)\n",
+                   addr.ToStringLog().c_str(), nGroup >> 8, nGroup & 0xff, nGroupCount, MAX_INBOUND_PER_GROUP);
+        closesocket(hSocket);
+        return true;
+    }
+
+    if (fDebug)
+        printf("[NET] Accepted inbound connection from %s (group %u.%u.x.x: %d/%d)\n",
+               addr.ToStringLog().c_str(), nGroup >> 8, nGroup & 0xff, nGroupCount + 1, MAX_INBOUND_PER_GROUP);
+    CNode* pnode = new CNode(hSocket, addr, true);
+    pnode->AddRef();
+    CRITICAL_BLOCK(cs_vNodes)
+    {
+        vNodes.push_back(pnode);
+        if (fDebug)
+            printf("[NET] Total peers: %d\n", (int)vNodes.size());
+    }
+    return true;
+}
+
+static bool SocketRecvError(CNode* pnode, int nBytes)
+{
+    if (nBytes == 0)
+    {
+        // socket closed gracefully
+        if (!pnode->fDisconnect)
+            printf("socket closed\n");
+        pnode->CloseSocketDisconnect();
+    }
+    else if (nBytes < 0)
+    {
+        // error
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+        {
+            if (!pnode->fDisconnect)
+                printf("socket recv error %d\n", nErr);
+            pnode->CloseSocketDisconnect();
+        }
+    }
+    return false;
+}
+
+// Caller holds cs_vRecv.  Returns true if data was read and more may follow.
+static bool SocketRecvData(CNode* pnode)
+{
+    // A large payload in progress is received straight into its own buffer
+    if (!pnode->vRecvMsg.empty())
+    {
+        CNetMessage& msg = pnode->vRecvMsg.back();
+        if (msg.InData() && msg.GetDataRemaining() >= 0x10000)
+        {
+            unsigned int nMax;
+            char* pdata = msg.GetDataBuffer(nMax);
+            int nBytes = recv(pnode->hSocket, pdata, nMax, MSG_DONTWAIT);
+            if (nBytes > 0)
+            {
+                msg.nDataPos += nBytes;
+                pnode->nLastRecv = GetTime();
+                return true;
+            }
+            return SocketRecvError(pnode, nBytes);
+        }
+    }
+
+    // typical socket buffer is 8K-64K
+    char pchBuf[0x10000];
+    int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+    if (nBytes > 0)
+    {
+        pnode->nLastRecv = GetTime();
+        if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+        {
+            printf("socket recv bad message header from %s\n", pnode->addr.ToStringLog().c_str());
+            pnode->CloseSocketDisconnect();
+            return false;
+        }
+        return true;
+    }
+    return SocketRecvError(pnode, nBytes);
+}
+
+// True if the oldest message has been received in full
+static bool HasCompleteMessage(CNode* pnode)
+{
+    return (!pnode->vRecvMsg.empty() && pnode->vRecvMsg.front().Complete());
+}
+
+static void QueueMessageReady(CNode* pnode)
+{
+    CRITICAL_BLOCK(cs_vNodes)
+    {
+        if (pnode->fMessageQueued)
+            return;
+        pnode->fMessageQueued = true;
+        vMessageReady.push_back(pnode);
+    }
+    eventMessageHandler.Set();
+}
+
+void WakeMessageHandler(bool fSendAll)
+{
+    if (fSendAll)
+        fRelayPending = true;
+    eventMessageHandler.Set();
+}
+
+// Send as much of the queue as one call will take: vSend bytes with the
+// shared messages between them, without copying the shared ones into vSend
+static int SocketSendQueued(CNode* pnode)
+{
+    CPublicDataStream& vSend = pnode->vSend;
+#if defined(_WIN32) || defined(__MINGW32__) || defined(__WXMSW__)
+    // Only the first piece
+    if (!pnode->vSendShared.empty() && pnode->vSendShared.front().first == 0)
+    {
+        const CPublicDataStream& msg = *pnode->vSendShared.front().second;
+        return send(pnode->hSocket, &msg[pnode->nSendSharedPos], msg.size() - pnode->nSendSharedPos, MSG_NOSIGNAL | MSG_DONTWAIT);
+    }
+    unsigned int nEnd = (pnode->vSendShared.empty() ? vSend.size() : pnode->vSendShared.front().first);
+    return send(pnode->hSocket, &vSend[0], nEnd, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+    struct iovec iov[64];
+    int nIov = 0;
+    unsigned int nPos = 0;
+    deque<pair<unsigned int, CSharedNetMessage> >::iterator it = pnode->vSendShared.begin();
+    for (; it != pnode->vSendShared.end() && nIov + 2 <= 64; ++it)
+    {
+        if ((*it).first > nPos)
+        {
+            iov[nIov].iov_base = &vSend[nPos];
+            iov[nIov].iov_len = (*it).first - nPos;
+            nIov++;
+            nPos = (*it).first;
+        }
+        const CPublicDataStream& msg = *(*it).second;
+        unsigned int nSkip = (it == pnode->vSendShared.begin() ? pnode->nSendSharedPos : 0);
+        iov[nIov].iov_base = (void*)&msg[nSkip];
+        iov[nIov].iov_len = msg.size() - nSkip;
+        nIov++;
+    }
+    unsigned int nEnd = (it == pnode->vSendShared.end() ? vSend.size() : (*it).first);
+    if (nEnd > nPos && nIov < 64)
+    {
+        iov[nIov].iov_base = &vSend[nPos];
+        iov[nIov].iov_len = nEnd - nPos;
+        nIov++;
+    }
+
+    struct msghdr msghdr;
+    memset(&msghdr, 0, sizeof(msghdr));
+    msghdr.msg_iov = iov;
+    msghdr.msg_iovlen = nIov;
+    return sendmsg(pnode->hSocket, &msghdr, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
+}
+
+// Drop nBytes that have been sent off the front of the send queue
+static void SendQueueConsumed(CNode* pnode, unsigned int nBytes)
+{
+    CPublicDataStream& vSend = pnode->vSend;
+    deque<pair<unsigned int, CSharedNetMessage> >& vSendShared = pnode->vSendShared;
+    while (nBytes > 0)
+    {
+        if (!vSendShared.empty() && vSendShared.front().first == 0)
+        {
+            unsigned int nSize = vSendShared.front().second->size();
+            unsigned int n = min(nBytes, nSize - pnode->nSendSharedPos);
+            pnode->nSendSharedPos += n;
+            nBytes -= n;
+            if (pnode->nSendSharedPos == nSize)
+            {
+                vSendShared.pop_front();
+                pnode->nSendSharedPos = 0;
+            }
+        }
+        else
+        {
+            unsigned int nEnd = (vSendShared.empty() ? vSend.size() : vSendShared.front().first);
+            unsigned int n = min(nBytes, nEnd);
+            vSend.erase(vSend.begin(), vSend.begin() + n);
+            for (deque<pair<unsigned int, CSharedNetMessage> >::iterator it = vSendShared.begin(); it != vSendShared.end(); ++it)
+                (*it).first -= n;
+            nBytes -= n;
+        }
+    }
+}
 
-                    // hold in disconnected pool until all refs are released
-                    pnode->nReleaseTime = max(pnode->nReleaseTime, GetTime() + 15 * 60);
-                    if (pnode->fNetworkNode || pnode->fInbound)
-                        pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
+// Caller holds cs_vSend.  Returns true once the send queue is empty.
+static bool SocketSendData(CNode* pnode)
+{
+    while (!pnode->IsSendQueueEmpty() && pnode->hSocket != INVALID_SOCKET)
+    {
+        int nBytes = SocketSendQueued(pnode);
+        if (nBytes > 0)
+        {
+            SendQueueConsumed(pnode, nBytes);
+            pnode->nLastSend = GetTime();
+        }
+        else
+        {
+            if (nBytes < 0)
+            {
+                // error
+                int nErr = WSAGetLastError();
+                if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+                {
+                    printf("socket send error %d\n", nErr);
+                    pnode->CloseSocketDisconnect();
                 }
             }
+            break;
+        }
+    }
+    if (pnode->IsSendQueueEmpty())
+        pnode->nLastSendEmpty = GetTime();
+    return pnode->IsSendQueueEmpty();
+}
 
-            // Delete disconnected nodes
-            list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            foreach(CNode* pnode, vNodesDisconnectedCopy)
+static void CheckInactivity(CNode* pnode)
+{
+    if (pnode->IsSendQueueEmpty())
+        pnode->nLastSendEmpty = GetTime();
+    if (GetTime() - pnode->nTimeConnected > 120)
+    {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
+        {
+            printf("socket no message in first 120 seconds, %d %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0);
+            pnode->fDisconnect = true;
+        }
+        else if (GetTime() - pnode->nLastSend > 90*60 && GetTime() - pnode->nLastSendEmpty > 90*60)
+        {
+            printf("socket not sending\n");
+            pnode->fDisconnect = true;
+        }
+        else if (GetTime() - pnode->nLastRecv > 90*60)
+        {
+            printf("socket inactivity timeout\n");
+            pnode->fDisconnect = true;
+        }
+    }
+}
+
+#ifdef USE_EPOLL
+void ThreadSocketHandler2(void* parg)
+{
+    printf("ThreadSocketHandler started (epoll)\n");
+    list<CNode*> vNodesDisconnected;
+    int nPrevNodeCount = 0;
+    int64 nLastSweep = 0;
+
+    // A restarted thread gets a fresh epoll set and re-registers everything
+    if (hEpoll != -1)
+        close(hEpoll);
+    hEpoll = epoll_create1(EPOLL_CLOEXEC);
+    if (hWakeEvent == -1)
+        hWakeEvent = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (hEpoll == -1 || hWakeEvent == -1)
+        throw runtime_error("ThreadSocketHandler() : epoll setup failed");
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = &hListenSocket;
+    if (hListenSocket != INVALID_SOCKET && epoll_ctl(hEpoll, EPOLL_CTL_ADD, hListenSocket, &event) != 0)
+        printf("ThreadSocketHandler() : epoll_ctl for listen socket failed %d\n", errno);
+    event.data.ptr = &hWakeEvent;
+    if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hWakeEvent, &event) != 0)
+        throw runtime_error("ThreadSocketHandler() : epoll_ctl for eventfd failed");
+    CRITICAL_BLOCK(cs_vNodes)
+        foreach(CNode* pnode, vNodes)
+            pnode->nPollEvents = 0;
+
+    struct epoll_event events[256];
+    loop
+    {
+        //
+        // Disconnect nodes, register new ones and check for timeouts
+        //
+        if (GetTimeMillis() - nLastSweep >= 100)
+        {
+            nLastSweep = GetTimeMillis();
+            DisconnectNodes(vNodesDisconnected);
+            CRITICAL_BLOCK(cs_vNodes)
             {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0)
+                foreach(CNode* pnode, vNodes)
                 {
-                    bool fDelete = false;
-                    TRY_CRITICAL_BLOCK(pnode->cs_vSend)
-                     TRY_CRITICAL_BLOCK(pnode->cs_vRecv)
-                      TRY_CRITICAL_BLOCK(pnode->cs_mapRequests)
-                       TRY_CRITICAL_BLOCK(pnode->cs_inventory)
-                        fDelete = true;
-                    if (fDelete)
-                    {
-                        vNodesDisconnected.remove(pnode);
-                        delete pnode;
-                    }
+                    if (pnode->nPollEvents == 0)
+                        setSocketRetry.insert(pnode);
+                    CheckInactivity(pnode);
                 }
             }
+            if (vNodes.size() != nPrevNodeCount)
+            {
+                nPrevNodeCount = vNodes.size();
+                MainFrameRepaint();
+            }
+        }
+
+        vnThreadsRunning[0]--;
+        int nEvents = epoll_wait(hEpoll, events, sizeof(events)/sizeof(events[0]), setSocketRetry.empty() ? 100 : 5);
+        vnThreadsRunning[0]++;
+        if (fShutdown)
+            return;
+        if (nEvents < 0)
+        {
+            if (errno != EINTR)
+            {
+                printf("socket epoll_wait error %d\n", errno);
+                Sleep(50);
+            }
+            nEvents = 0;
+        }
+
+        vector<CNode*> vRecvNodes;
+        vector<CNode*> vSendNodes;
+        for (int i = 0; i < nEvents; i++)
+        {
+            if (events[i].data.ptr == &hListenSocket)
+            {
+                for (int n = 0; n < 64 && AcceptConnection(); n++)
+                    ;
+            }
+            else if (events[i].data.ptr == &hWakeEvent)
+            {
+                uint64 n;
+                while (read(hWakeEvent, &n, sizeof(n)) == sizeof(n))
+                    ;
+            }
+            else
+            {
+                CNode* pnode = (CNode*)events[i].data.ptr;
+                if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                    vRecvNodes.push_back(pnode);
+                if (events[i].events & EPOLLOUT)
+                    vSendNodes.push_back(pnode);
+            }
+        }
+        CRITICAL_BLOCK(cs_vSendReady)
+        {
+            vSendNodes.insert(vSendNodes.end(), vSendReady.begin(), vSendReady.end());
+            vSendReady.clear();
+        }
+        foreach(CNode* pnode, setSocketRetry)
+        {
+            vRecvNodes.push_back(pnode);
+            vSendNodes.push_back(pnode);
+        }
+        setSocketRetry.clear();
+
+        //
+        // Receive until the socket would block, a bounded amount per pass
+        //
+        foreach(CNode* pnode, vRecvNodes)
+        {
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+            if (pnode->nPollEvents == 0)
+                SetPollEvents(pnode, EPOLLIN | EPOLLET);
+            bool fLocked = false;
+            TRY_CRITICAL_BLOCK(pnode->cs_vRecv)
+            {
+                fLocked = true;
+                int n = 0;
+                while (n < 16 && SocketRecvData(pnode))
+                    n++;
+                if (n == 16)
+                    setSocketRetry.insert(pnode);
+                if (HasCompleteMessage(pnode))
+                    QueueMessageReady(pnode);
+            }
+            if (!fLocked)
+                setSocketRetry.insert(pnode);
         }
+
+        //
+        // Send, and only watch for writability while a send would block
+        //
+        foreach(CNode* pnode, vSendNodes)
+        {
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+            bool fLocked = false;
+            TRY_CRITICAL_BLOCK(pnode->cs_vSend)
+            {
+                fLocked = true;
+                bool fDrained = SocketSendData(pnode);
+                SetPollEvents(pnode, EPOLLIN | EPOLLET | (fDrained ? 0 : EPOLLOUT));
+            }
+            if (!fLocked)
+                setSocketRetry.insert(pnode);
+        }
+
+        nThreadSocketHandlerHeartbeat = GetTime();
+    }
+}
+#else
+void ThreadSocketHandler2(void* parg)
+{
+    printf("ThreadSocketHandler started\n");
+    list<CNode*> vNodesDisconnected;
+    int nPrevNodeCount = 0;
+
+    loop
+    {
+        //
+        // Disconnect nodes
+        //
+        DisconnectNodes(vNodesDisconnected);
         if (vNodes.size() != nPrevNodeCount)
         {
             nPrevNodeCount = vNodes.size();
@@ -665,7 +1685,7 @@ void ThreadSocketHandler2(void* parg)
                 FD_SET(pnode->hSocket, &fdsetError);
                 hSocketMax = max(hSocketMax, pnode->hSocket);
                 TRY_CRITICAL_BLOCK(pnode->cs_vSend)
-                    if (!pnode->vSend.empty())
+                    if (!pnode->IsSendQueueEmpty())
                         FD_SET(pnode->hSocket, &fdsetSend);
             }
         }
@@ -691,43 +1711,7 @@ void ThreadSocketHandler2(void* parg)
         // Accept new connections
         //
         if (FD_ISSET(hListenSocket, &fdsetRecv))
-        {
-            struct sockaddr_in sockaddr;
-            socklen_t len = sizeof(sockaddr);
-            SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
-            CAddress addr(sockaddr);
-            if (hSocket == INVALID_SOCKET)
-            {
-                if (WSAGetLastError() != WSAEWOULDBLOCK)
-                    printf("socket error accept failed: %d\n", WSAGetLastError());
-            }
-            else
-            {
-                uint16_t nGroup = addr.GetGroup();
-                int nGroupCount = GetInboundGroupCount(nGroup);
-                if (nGroupCount >= MAX_INBOUND_PER_GROUP)
-                {
-                    if (fDebug)
-                        printf("[NET] Rejecting inbound from %s: too many from network group %u.%u.x.x (%d/%d)\n",
-                               addr.ToStringLog().c_str(), nGroup >> 8, nGroup & 0xff, nGroupCount, MAX_INBOUND_PER_GROUP);
-                    closesocket(hSocket);
-                }
-                else
-                {
-                    if (fDebug)
-                        printf("[NET] Accepted inbound connection from %s (group %u.%u.x.x: %d/%d)\n",
-                               addr.ToStringLog().c_str(), nGroup >> 8, nGroup & 0xff, nGroupCount + 1, MAX_INBOUND_PER_GROUP);
-                    CNode* pnode = new CNode(hSocket, addr, true);
-                    pnode->AddRef();
-                    CRITICAL_BLOCK(cs_vNodes)
-                    {
-                        vNodes.push_back(pnode);
-                        if (fDebug)
-                            printf("[NET] Total peers: %d\n", (int)vNodes.size());
-                    }
-                }
-            }
-        }
+            AcceptConnection();
 
 
         //
@@ -754,36 +1738,9 @@ void ThreadSocketHandler2(void* parg)
             {
                 TRY_CRITICAL_BLOCK(pnode->cs_vRecv)
                 {
-                    CDataStream& vRecv = pnode->vRecv;
-                    unsigned int nPos = vRecv.size();
-
-                    // typical socket buffer is 8K-64K
-                    char pchBuf[0x10000];
-                    int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                    if (nBytes > 0)
-                    {
-                        vRecv.resize(nPos + nBytes);
-                        memcpy(&vRecv[nPos], pchBuf, nBytes);
-                        pnode->nLastRecv = GetTime();
-                    }
-                    else if (nBytes == 0)
-                    {
-                        // socket closed gracefully
-                        if (!pnode->fDisconnect)
-                            printf("socket closed\n");
-                        pnode->CloseSocketDisconnect();
-                    }
-                    else if (nBytes < 0)
-                    {
-                        // error
-                        int nErr = WSAGetLastError();
-                        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                        {
-                            if (!pnode->fDisconnect)
-                                printf("socket recv error %d\n", nErr);
-                            pnode->CloseSocketDisconnect();
-                        }
-                    }
+                    SocketRecvData(pnode);
+                    if (HasCompleteMessage(pnode))
+                        QueueMessageReady(pnode);
                 }
             }
 
@@ -795,53 +1752,13 @@ void ThreadSocketHandler2(void* parg)
             if (FD_ISSET(pnode->hSocket, &fdsetSend))
             {
                 TRY_CRITICAL_BLOCK(pnode->cs_vSend)
-                {
-                    CDataStream& vSend = pnode->vSend;
-                    if (!vSend.empty())
-                    {
-                        int nBytes = send(pnode->hSocket, &vSend[0], vSend.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            vSend.erase(vSend.begin(), vSend.begin() + nBytes);
-                            pnode->nLastSend = GetTime();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                printf("socket send error %d\n", nErr);
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
+                    SocketSendData(pnode);
             }
 
             //
             // Inactivity checking
             //
-            if (pnode->vSend.empty())
-                pnode->nLastSendEmpty = GetTime();
-            if (GetTime() - pnode->nTimeConnected > 120)
-            {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    printf("socket no message in first 120 seconds, %d %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0);
-                    pnode->fDisconnect = true;
-                }
-                else if (GetTime() - pnode->nLastSend > 90*60 && GetTime() - pnode->nLastSendEmpty > 90*60)
-                {
-                    printf("socket not sending\n");
-                    pnode->fDisconnect = true;
-                }
-                else if (GetTime() - pnode->nLastRecv > 90*60)
-                {
-                    printf("socket inactivity timeout\n");
-                    pnode->fDisconnect = true;
-                }
-            }
+            CheckInactivity(pnode);
         }
         CRITICAL_BLOCK(cs_vNodes)
         {
@@ -853,6 +1770,7 @@ void ThreadSocketHandler2(void* parg)
         Sleep(10);
     }
 }
+#endif
 
 
 
@@ -1012,7 +1930,6 @@ void ThreadOpenConnections2(void* parg)
         return;
 
     // Initiate network connections
-    int64 nStart = GetTime();
     const int nMaxConnections = 8;
     loop
     {
@@ -1030,112 +1947,84 @@ void ThreadOpenConnections2(void* parg)
         if (fShutdown)
             return;
 
-        CRITICAL_BLOCK(cs_mapAddresses)
-        {
-            static int64 nLastSeedAttempt = 0;
-            set<unsigned int> setSeed(pnSeed, pnSeed + ARRAYLEN(pnSeed));
+        static int64 nLastSeedAttempt = 0;
+        set<unsigned int> setSeed(pnSeed, pnSeed + ARRAYLEN(pnSeed));
 
-            int nCurrentConnections = vNodes.size();
-            int nSeedConnections = 0;
-            int nNonSeedConnections = 0;
+        int nCurrentConnections = vNodes.size();
+        int nSeedConnections = 0;
+        int nNonSeedConnections = 0;
 
-            CRITICAL_BLOCK(cs_vNodes)
+        CRITICAL_BLOCK(cs_vNodes)
+        {
+            foreach(CNode* pnode, vNodes)
             {
-                foreach(CNode* pnode, vNodes)
-                {
-                    if (setSeed.count(pnode->addr.ip))
-                        nSeedConnections++;
-                    else if (pnode->fSuccessfullyConnected)
-                        nNonSeedConnections++;
-                }
+                if (setSeed.count(pnode->addr.ip))
+                    nSeedConnections++;
+                else if (pnode->fSuccessfullyConnected)
+                    nNonSeedConnections++;
             }
+        }
 
-            bool fNeedSeeds = (nCurrentConnections < 3) ||
-                              (nNonSeedConnections < 2 && nSeedConnections == 0);
-            bool fCanTrySeeds = (GetTime() - nLastSeedAttempt > 15);
+        bool fNeedSeeds = (nCurrentConnections < 3) ||
+                          (nNonSeedConnections < 2 && nSeedConnections == 0);
+        bool fCanTrySeeds = (GetTime() - nLastSeedAttempt > 15);
 
-            if (fNeedSeeds && fCanTrySeeds)
-            {
-                nLastSeedAttempt = GetTime();
-                if (fDebug)
-                    printf("[NET] Connecting to seed nodes (connections=%d, seeds=%d, others=%d)\n",
-                           nCurrentConnections, nSeedConnections, nNonSeedConnections);
+        if (fNeedSeeds && fCanTrySeeds)
+        {
+            nLastSeedAttempt = GetTime();
+            if (fDebug)
+                printf("[NET] Connecting to seed nodes (connections=%d, seeds=%d, others=%d)\n",
+                       nCurrentConnections, nSeedConnections, nNonSeedConnections);
 
-                for (int i = 0; i < ARRAYLEN(pnSeed); i++)
-                {
-                    if (FindNode(pnSeed[i]))
-                        continue;
+            for (int i = 0; i < ARRAYLEN(pnSeed); i++)
+            {
+                if (FindNode(pnSeed[i]))
+                    continue;
 
-                    CAddress addr;
-                    addr.ip = pnSeed[i];
-                    addr.port = DEFAULT_PORT;
-                    addr.nServices = NODE_NETWORK;
-                    addr.nTime = GetTime();
-                    if (fDebug)
-                        printf("[NET] Seed %d: %s\n", i, addr.ToString().c_str());
-                    AddAddress(addr);
-                    OpenNetworkConnection(addr);
-                    Sleep(200);
-                }
+                CAddress addr;
+                addr.ip = pnSeed[i];
+                addr.port = DEFAULT_PORT;
+                addr.nServices = NODE_NETWORK;
+                addr.nTime = GetTime();
+                if (fDebug)
+                    printf("[NET] Seed %d: %s\n", i, addr.ToString().c_str());
+                AddAddress(addr);
+                OpenNetworkConnection(addr);
+                Sleep(200);
             }
+        }
 
-            if (nNonSeedConnections >= 6 && nSeedConnections > 0 && nCurrentConnections >= nMaxConnections - 1)
+        if (nNonSeedConnections >= 6 && nSeedConnections > 0 && nCurrentConnections >= nMaxConnections - 1)
+        {
+            if (fDebug)
+                printf("[NET] Have %d non-seed connections, freeing seed slot\n", nNonSeedConnections);
+            CRITICAL_BLOCK(cs_vNodes)
             {
-                if (fDebug)
-                    printf("[NET] Have %d non-seed connections, freeing seed slot\n", nNonSeedConnections);
-                CRITICAL_BLOCK(cs_vNodes)
+                foreach(CNode* pnode, vNodes)
                 {
-                    foreach(CNode* pnode, vNodes)
+                    if (setSeed.count(pnode->addr.ip))
                     {
-                        if (setSeed.count(pnode->addr.ip))
-                        {
-                            pnode->fDisconnect = true;
-                            break;
-                        }
+                        pnode->fDisconnect = true;
+                        break;
                     }
                 }
             }
         }
 
-
         //
-        // Periodically clean up old addresses that haven't been seen in a long time
+        // Periodically write the address tables out
         //
-        static int64 nLastCleanup = 0;
-        if (GetTime() - nLastCleanup > 60 * 60) // Every hour
+        static int64 nLastDump = GetTime();
+        if (GetTime() - nLastDump > 15 * 60)
         {
-            nLastCleanup = GetTime();
-            int64 nCutoff = GetAdjustedTime() - 12 * 60 * 60; // 12 hours
-            vector<vector<unsigned char> > vToErase;
-
-            foreach(const PAIRTYPE(vector<unsigned char>, CAddress)& item, mapAddresses)
-            {
-                const CAddress& addr = item.second;
-                if (addr.nTime < nCutoff && addr.nTime > 0)
-                {
-                    vToErase.push_back(item.first);
-                }
-            }
-
-            if (!vToErase.empty())
-            {
-                printf("Cleaning up %d old peer addresses (older than 12 hours)\n", (int)vToErase.size());
-                CAddrDB addrdb;
-                foreach(const vector<unsigned char>& key, vToErase)
-                {
-                    mapAddresses.erase(key);
-                }
-            }
+            nLastDump = GetTime();
+            DumpAddresses();
         }
 
         //
-        // Choose an address to connect to based on most recently seen
+        // Choose an address to connect to from the address manager,
         // with network group diversity for anti-eclipse protection
         //
-        CAddress addrConnect;
-        int64 nBest = INT64_MIN;
-
-        // Do this here so we don't have to critsect vNodes inside mapAddresses critsect
         set<unsigned int> setConnected;
         map<uint16_t, int> mapGroupCounts;
         CRITICAL_BLOCK(cs_vNodes)
@@ -1148,68 +2037,26 @@ void ThreadOpenConnections2(void* parg)
             }
         }
 
-        CRITICAL_BLOCK(cs_mapAddresses)
+        CAddress addrConnect;
+        int64 nNow = GetAdjustedTime();
+        for (int nTries = 0; nTries < 100; nTries++)
         {
-            foreach(const PAIRTYPE(vector<unsigned char>, CAddress)& item, mapAddresses)
-            {
-                const CAddress& addr = item.second;
-                if (!addr.IsIPv4() || !addr.IsValid() || setConnected.count(addr.ip))
-                    continue;
-
-                uint16_t nGroup = addr.GetGroup();
-                if (mapGroupCounts[nGroup] >= MAX_OUTBOUND_PER_GROUP)
-                    continue;
-                int64 nSinceLastSeen = GetAdjustedTime() - addr.nTime;
-                int64 nSinceLastTry = GetAdjustedTime() - addr.nLastTry;
-
-                // Randomize the order in a deterministic way, putting the standard port first
-                int64 nRandomizer = (uint64)(nStart * 4951 + addr.nLastTry * 9567851 + addr.ip * 7789) % (2 * 60 * 60);
-                if (addr.port != DEFAULT_PORT)
-                    nRandomizer += 2 * 60 * 60;
-
-                // Last seen  Base retry frequency
-                //   <1 hour   10 min
-                //    1 hour    1 hour
-                //    4 hours   2 hours
-                //   24 hours   5 hours
-                //   48 hours   7 hours
-                //    7 days   13 hours
-                //   30 days   27 hours
-                //   90 days   46 hours
-                //  365 days   93 hours
-                int64 nDelay = (int64)(3600.0 * sqrt(fabs((double)nSinceLastSeen) / 3600.0) + nRandomizer);
-
-                // Fast reconnect for one hour after last seen
-                if (nSinceLastSeen < 60 * 60)
-                    nDelay = 10 * 60;
-
-                // When we have few connections, be more aggressive about retrying
-                if (vNodes.size() < 4 && nSinceLastSeen < 60 * 60)
-                    nDelay = 30; // 30 seconds when bootstrapping
-
-                // Limit retry frequency
-                if (nSinceLastTry < nDelay)
-                    continue;
+            CAddress addr = addrman.Select();
+            if (!addr.IsIPv4() || !addr.IsValid())
+                break;
+            if (setConnected.count(addr.ip) || mapGroupCounts[addr.GetGroup()] >= MAX_OUTBOUND_PER_GROUP)
+                continue;
 
-                // If we have IRC, we'll be notified when they first come online,
-                // and again every 24 hours by the refresh broadcast.
-                // Maintain at least 4 connections before being selective about old addresses
-                if (nGotIRCAddresses > 0 && vNodes.size() >= 4 && nSinceLastSeen > 24 * 60 * 60)
-                    continue;
+            // Only retry an address we tried recently once we're running out of options
+            if (nNow - (int64)addr.nLastTry < 10 * 60 && nTries < 30)
+                continue;
 
-                // Only try the old stuff if we don't have enough connections
-                if (vNodes.size() >= 8 && nSinceLastSeen > 24 * 60 * 60)
-                    continue;
+            // Prefer the standard port
+            if (addr.port != DEFAULT_PORT && nTries < 50)
+                continue;
 
-                // If multiple addresses are ready, prioritize by time since
-                // last seen and time since last tried.
-                int64 nScore = min(nSinceLastTry, (int64)24 * 60 * 60) - nSinceLastSeen - nRandomizer;
-                if (nScore > nBest)
-                {
-                    nBest = nScore;
-                    addrConnect = addr;
-                }
-            }
+            addrConnect = addr;
+            break;
         }
 
         if (addrConnect.IsValid())
@@ -1288,45 +2135,98 @@ void ThreadMessageHandler2(void* parg)
 {
     printf("ThreadMessageHandler started\n");
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
+    int64 nLastSendAll = 0;
     while (!fShutdown)
     {
-        vector<CNode*> vNodesCopy;
+        //
+        // Process the nodes the socket thread has queued, in arrival order.
+        // Each gets one pass and goes to the back of the queue if it has more.
+        //
+        vector<CNode*> vReady;
         CRITICAL_BLOCK(cs_vNodes)
         {
-            vNodesCopy = vNodes;
-            foreach(CNode* pnode, vNodesCopy)
+            vReady.assign(vMessageReady.begin(), vMessageReady.end());
+            vMessageReady.clear();
+            foreach(CNode* pnode, vReady)
+            {
+                pnode->fMessageQueued = false;
                 pnode->AddRef();
+            }
         }
-
-        // Poll the connected nodes for messages
-        CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
-            pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
-        foreach(CNode* pnode, vNodesCopy)
+        foreach(CNode* pnode, vReady)
         {
             // Receive messages
+            bool fMore = true;
             TRY_CRITICAL_BLOCK(pnode->cs_vRecv)
+            {
                 ProcessMessages(pnode);
+                fMore = HasCompleteMessage(pnode);
+            }
             if (fShutdown)
                 return;
 
-            // Send messages
+            // Send replies right away
             TRY_CRITICAL_BLOCK(pnode->cs_vSend)
-                SendMessages(pnode, pnode == pnodeTrickle);
+                SendMessages(pnode, false);
             if (fShutdown)
                 return;
-        }
 
+            if (fMore)
+                QueueMessageReady(pnode);
+        }
         CRITICAL_BLOCK(cs_vNodes)
         {
-            foreach(CNode* pnode, vNodesCopy)
+            foreach(CNode* pnode, vReady)
                 pnode->Release();
         }
 
-        // Wait and allow messages to bunch up
-        vnThreadsRunning[2]--;
-        Sleep(100);
-        vnThreadsRunning[2]++;
+        //
+        // Every 100ms, or when something was relayed, give every node a
+        // chance to send inventory, getdata retries and keep-alives
+        //
+        bool fTimer = (GetTimeMillis() - nLastSendAll >= 100);
+        bool fRelay = fRelayPending.exchange(false);
+        if (fTimer || fRelay)
+        {
+            if (fTimer)
+                nLastSendAll = GetTimeMillis();
+
+            vector<CNode*> vNodesCopy;
+            CRITICAL_BLOCK(cs_vNodes)
+            {
+                vNodesCopy = vNodes;
+                foreach(CNode* pnode, vNodesCopy)
+                    pnode->AddRef();
+            }
+
+            CNode* pnodeTrickle = NULL;
+            if (fTimer && !vNodesCopy.empty())
+                pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
+            foreach(CNode* pnode, vNodesCopy)
+            {
+                TRY_CRITICAL_BLOCK(pnode->cs_vSend)
+                    SendMessages(pnode, pnode == pnodeTrickle);
+                if (fShutdown)
+                    return;
+            }
+
+            CRITICAL_BLOCK(cs_vNodes)
+            {
+                foreach(CNode* pnode, vNodesCopy)
+                    pnode->Release();
+            }
+        }
+
+        // Sleep until a message arrives or the next send pass is due
+        bool fIdle = false;
+        CRITICAL_BLOCK(cs_vNodes)
+            fIdle = vMessageReady.empty();
+        if (fIdle && !fRelayPending)
+        {
+            vnThreadsRunning[2]--;
+            eventMessageHandler.Wait(max((int64)1, 100 - (GetTimeMillis() - nLastSendAll)));
+            vnThreadsRunning[2]++;
+        }
         if (fShutdown)
             return;
     }
@@ -1340,6 +2240,348 @@ void ThreadMessageHandler2(void* parg)
 
 
 
+//
+// Block and transaction notifications
+//
+// Subscribers connect to -notifysocket, a TCP port on 127.0.0.1 or
+// unix:<path>, and send the names of the topics they want one per line:
+// hashblock, rawblock, hashtx, rawtx.  Each event is sent as a frame:
+//  (4) size of the rest of the frame
+//  topic as a length-prefixed string
+//  body as a length-prefixed byte vector
+//  (4) sequence number, counted separately for each topic
+// A subscriber that falls too far behind is disconnected.
+//
+
+static const unsigned int MAX_NOTIFY_BACKLOG = 32 * 1000000;
+
+class CNotifySubscriber
+{
+public:
+    SOCKET hSocket;
+    set<string> setTopics;
+    string strRecv;
+    CPublicDataStream vSend;
+    bool fDisconnect;
+
+    CNotifySubscriber(SOCKET hSocketIn) : vSend(SER_NETWORK)
+    {
+        hSocket = hSocketIn;
+        fDisconnect = false;
+    }
+};
+
+static SOCKET hNotifySocket = INVALID_SOCKET;
+static vector<CNotifySubscriber*> vNotifySubscribers;
+static map<string, unsigned int> mapNotifySequence;
+static CCriticalSection cs_vNotifySubscribers;
+
+bool NotifyWanted(const char* pszTopic)
+{
+    if (hNotifySocket == INVALID_SOCKET)
+        return false;
+    CRITICAL_BLOCK(cs_vNotifySubscribers)
+        foreach(CNotifySubscriber* psub, vNotifySubscribers)
+            if (psub->setTopics.count(pszTopic))
+                return true;
+    return false;
+}
+
+// Returns false if the subscriber's socket failed
+static bool NotifySendData(CNotifySubscriber* psub)
+{
+    while (!psub->vSend.empty())
+    {
+        int nBytes = send(psub->hSocket, &psub->vSend[0], psub->vSend.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (nBytes <= 0)
+        {
+            int nErr = WSAGetLastError();
+            return (nBytes < 0 && (nErr == WSAEWOULDBLOCK || nErr == WSAEMSGSIZE || nErr == WSAEINTR || nErr == WSAEINPROGRESS));
+        }
+        psub->vSend.erase(psub->vSend.begin(), psub->vSend.begin() + nBytes);
+    }
+    return true;
+}
+
+void PublishNotification(const char* pszTopic, const char* pch, unsigned int nSize)
+{
+    if (hNotifySocket == INVALID_SOCKET)
+        return;
+
+    CRITICAL_BLOCK(cs_vNotifySubscribers)
+    {
+        unsigned int nSequence = mapNotifySequence[pszTopic]++;
+
+        // Frame is built once and copied to each subscriber's queue
+        CPublicDataStream ssFrame(SER_NETWORK);
+        unsigned int nFrameSize = 0;
+        ssFrame << nFrameSize << string(pszTopic);
+        WriteCompactSize(ssFrame, nSize);
+        ssFrame.write(pch, nSize);
+        ssFrame << nSequence;
+        nFrameSize = ssFrame.size() - sizeof(nFrameSize);
+        memcpy(&ssFrame[0], &nFrameSize, sizeof(nFrameSize));
+
+        foreach(CNotifySubscriber* psub, vNotifySubscribers)
+        {
+            if (psub->fDisconnect || !psub->setTopics.count(pszTopic))
+                continue;
+            if (psub->vSend.size() + ssFrame.size() > MAX_NOTIFY_BACKLOG)
+            {
+                printf("notify subscriber too far behind, disconnecting\n");
+                psub->fDisconnect = true;
+                continue;
+            }
+            psub->vSend.write(&ssFrame[0], ssFrame.size());
+            if (!NotifySendData(psub))
+                psub->fDisconnect = true;
+        }
+
+        if (fDebug)
+            printf("[NOTIFY] %s seq=%u size=%u\n", pszTopic, nSequence, nSize);
+    }
+}
+
+static SOCKET BindNotifySocket(const string& strAddr, string& strPathRet)
+{
+    SOCKET hSocket = INVALID_SOCKET;
+    int nOne = 1;
+    strPathRet = "";
+
+    if (strAddr.substr(0, 5) == "unix:")
+    {
+#if defined(_WIN32) || defined(__MINGW32__) || defined(__WXMSW__)
+        printf("Error: -notifysocket=unix: is not supported on Windows\n");
+        return INVALID_SOCKET;
+#else
+        strPathRet = strAddr.substr(5);
+        if (!strPathRet.empty() && strPathRet[0] != '/')
+            strPathRet = GetDataDir() + "/" + strPathRet;
+        struct sockaddr_un sockaddr;
+        memset(&sockaddr, 0, sizeof(sockaddr));
+        sockaddr.sun_family = AF_UNIX;
+        if (strPathRet.empty() || strPathRet.size() >= sizeof(sockaddr.sun_path))
+        {
+            printf("Error: -notifysocket path is empty or too long\n");
+            return INVALID_SOCKET;
+        }
+        strlcpy(sockaddr.sun_path, strPathRet.c_str(), sizeof(sockaddr.sun_path));
+        unlink(strPathRet.c_str());
+        hSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (hSocket == INVALID_SOCKET)
+            return INVALID_SOCKET;
+        if (::bind(hSocket, (struct sockaddr*)&sockaddr, sizeof(sockaddr)) == SOCKET_ERROR)
+        {
+            printf("Error: Unable to bind notification socket %s (error %d)\n", strPathRet.c_str(), WSAGetLastError());
+            closesocket(hSocket);
+            return INVALID_SOCKET;
+        }
+#endif
+    }
+    else
+    {
+        int nPort = atoi(strAddr);
+        if (nPort <= 0 || nPort > 0xffff)
+        {
+            printf("Error: Invalid -notifysocket=%s\n", strAddr.c_str());
+            return INVALID_SOCKET;
+        }
+        hSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (hSocket == INVALID_SOCKET)
+            return INVALID_SOCKET;
+#if !defined(_WIN32) && !defined(__MINGW32__) && !defined(__WXMSW__)
+        setsockopt(hSocket, SOL_SOCKET, SO_REUSEADDR, (void*)&nOne, sizeof(int));
+#endif
+        // Events are only offered to this machine
+        struct sockaddr_in sockaddr;
+        memset(&sockaddr, 0, sizeof(sockaddr));
+        sockaddr.sin_family = AF_INET;
+        sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        sockaddr.sin_port = htons(nPort);
+        if (::bind(hSocket, (struct sockaddr*)&sockaddr, sizeof(sockaddr)) == SOCKET_ERROR)
+        {
+            printf("Error: Unable to bind notification port %d (error %d)\n", nPort, WSAGetLastError());
+            closesocket(hSocket);
+            return INVALID_SOCKET;
+        }
+    }
+
+#if defined(_WIN32) || defined(__MINGW32__) || defined(__WXMSW__)
+    if (ioctlsocket(hSocket, FIONBIO, (u_long*)&nOne) == SOCKET_ERROR || listen(hSocket, SOMAXCONN) == SOCKET_ERROR)
+#else
+    if (fcntl(hSocket, F_SETFL, O_NONBLOCK) == SOCKET_ERROR || listen(hSocket, SOMAXCONN) == SOCKET_ERROR)
+#endif
+    {
+        printf("Error: Listening on notification socket failed (error %d)\n", WSAGetLastError());
+        closesocket(hSocket);
+        return INVALID_SOCKET;
+    }
+    printf("Publishing notifications on %s\n", strAddr.c_str());
+    return hSocket;
+}
+
+// Read topic names, one per line
+static void NotifyRecvData(CNotifySubscriber* psub)
+{
+    char pchBuf[1000];
+    int nBytes = recv(psub->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+    if (nBytes <= 0)
+    {
+        int nErr = WSAGetLastError();
+        if (nBytes == 0 || (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS))
+            psub->fDisconnect = true;
+        return;
+    }
+    psub->strRecv.append(pchBuf, nBytes);
+
+    string::size_type nEnd;
+    while ((nEnd = psub->strRecv.find('\n')) != string::npos)
+    {
+        string strTopic = psub->strRecv.substr(0, nEnd);
+        psub->strRecv.erase(0, nEnd + 1);
+        boost::trim(strTopic);
+        if (strTopic == "hashblock" || strTopic == "rawblock" || strTopic == "hashtx" || strTopic == "rawtx")
+        {
+            psub->setTopics.insert(strTopic);
+            if (fDebug)
+                printf("[NOTIFY] subscribe %s\n", strTopic.c_str());
+        }
+    }
+    if (psub->strRecv.size() > 1000)
+        psub->fDisconnect = true;
+}
+
+void ThreadNotifyPublisher2(void* parg)
+{
+    printf("ThreadNotifyPublisher started\n");
+    string strPath;
+    SOCKET hListen = BindNotifySocket(GetArg("-notifysocket", ""), strPath);
+    if (hListen == INVALID_SOCKET)
+        return;
+    hNotifySocket = hListen;
+
+    while (!fShutdown)
+    {
+        fd_set fdsetRecv;
+        fd_set fdsetSend;
+        FD_ZERO(&fdsetRecv);
+        FD_ZERO(&fdsetSend);
+        FD_SET(hListen, &fdsetRecv);
+        SOCKET hSocketMax = hListen;
+        CRITICAL_BLOCK(cs_vNotifySubscribers)
+        {
+            foreach(CNotifySubscriber* psub, vNotifySubscribers)
+            {
+                FD_SET(psub->hSocket, &fdsetRecv);
+                if (!psub->vSend.empty())
+                    FD_SET(psub->hSocket, &fdsetSend);
+                hSocketMax = max(hSocketMax, psub->hSocket);
+            }
+        }
+
+        // Frames are sent by the publishing thread; this thread only
+        // accepts, reads subscriptions and drains what didn't fit
+        struct timeval timeout;
+        timeout.tv_sec  = 0;
+        timeout.tv_usec = 50000;
+        int nSelect = select(hSocketMax + 1, &fdsetRecv, &fdsetSend, NULL, &timeout);
+        if (fShutdown)
+            break;
+        if (nSelect == SOCKET_ERROR)
+        {
+            Sleep(50);
+            continue;
+        }
+
+        if (FD_ISSET(hListen, &fdsetRecv))
+        {
+            SOCKET hSocket = accept(hListen, NULL, NULL);
+            if (hSocket != INVALID_SOCKET)
+            {
+#if defined(_WIN32) || defined(__MINGW32__) || defined(__WXMSW__)
+                u_long nOne = 1;
+                ioctlsocket(hSocket, FIONBIO, &nOne);
+#else
+                fcntl(hSocket, F_SETFL, O_NONBLOCK);
+#endif
+                if (fDebug)
+                    printf("[NOTIFY] subscriber connected\n");
+                CRITICAL_BLOCK(cs_vNotifySubscribers)
+                    vNotifySubscribers.push_back(new CNotifySubscriber(hSocket));
+            }
+        }
+
+        CRITICAL_BLOCK(cs_vNotifySubscribers)
+        {
+            foreach(CNotifySubscriber* psub, vNotifySubscribers)
+            {
+                if (FD_ISSET(psub->hSocket, &fdsetRecv))
+                    NotifyRecvData(psub);
+                if (FD_ISSET(psub->hSocket, &fdsetSend) && !NotifySendData(psub))
+                    psub->fDisconnect = true;
+            }
+
+            vector<CNotifySubscriber*> vKeep;
+            foreach(CNotifySubscriber* psub, vNotifySubscribers)
+            {
+                if (psub->fDisconnect)
+                {
+                    if (fDebug)
+                        printf("[NOTIFY] subscriber disconnected\n");
+                    closesocket(psub->hSocket);
+                    delete psub;
+                }
+                else
+                    vKeep.push_back(psub);
+            }
+            vNotifySubscribers.swap(vKeep);
+        }
+    }
+
+    hNotifySocket = INVALID_SOCKET;
+    CRITICAL_BLOCK(cs_vNotifySubscribers)
+    {
+        foreach(CNotifySubscriber* psub, vNotifySubscribers)
+        {
+            closesocket(psub->hSocket);
+            delete psub;
+        }
+        vNotifySubscribers.clear();
+    }
+    closesocket(hListen);
+#if !defined(_WIN32) && !defined(__MINGW32__) && !defined(__WXMSW__)
+    if (!strPath.empty())
+        unlink(strPath.c_str());
+#endif
+}
+
+void ThreadNotifyPublisher(void* parg)
+{
+    IMPLEMENT_RANDOMIZE_STACK(ThreadNotifyPublisher(parg));
+    try
+    {
+        vnThreadsRunning[5]++;
+        ThreadNotifyPublisher2(parg);
+        vnThreadsRunning[5]--;
+    }
+    catch (std::exception& e) {
+        vnThreadsRunning[5]--;
+        PrintException(&e, "ThreadNotifyPublisher()");
+    } catch (...) {
+        vnThreadsRunning[5]--;
+        PrintException(NULL, "ThreadNotifyPublisher()");
+    }
+    printf("ThreadNotifyPublisher exiting\n");
+}
+
+
+
+
+
+
+
+
+
 bool BindListenPort(string& strError)
 {
     strError = "";
@@ -1523,6 +2765,11 @@ void StartNode(void* parg)
     if (!CreateThread(ThreadMessageHandler, NULL))
         printf("Error: CreateThread(ThreadMessageHandler) failed\n");
 
+    // Publish new blocks and transactions to local subscribers
+    if (mapArgs.count("-notifysocket"))
+        if (!CreateThread(ThreadNotifyPublisher, NULL))
+            printf("Error: CreateThread(ThreadNotifyPublisher) failed\n");
+
     // Generate coins in the background
     GenerateBitcoins(fGenerateBitcoins);
 
@@ -1587,6 +2834,8 @@ bool StopNode()
     fShutdown = true;
     fGenerateBitcoins = false;
     nTransactionsUpdated++;
+    WakeSocketHandler();
+    WakeMessageHandler();
 
     if (hListenSocket != INVALID_SOCKET)
     {
@@ -1595,7 +2844,7 @@ bool StopNode()
     }
 
     int64 nStart = GetTime();
-    while (vnThreadsRunning[0] > 0 || vnThreadsRunning[1] > 0 || vnThreadsRunning[2] > 0 || vnThreadsRunning[3] > 0 || vnThreadsRunning[4] > 0)
+    while (vnThreadsRunning[0] > 0 || vnThreadsRunning[1] > 0 || vnThreadsRunning[2] > 0 || vnThreadsRunning[3] > 0 || vnThreadsRunning[4] > 0 || vnThreadsRunning[5] > 0)
     {
         if (GetTime() - nStart > 20)
             break;
@@ -1606,6 +2855,7 @@ bool StopNode()
     if (vnThreadsRunning[2] > 0) printf("ThreadMessageHandler still running\n");
     if (vnThreadsRunning[3] > 0) printf("ThreadBitcoinMiner still running\n");
     if (vnThreadsRunning[4] > 0) printf("ThreadRPCServer still running\n");
+    if (vnThreadsRunning[5] > 0) printf("ThreadNotifyPublisher still running\n");
 
     nStart = GetTime();
     while (vnThreadsRunning[2] > 0 || vnThreadsRunning[4] > 0)
@@ -1616,6 +2866,8 @@ bool StopNode()
     }
     Sleep(50);
 
+    DumpAddresses();
+
     return true;
 }
 
@@ -17,6 +17,8 @@ static const unsigned int PUBLISH_HOPS = 5;
 enum
 {
     NODE_NETWORK = (1 << 0),
+    NODE_HEADERS = (1 << 1),
+    NODE_COMPACT = (1 << 2),
 };
 
 
@@ -24,15 +26,21 @@ enum
 
 bool ConnectSocket(const CAddress& addrConnect, SOCKET& hSocketRet);
 bool GetMyExternalIP(unsigned int& ipRet);
-bool AddAddress(CAddress addr);
+bool AddAddress(CAddress addr, unsigned int ipSource=0);
 void AddressCurrentlyConnected(const CAddress& addr);
+void DumpAddresses();
 CNode* FindNode(unsigned int ip);
 CNode* ConnectNode(CAddress addrConnect, int64 nTimeout=0);
-void AbandonRequests(void (*fn)(void*, CDataStream&), void* param1);
+void AbandonRequests(void (*fn)(void*, CPublicDataStream&), void* param1);
 bool AnySubscribed(unsigned int nChannel);
 bool BindListenPort(string& strError=REF(string()));
 void StartNode(void* parg);
 bool StopNode();
+void WakeSocketHandler(CNode* pnodeSend=NULL);
+void WakeMessageHandler(bool fSendAll=false);
+void ThreadNotifyPublisher(void* parg);
+bool NotifyWanted(const char* pszTopic);
+void PublishNotification(const char* pszTopic, const char* pch, unsigned int nSize);
 
 
 
@@ -130,6 +138,91 @@ public:
 
 
 
+//
+// A message being read off the wire.  The header is accumulated first, then
+// the payload is read straight into its own stream, so a complete message is
+// handed to ProcessMessage without being copied or shifted out of a shared
+// receive buffer.
+//
+class CNetMessage
+{
+public:
+    // Don't trust the header's size field for more than this up front
+    enum { MAX_RECV_PREALLOC = 0x100000 };
+
+    unsigned int nHeaderSize;
+    char pchHeader[sizeof(CMessageHeader)];
+    unsigned int nHeaderPos;
+    CMessageHeader hdr;
+    CPublicDataStream vRecv;
+    unsigned int nDataPos;
+
+    CNetMessage(int nTypeIn, int nVersionIn) : vRecv(nTypeIn, nVersionIn)
+    {
+        nHeaderSize = vRecv.GetSerializeSize(CMessageHeader());
+        nHeaderPos = 0;
+        nDataPos = 0;
+    }
+
+    bool InData() const { return nHeaderPos == nHeaderSize; }
+    bool Complete() const { return InData() && nDataPos == hdr.nMessageSize; }
+    unsigned int GetDataRemaining() const { return hdr.nMessageSize - nDataPos; }
+
+    // Returns the number of bytes used, or -1 if the header is bad
+    int ReadHeader(const char* pch, unsigned int nBytes)
+    {
+        unsigned int nCopy = min(nHeaderSize - nHeaderPos, nBytes);
+        memcpy(&pchHeader[nHeaderPos], pch, nCopy);
+        nHeaderPos += nCopy;
+        if (nHeaderPos < nHeaderSize)
+            return nCopy;
+
+        try
+        {
+            CPublicDataStream ss(pchHeader, pchHeader + nHeaderSize, vRecv.nType, vRecv.nVersion);
+            ss >> hdr;
+        }
+        catch (std::exception& e)
+        {
+            return -1;
+        }
+        if (!hdr.IsValid())
+            return -1;
+
+        vRecv.resize(min(hdr.nMessageSize, (unsigned int)MAX_RECV_PREALLOC));
+        return nCopy;
+    }
+
+    int ReadData(const char* pch, unsigned int nBytes)
+    {
+        unsigned int nMax;
+        char* pdata = GetDataBuffer(nMax);
+        unsigned int nCopy = min(nMax, nBytes);
+        memcpy(pdata, pch, nCopy);
+        nDataPos += nCopy;
+        return nCopy;
+    }
+
+    // Where the next payload bytes go, for receiving into directly
+    char* GetDataBuffer(unsigned int& nMax)
+    {
+        if (vRecv.size() < hdr.nMessageSize && vRecv.size() - nDataPos < 0x10000)
+            vRecv.resize(min(hdr.nMessageSize, max((unsigned int)vRecv.size() * 2, nDataPos + 0x10000)));
+        nMax = min((unsigned int)vRecv.size(), hdr.nMessageSize) - nDataPos;
+        return &vRecv[nDataPos];
+    }
+};
+
+
+//
+// A complete message, header and payload, serialized once and queued by
+// pointer on every peer it goes to.  Never modified after it's made.
+//
+typedef boost::shared_ptr<const CPublicDataStream> CSharedNetMessage;
+
+CSharedNetMessage MakeSharedMessage(const char* pszCommand, const CPublicDataStream& ssPayload);
+
+
 
 
 
@@ -262,7 +355,7 @@ public:
 
     vector<unsigned char> GetKey() const
     {
-        CDataStream ss;
+        CPublicDataStream ss;
         ss.reserve(18);
         ss << FLATDATA(pchReserved) << ip << port;
 
@@ -356,6 +449,113 @@ public:
 
 
 
+//
+// Address manager.  Addresses we've heard of go in the new table and move
+// to the tried table once we've connected to them.  Both tables are split
+// into buckets by a secret hash of the address group and who told us, so
+// no single source can fill them, and a connection candidate is drawn in
+// constant time from a dense list of each table's entries.
+//
+class CAddrInfo : public CAddress
+{
+public:
+    unsigned int ipSource;
+    int64 nLastSuccess;
+    int nAttempts;
+    bool fInTried;
+
+    // memory only
+    int nBucket;
+    int nBucketPos;
+    int nRandomPos;
+
+    CAddrInfo()
+    {
+        SetNullInfo();
+    }
+
+    CAddrInfo(const CAddress& addr, unsigned int ipSourceIn) : CAddress(addr)
+    {
+        SetNullInfo();
+        ipSource = ipSourceIn;
+    }
+
+    void SetNullInfo()
+    {
+        ipSource = 0;
+        nLastSuccess = 0;
+        nAttempts = 0;
+        fInTried = false;
+        nBucket = -1;
+        nBucketPos = -1;
+        nRandomPos = -1;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(*(CAddress*)this);
+        READWRITE(ipSource);
+        READWRITE(nLastTry);
+        READWRITE(nLastSuccess);
+        READWRITE(nAttempts);
+        READWRITE(fInTried);
+    )
+
+    bool IsTerrible(int64 nNow) const;
+    double GetChance(int64 nNow) const;
+};
+
+class CAddrMan
+{
+protected:
+    enum
+    {
+        NEW_BUCKET_COUNT = 256,
+        TRIED_BUCKET_COUNT = 64,
+        BUCKET_SIZE = 64,
+        NEW_BUCKETS_PER_SOURCE_GROUP = 32,
+        TRIED_BUCKETS_PER_GROUP = 8,
+    };
+
+    CCriticalSection cs;
+    uint256 nKey;
+    int nIdCount;
+    map<int, CAddrInfo> mapInfo;
+    map<CAddress, int> mapAddr;
+    vector<int> vRandomNew;
+    vector<int> vRandomTried;
+    vector<int> vNewSlots;
+    vector<int> vTriedSlots;
+
+    uint64 KeyedHash(const CPublicDataStream& ss) const;
+    int GetNewBucket(const CAddress& addr, unsigned int ipSource) const;
+    int GetTriedBucket(const CAddress& addr) const;
+    int GetBucketPosition(bool fNew, int nBucket, const CAddress& addr) const;
+    void RandomListAdd(int nId);
+    void RandomListRemove(int nId);
+    void Unplace(int nId);
+    bool PlaceNew(int nId);
+    void PlaceTried(int nId);
+    void Delete(int nId);
+    int Create(const CAddrInfo& info);
+
+public:
+    CAddrMan();
+    bool Add(const CAddress& addr, unsigned int ipSource);
+    void Good(const CAddress& addr);
+    void Attempt(const CAddress& addr);
+    void Connected(const CAddress& addr);
+    CAddress Select();
+    vector<CAddress> GetAddr(int64 nSince);
+    int size();
+    bool Write(const string& strFile);
+    bool Read(const string& strFile);
+};
+
+
+
+
+
 
 
 enum
@@ -446,10 +646,10 @@ public:
 class CRequestTracker
 {
 public:
-    void (*fn)(void*, CDataStream&);
+    void (*fn)(void*, CPublicDataStream&);
     void* param1;
 
-    explicit CRequestTracker(void (*fnIn)(void*, CDataStream&)=NULL, void* param1In=NULL)
+    explicit CRequestTracker(void (*fnIn)(void*, CPublicDataStream&)=NULL, void* param1In=NULL)
     {
         fn = fnIn;
         param1 = param1In;
@@ -464,6 +664,58 @@ public:
 
 
 
+//
+// Serialized messages we've relayed, so every peer that asks gets the same
+// buffer.  Bounded by bytes with the least recently used going first, and
+// nothing is kept longer than 15 minutes.
+//
+struct CRelayCacheStats
+{
+    unsigned int nEntries;
+    uint64 nBytes;
+    uint64 nMaxBytes;
+    uint64 nHits;
+    uint64 nMisses;
+    uint64 nEvicted;
+    uint64 nExpired;
+};
+
+class CRelayCache
+{
+protected:
+    struct CEntry
+    {
+        CSharedNetMessage pmsg;
+        int64 nExpire;
+        list<CInv>::iterator itLRU;
+    };
+
+    map<CInv, CEntry> mapEntries;
+    list<CInv> listLRU; // most recently used first
+    deque<pair<int64, CInv> > vExpiration;
+    uint64 nBytes;
+    uint64 nMaxBytes;
+    uint64 nHits;
+    uint64 nMisses;
+    uint64 nEvicted;
+    uint64 nExpired;
+    CCriticalSection cs;
+
+    void Erase(map<CInv, CEntry>::iterator mi);
+    void ExpireOld();
+
+public:
+    CRelayCache();
+    void SetMaxBytes(uint64 nMaxBytesIn);
+    void Insert(const CInv& inv, const CSharedNetMessage& pmsg);
+    CSharedNetMessage Find(const CInv& inv);
+    void Expire();
+    CRelayCacheStats GetStats();
+};
+
+
+
+
 
 extern bool fClient;
 extern uint64 nLocalServices;
@@ -476,11 +728,8 @@ extern int64 nThreadSocketHandlerHeartbeat;
 
 extern vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern map<vector<unsigned char>, CAddress> mapAddresses;
-extern CCriticalSection cs_mapAddresses;
-extern map<CInv, CDataStream> mapRelay;
-extern deque<pair<int64, CInv> > vRelayExpiration;
-extern CCriticalSection cs_mapRelay;
+extern CAddrMan addrman;
+extern CRelayCache relayCache;
 extern map<CInv, int64> mapAlreadyAskedFor;
 
 // Settings
@@ -498,14 +747,19 @@ public:
     // socket
     uint64 nServices;
     SOCKET hSocket;
-    CDataStream vSend;
-    CDataStream vRecv;
+    CPublicDataStream vSend;
+    deque<pair<unsigned int, CSharedNetMessage> > vSendShared;
+    unsigned int nSendSharedPos;
+    deque<CNetMessage> vRecvMsg;
+    int nRecvType;
+    int nRecvVersion;
     CCriticalSection cs_vSend;
     CCriticalSection cs_vRecv;
     int64 nLastSend;
     int64 nLastRecv;
     int64 nLastSendEmpty;
     int64 nTimeConnected;
+    unsigned int nPollEvents;
     unsigned int nHeaderStart;
     unsigned int nMessageStart;
     CAddress addr;
@@ -515,6 +769,7 @@ public:
     bool fNetworkNode;
     bool fSuccessfullyConnected;
     bool fDisconnect;
+    bool fMessageQueued;
 protected:
     int nRefCount;
 public:
@@ -524,7 +779,9 @@ public:
     uint256 hashContinue;
     CBlockIndex* pindexLastGetBlocksBegin;
     uint256 hashLastGetBlocksEnd;
+    CBlockIndex* pindexLastGetHeadersBegin;
     int nStartingHeight;
+    int nBlocksInFlight;
 
     // flood
     vector<CAddress> vAddrToSend;
@@ -532,7 +789,7 @@ public:
     bool fGetAddr;
 
     // inventory based relay
-    set<CInv> setInventoryKnown;
+    CRollingBloomFilter filterInventoryKnown;
     vector<CInv> vInventoryToSend;
     CCriticalSection cs_inventory;
     multimap<int64, CInv> mapAskFor;
@@ -541,24 +798,26 @@ public:
     vector<char> vfSubscribe;
 
 
-    CNode(SOCKET hSocketIn, CAddress addrIn, bool fInboundIn=false)
+    CNode(SOCKET hSocketIn, CAddress addrIn, bool fInboundIn=false) : filterInventoryKnown(20000, 0.000001)
     {
         nServices = 0;
         hSocket = hSocketIn;
         vSend.SetType(SER_NETWORK);
         vSend.SetVersion(0);
-        vRecv.SetType(SER_NETWORK);
-        vRecv.SetVersion(0);
+        nSendSharedPos = 0;
+        nRecvType = SER_NETWORK;
+        nRecvVersion = 0;
         // Version 0.2 obsoletes 20 Feb 2012
         if (GetTime() > 1329696000)
         {
             vSend.SetVersion(209);
-            vRecv.SetVersion(209);
+            nRecvVersion = 209;
         }
         nLastSend = 0;
         nLastRecv = 0;
         nLastSendEmpty = GetTime();
         nTimeConnected = GetTime();
+        nPollEvents = 0;
         nHeaderStart = -1;
         nMessageStart = -1;
         addr = addrIn;
@@ -568,12 +827,15 @@ public:
         fNetworkNode = false;
         fSuccessfullyConnected = false;
         fDisconnect = false;
+        fMessageQueued = false;
         nRefCount = 0;
         nReleaseTime = 0;
         hashContinue = 0;
         pindexLastGetBlocksBegin = 0;
         hashLastGetBlocksEnd = 0;
+        pindexLastGetHeadersBegin = 0;
         nStartingHeight = -1;
+        nBlocksInFlight = 0;
         fGetAddr = false;
         vfSubscribe.assign(256, false);
 
@@ -641,13 +903,21 @@ public:
     void AddInventoryKnown(const CInv& inv)
     {
         CRITICAL_BLOCK(cs_inventory)
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(inv.hash);
+    }
+
+    bool IsInventoryKnown(const CInv& inv)
+    {
+        bool fKnown = false;
+        CRITICAL_BLOCK(cs_inventory)
+            fKnown = filterInventoryKnown.contains(inv.hash);
+        return fKnown;
     }
 
     void PushInventory(const CInv& inv)
     {
         CRITICAL_BLOCK(cs_inventory)
-            if (!setInventoryKnown.count(inv))
+            if (!filterInventoryKnown.contains(inv.hash))
                 vInventoryToSend.push_back(inv);
     }
 
@@ -656,7 +926,8 @@ public:
         // We're using mapAskFor as a priority queue,
         // the key is the earliest time the request can be sent
         int64& nRequestTime = mapAlreadyAskedFor[inv];
-        printf("askfor %s   %" PRI64d "\n", inv.ToString().c_str(), nRequestTime);
+        if (fDebug)
+            printf("[NET] askfor %s   %" PRI64d "\n", inv.ToString().c_str(), nRequestTime);
 
         // Make sure not to reuse time indexes to keep things in the same order
         int64 nNow = (GetTime() - 1) * 1000000;
@@ -723,6 +994,10 @@ public:
         printf("(%d bytes) ", nSize);
         printf("\n");
 
+        // vSend was idle, so the socket thread isn't watching this socket for writability
+        if (nHeaderStart == 0 && vSendShared.empty())
+            WakeSocketHandler(this);
+
         nHeaderStart = -1;
         nMessageStart = -1;
         cs_vSend.Leave();
@@ -749,6 +1024,45 @@ public:
 
 
 
+    // The shared messages are sent in order with vSend, each one after the
+    // vSend bytes that were queued ahead of it
+    bool IsSendQueueEmpty() const
+    {
+        return vSend.empty() && vSendShared.empty();
+    }
+
+    void PushSharedMessage(const CSharedNetMessage& pmsg)
+    {
+        CRITICAL_BLOCK(cs_vSend)
+        {
+            if (vSend.GetVersion() < 209)
+            {
+                // Old header format without the checksum, has to be built for this peer
+                CMessageHeader hdr;
+                CPublicDataStream(pmsg->begin(), pmsg->end(), SER_NETWORK, 209) >> hdr;
+                unsigned int nHeaderSize = ::GetSerializeSize(hdr, SER_NETWORK, 209);
+                try
+                {
+                    BeginMessage(hdr.GetCommand().c_str());
+                    vSend.insert(vSend.end(), pmsg->begin() + nHeaderSize, pmsg->end());
+                    EndMessage();
+                }
+                catch (...)
+                {
+                    AbortMessage();
+                    throw;
+                }
+            }
+            else
+            {
+                bool fIdle = IsSendQueueEmpty();
+                vSendShared.push_back(make_pair((unsigned int)vSend.size(), pmsg));
+                if (fIdle)
+                    WakeSocketHandler(this);
+            }
+        }
+    }
+
     void PushMessage(const char* pszCommand)
     {
         try
@@ -909,7 +1223,7 @@ public:
 
 
     void PushRequest(const char* pszCommand,
-                     void (*fn)(void*, CDataStream&), void* param1)
+                     void (*fn)(void*, CPublicDataStream&), void* param1)
     {
         uint256 hashReply;
         RAND_bytes((unsigned char*)&hashReply, sizeof(hashReply));
@@ -922,7 +1236,7 @@ public:
 
     template<typename T1>
     void PushRequest(const char* pszCommand, const T1& a1,
-                     void (*fn)(void*, CDataStream&), void* param1)
+                     void (*fn)(void*, CPublicDataStream&), void* param1)
     {
         uint256 hashReply;
         RAND_bytes((unsigned char*)&hashReply, sizeof(hashReply));
@@ -935,7 +1249,7 @@ public:
 
     template<typename T1, typename T2>
     void PushRequest(const char* pszCommand, const T1& a1, const T2& a2,
-                     void (*fn)(void*, CDataStream&), void* param1)
+                     void (*fn)(void*, CPublicDataStream&), void* param1)
     {
         uint256 hashReply;
         RAND_bytes((unsigned char*)&hashReply, sizeof(hashReply));
@@ -949,11 +1263,13 @@ public:
 
 
     void PushGetBlocks(CBlockIndex* pindexBegin, uint256 hashEnd);
+    void PushGetHeaders(CBlockIndex* pindexBegin);
     bool IsSubscribed(unsigned int nChannel);
     void Subscribe(unsigned int nChannel, unsigned int nHops=0);
     void CancelSubscribe(unsigned int nChannel);
     void CloseSocketDisconnect();
     void Cleanup();
+    bool ReceiveMsgBytes(const char* pch, unsigned int nBytes);
 };
 
 
@@ -971,34 +1287,29 @@ inline void RelayInventory(const CInv& inv)
     CRITICAL_BLOCK(cs_vNodes)
         foreach(CNode* pnode, vNodes)
             pnode->PushInventory(inv);
+    WakeMessageHandler(true);
 }
 
 template<typename T>
 void RelayMessage(const CInv& inv, const T& a)
 {
-    CDataStream ss(SER_NETWORK);
+    CPublicDataStream ss(SER_NETWORK);
     ss.reserve(10000);
     ss << a;
     RelayMessage(inv, ss);
 }
 
-template<>
-inline void RelayMessage<>(const CInv& inv, const CDataStream& ss)
+inline void SaveRelayMessage(const CInv& inv, const CPublicDataStream& ss)
 {
-    CRITICAL_BLOCK(cs_mapRelay)
-    {
-        // Expire old relay messages
-        while (!vRelayExpiration.empty() && vRelayExpiration.front().first < GetTime())
-        {
-            mapRelay.erase(vRelayExpiration.front().second);
-            vRelayExpiration.pop_front();
-        }
-
-        // Save original serialized message so newer versions are preserved
-        mapRelay[inv] = ss;
-        vRelayExpiration.push_back(make_pair(GetTime() + 15 * 60, inv));
-    }
+    // Serialize the whole message once, every peer that asks gets the same buffer.
+    // Save original serialized message so newer versions are preserved
+    relayCache.Insert(inv, MakeSharedMessage(inv.GetCommand(), ss));
+}
 
+template<>
+inline void RelayMessage<>(const CInv& inv, const CPublicDataStream& ss)
+{
+    SaveRelayMessage(inv, ss);
     RelayInventory(inv);
 }
 
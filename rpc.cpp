@@ -9,6 +9,7 @@
 #define BOOST_ASIO_DISABLE_IOCP
 #endif
 #include <boost/asio.hpp>
+#include <boost/algorithm/string.hpp>
 #include "json/json_spirit_reader_template.h"
 #include "json/json_spirit_writer_template.h"
 #include "json/json_spirit_utils.h"
@@ -137,14 +138,17 @@ Value getblockhash(const Array& params, bool fHelp)
             "Returns hash of block in best-block-chain at <index>.");
 
     int nHeight = params[0].get_int();
-    if (nHeight < 0 || nHeight > nBestHeight)
+    uint256 hash = 0;
+    CRITICAL_BLOCK(cs_main)
+    {
+        CBlockIndex* pblockindex = FindBlockByHeight(nHeight);
+        if (pblockindex)
+            hash = pblockindex->GetBlockHash();
+    }
+    if (hash == 0)
         throw runtime_error("Block number out of range.");
 
-    CBlockIndex* pblockindex = pindexBest;
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-
-    return pblockindex->GetBlockHash().ToString();
+    return hash.ToString();
 }
 
 
@@ -159,12 +163,26 @@ Value getblock(const Array& params, bool fHelp)
     uint256 hash;
     hash.SetHex(strHash);
 
-    if (mapBlockIndex.count(hash) == 0)
-        throw runtime_error("Block not found");
+    // Copy what's needed out of the index under cs_main, read the block after
+    unsigned int nFile = 0, nBlockPos = 0;
+    int nHeight = 0;
+    uint256 hashNext = 0;
+    CRITICAL_BLOCK(cs_main)
+    {
+        auto mi = mapBlockIndex.find(hash);
+        if (mi == mapBlockIndex.end())
+            throw runtime_error("Block not found");
+        CBlockIndex* pblockindex = (*mi).second;
+        nFile = pblockindex->nFile;
+        nBlockPos = pblockindex->nBlockPos;
+        nHeight = pblockindex->nHeight;
+        if (pblockindex->pnext)
+            hashNext = pblockindex->pnext->GetBlockHash();
+    }
 
-    CBlockIndex* pblockindex = mapBlockIndex[hash];
     CBlock block;
-    block.ReadFromDisk(pblockindex, true);
+    if (!block.ReadFromDisk(nFile, nBlockPos, true))
+        throw runtime_error("Block read failed");
 
     Object result;
     result.push_back(Pair("hash", block.GetHash().ToString()));
@@ -174,15 +192,15 @@ Value getblock(const Array& params, bool fHelp)
     result.push_back(Pair("time", (boost::int64_t)block.nTime));
     result.push_back(Pair("bits", (boost::int64_t)block.nBits));
     result.push_back(Pair("nonce", (boost::int64_t)block.nNonce));
-    result.push_back(Pair("height", pblockindex->nHeight));
+    result.push_back(Pair("height", nHeight));
 
     Array txhashes;
     foreach(const CTransaction& tx, block.vtx)
         txhashes.push_back(tx.GetHash().ToString());
     result.push_back(Pair("tx", txhashes));
 
-    if (pblockindex->pnext)
-        result.push_back(Pair("nextblockhash", pblockindex->pnext->GetBlockHash().ToString()));
+    if (hashNext != 0)
+        result.push_back(Pair("nextblockhash", hashNext.ToString()));
 
     return result;
 }
@@ -201,6 +219,7 @@ Value gettransaction(const Array& params, bool fHelp)
 
     Object result;
 
+    CRITICAL_BLOCK(cs_main)
     CRITICAL_BLOCK(cs_mapWallet)
     {
         if (mapWallet.count(hash))
@@ -218,7 +237,7 @@ Value gettransaction(const Array& params, bool fHelp)
                 result.push_back(Pair("blockhash", wtx.hashBlock.ToString()));
 
             int64 nCredit = wtx.GetCredit(true);
-            int64 nDebit = wtx.GetDebit();
+            int64 nDebit = wtx.GetDebit(true);
             int64 nNet = nCredit - nDebit;
 
             result.push_back(Pair("amount", (double)nNet / (double)COIN));
@@ -403,7 +422,10 @@ Value getdifficulty(const Array& params, bool fHelp)
             "getdifficulty\n"
             "Returns the proof-of-work difficulty as a multiple of the minimum difficulty.");
 
-    return GetDifficulty();
+    double dDiff = 1.0;
+    CRITICAL_BLOCK(cs_main)
+        dDiff = GetDifficulty();
+    return dDiff;
 }
 
 
@@ -463,12 +485,16 @@ Value getmininginfo(const Array& params, bool fHelp)
             "Returns an object containing mining-related information.");
 
     Object obj;
-    obj.push_back(Pair("blocks",            (int)nBestHeight));
-    obj.push_back(Pair("currentblocksize",  (uint64_t)0));
-    obj.push_back(Pair("currentblocktx",    (uint64_t)0));
-    obj.push_back(Pair("difficulty",        (double)GetDifficulty()));
-    obj.push_back(Pair("networkhashps",     (int64_t)GetNetworkHashPS()));
-    obj.push_back(Pair("pooledtx",          (uint64_t)mapTransactions.size()));
+    CRITICAL_BLOCK(cs_main)
+    {
+        obj.push_back(Pair("blocks",            (int)nBestHeight));
+        obj.push_back(Pair("currentblocksize",  (uint64_t)0));
+        obj.push_back(Pair("currentblocktx",    (uint64_t)0));
+        obj.push_back(Pair("difficulty",        (double)GetDifficulty()));
+        obj.push_back(Pair("networkhashps",     (int64_t)GetNetworkHashPS()));
+    }
+    CRITICAL_BLOCK(cs_mapTransactions)
+        obj.push_back(Pair("pooledtx",          (uint64_t)mapTransactions.size()));
     obj.push_back(Pair("chain",             string("main")));
     obj.push_back(Pair("generate",          (bool)fGenerateBitcoins));
     obj.push_back(Pair("genproclimit",      (int)(fLimitProcessors ? nLimitProcessors : -1)));
@@ -501,7 +527,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
     for (unsigned int i = 1; i < pblock->vtx.size(); i++)
     {
         const CTransaction& tx = pblock->vtx[i];
-        CDataStream ssTx(SER_NETWORK);
+        CPublicDataStream ssTx(SER_NETWORK);
         ssTx << tx;
 
         Object entry;
@@ -552,7 +578,7 @@ Value submitblock(const Array& params, bool fHelp)
             "Returns null on success, error string on failure.");
 
     vector<unsigned char> blockData = ParseHex(params[0].get_str());
-    CDataStream ssBlock(blockData, SER_NETWORK);
+    CPublicDataStream ssBlock(blockData, SER_NETWORK);
     CBlock* pblock = new CBlock();
 
     try {
@@ -760,7 +786,8 @@ Value getinfo(const Array& params, bool fHelp)
     obj.push_back(Pair("proxy",         (fUseProxy ? addrProxy.ToStringIPPort() : string())));
     obj.push_back(Pair("generate",      (bool)fGenerateBitcoins));
     obj.push_back(Pair("genproclimit",  (int)(fLimitProcessors ? nLimitProcessors : -1)));
-    obj.push_back(Pair("difficulty",    (double)GetDifficulty()));
+    CRITICAL_BLOCK(cs_main)
+        obj.push_back(Pair("difficulty",    (double)GetDifficulty()));
     return obj;
 }
 
@@ -882,12 +909,19 @@ Value sendtoaddress(const Array& params, bool fHelp)
 }
 
 
-Value listtransactions(const Array& params, bool fHelp)
+// The streaming calls build their entries this many wallet or mempool txes
+// at a time under the lock and write them out after releasing it, so a
+// client that stops reading never holds up the node
+static const int RPC_STREAM_BATCH = 256;
+
+template<typename T>
+void ListTransactions(const Array& params, bool fHelp, T& ret)
 {
-    if (fHelp || params.size() > 2)
+    if (fHelp || params.size() > 4)
         throw runtime_error(
-            "listtransactions [count=10] [includegenerated=true]\n"
-            "Returns up to [count] most recent transactions.\n"
+            "listtransactions [count=10] [includegenerated=true] [skip=0] [sinceblockhash]\n"
+            "Returns up to [count] most recent transactions, after skipping the first [skip].\n"
+            "With [sinceblockhash], only transactions unconfirmed or confirmed after that block.\n"
             "Returns array of objects with: txid, category, amount, confirmations, time, address");
 
     int64 nCount = 10;
@@ -896,112 +930,192 @@ Value listtransactions(const Array& params, bool fHelp)
     bool fIncludeGenerated = true;
     if (params.size() > 1)
         fIncludeGenerated = params[1].get_bool();
-
-    vector<pair<int64, uint256> > vSorted;
-    CRITICAL_BLOCK(cs_mapWallet)
+    int64 nSkip = 0;
+    if (params.size() > 2)
+        nSkip = params[2].get_int64();
+    if (nCount < 0 || nSkip < 0)
+        throw runtime_error("Negative count or skip");
+
+    // Only transactions with fewer confirmations than the since block has
+    int nMaxDepth = INT_MAX;
+    if (params.size() > 3 && !params[3].get_str().empty())
     {
-        for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        uint256 hashSince;
+        hashSince.SetHex(params[3].get_str());
+        CRITICAL_BLOCK(cs_main)
         {
-            const CWalletTx& wtx = (*it).second;
-            vSorted.push_back(make_pair(wtx.nTimeReceived, wtx.GetHash()));
+            auto mi = mapBlockIndex.find(hashSince);
+            if (mi == mapBlockIndex.end())
+                throw runtime_error("Block not found");
+            CBlockIndex* pindexSince = (*mi).second;
+            while (pindexSince->pprev && !pindexSince->IsInMainChain())
+                pindexSince = pindexSince->pprev;
+            nMaxDepth = nBestHeight - pindexSince->nHeight;
         }
     }
-    sort(vSorted.rbegin(), vSorted.rend());
 
-    Array ret;
-    CRITICAL_BLOCK(cs_mapWallet)
+    pair<unsigned int, uint256> keyLast;
+    bool fFirst = true;
+    bool fMore = true;
+    while (fMore && (int64)ret.size() < nCount)
     {
-        for (vector<pair<int64, uint256> >::iterator it = vSorted.begin(); it != vSorted.end() && (int64)ret.size() < nCount; ++it)
+        Array vBatch;
+        CRITICAL_BLOCK(cs_main)
+        CRITICAL_BLOCK(cs_mapWallet)
         {
-            map<uint256, CWalletTx>::iterator mi = mapWallet.find((*it).second);
-            if (mi == mapWallet.end())
-                continue;
-            const CWalletTx& wtx = (*mi).second;
-
-            bool fGenerated = wtx.IsCoinBase();
-            if (fGenerated && !fIncludeGenerated)
-                continue;
+            // setWalletByTime is kept in step with mapWallet, so a page only
+            // touches the transactions it skips or returns.  Each batch resumes
+            // below the last key of the one before.
+            set<pair<unsigned int, uint256> >::reverse_iterator it = setWalletByTime.rbegin();
+            if (!fFirst)
+                it = set<pair<unsigned int, uint256> >::reverse_iterator(setWalletByTime.lower_bound(keyLast));
+            fFirst = false;
+            for (int nTx = 0; it != setWalletByTime.rend() && nTx < RPC_STREAM_BATCH && (int64)(ret.size() + vBatch.size()) < nCount; ++it, nTx++)
+            {
+                keyLast = *it;
+                map<uint256, CWalletTx>::iterator mi = mapWallet.find((*it).second);
+                if (mi == mapWallet.end())
+                    continue;
+                const CWalletTx& wtx = (*mi).second;
 
-            int nDepth = wtx.GetDepthInMainChain();
-            int64 nTime = wtx.nTimeReceived;
-            string strTxid = wtx.GetHash().ToString();
+                bool fGenerated = wtx.IsCoinBase();
+                if (fGenerated && !fIncludeGenerated)
+                    continue;
 
-            if (fGenerated)
-            {
-                if (nDepth < GetCoinbaseMaturity())
+                int nDepth = wtx.GetDepthInMainChain();
+                if (nDepth > nMaxDepth)
                     continue;
-                int64 nCredit = wtx.GetCredit(true);
-                Object entry;
-                entry.push_back(Pair("txid", strTxid));
-                entry.push_back(Pair("category", "generate"));
-                entry.push_back(Pair("amount", (double)nCredit / (double)COIN));
-                entry.push_back(Pair("confirmations", nDepth));
-                entry.push_back(Pair("time", (boost::int64_t)nTime));
-                ret.push_back(entry);
-            }
-            else
-            {
-                int64 nDebit = wtx.GetDebit();
-                int64 nCredit = wtx.GetCredit(true);
+                int64 nTime = wtx.nTimeReceived;
+                string strTxid = wtx.GetHash().ToString();
 
-                if (nDebit > 0)
+                Array vEntries;
+                if (fGenerated)
+                {
+                    if (nDepth < GetCoinbaseMaturity())
+                        continue;
+                    int64 nCredit = wtx.GetCredit(true);
+                    Object entry;
+                    entry.push_back(Pair("txid", strTxid));
+                    entry.push_back(Pair("category", "generate"));
+                    entry.push_back(Pair("amount", (double)nCredit / (double)COIN));
+                    entry.push_back(Pair("confirmations", nDepth));
+                    entry.push_back(Pair("time", (boost::int64_t)nTime));
+                    vEntries.push_back(entry);
+                }
+                else
                 {
-                    int64 nValueOut = wtx.GetValueOut();
-                    int64 nFee = nDebit - nValueOut;
+                    int64 nDebit = wtx.GetDebit(true);
+                    int64 nCredit = wtx.GetCredit(true);
 
-                    for (int i = 0; i < wtx.vout.size(); i++)
+                    if (nDebit > 0)
                     {
-                        const CTxOut& txout = wtx.vout[i];
-                        if (txout.IsMine())
-                            continue;
-
-                        string strAddress;
-                        ExtractAddress(txout.scriptPubKey, strAddress);
-
-                        Object entry;
-                        entry.push_back(Pair("txid", strTxid));
-                        entry.push_back(Pair("category", "send"));
-                        entry.push_back(Pair("amount", (double)(-txout.nValue) / (double)COIN));
-                        entry.push_back(Pair("fee", (double)(-nFee) / (double)COIN));
-                        if (!strAddress.empty())
-                            entry.push_back(Pair("address", strAddress));
-                        entry.push_back(Pair("confirmations", nDepth));
-                        entry.push_back(Pair("time", (boost::int64_t)nTime));
-                        ret.push_back(entry);
-                        nFee = 0;
+                        int64 nValueOut = wtx.GetValueOut();
+                        int64 nFee = nDebit - nValueOut;
+
+                        for (int i = 0; i < wtx.vout.size(); i++)
+                        {
+                            const CTxOut& txout = wtx.vout[i];
+                            if (txout.IsMine())
+                                continue;
+
+                            string strAddress;
+                            ExtractAddress(txout.scriptPubKey, strAddress);
+
+                            Object entry;
+                            entry.push_back(Pair("txid", strTxid));
+                            entry.push_back(Pair("category", "send"));
+                            entry.push_back(Pair("amount", (double)(-txout.nValue) / (double)COIN));
+                            entry.push_back(Pair("fee", (double)(-nFee) / (double)COIN));
+                            if (!strAddress.empty())
+                                entry.push_back(Pair("address", strAddress));
+                            entry.push_back(Pair("confirmations", nDepth));
+                            entry.push_back(Pair("time", (boost::int64_t)nTime));
+                            vEntries.push_back(entry);
+                            nFee = 0;
+                        }
                     }
-                }
 
-                if (nCredit > 0)
-                {
-                    for (int i = 0; i < wtx.vout.size(); i++)
+                    if (nCredit > 0)
                     {
-                        const CTxOut& txout = wtx.vout[i];
-                        if (!txout.IsMine())
-                            continue;
-
-                        string strAddress;
-                        ExtractAddress(txout.scriptPubKey, strAddress);
-
-                        Object entry;
-                        entry.push_back(Pair("txid", strTxid));
-                        entry.push_back(Pair("category", "receive"));
-                        entry.push_back(Pair("amount", (double)txout.nValue / (double)COIN));
-                        if (!strAddress.empty())
-                            entry.push_back(Pair("address", strAddress));
-                        entry.push_back(Pair("confirmations", nDepth));
-                        entry.push_back(Pair("time", (boost::int64_t)nTime));
-                        ret.push_back(entry);
+                        for (int i = 0; i < wtx.vout.size(); i++)
+                        {
+                            const CTxOut& txout = wtx.vout[i];
+                            if (!txout.IsMine())
+                                continue;
+
+                            string strAddress;
+                            ExtractAddress(txout.scriptPubKey, strAddress);
+
+                            Object entry;
+                            entry.push_back(Pair("txid", strTxid));
+                            entry.push_back(Pair("category", "receive"));
+                            entry.push_back(Pair("amount", (double)txout.nValue / (double)COIN));
+                            if (!strAddress.empty())
+                                entry.push_back(Pair("address", strAddress));
+                            entry.push_back(Pair("confirmations", nDepth));
+                            entry.push_back(Pair("time", (boost::int64_t)nTime));
+                            vEntries.push_back(entry);
+                        }
                     }
                 }
+
+                for (int i = 0; i < vEntries.size() && (int64)(ret.size() + vBatch.size()) < nCount; i++)
+                {
+                    if (nSkip > 0)
+                        nSkip--;
+                    else
+                        vBatch.push_back(vEntries[i]);
+                }
             }
+            fMore = (it != setWalletByTime.rend());
         }
+        foreach(const Value& entry, vBatch)
+            ret.push_back(entry);
     }
+}
 
+Value listtransactions(const Array& params, bool fHelp)
+{
+    Array ret;
+    ListTransactions(params, fHelp, ret);
     return ret;
 }
 
 
+// Only the wallet txes setWalletByAddress lists for these scripts are read
+int64 GetReceivedByScripts(const set<CScript>& setPubKey, int nMinDepth)
+{
+    int64 nAmount = 0;
+    CRITICAL_BLOCK(cs_main)
+    CRITICAL_BLOCK(cs_mapWallet)
+    {
+        set<uint256> setTx;
+        foreach(const CScript& scriptPubKey, setPubKey)
+        {
+            uint160 hash160 = scriptPubKey.GetBitcoinAddressHash160();
+            set<pair<uint160, uint256> >::iterator it = setWalletByAddress.lower_bound(make_pair(hash160, uint256(0)));
+            for (; it != setWalletByAddress.end() && (*it).first == hash160; ++it)
+                setTx.insert((*it).second);
+        }
+
+        foreach(const uint256& hash, setTx)
+        {
+            map<uint256, CWalletTx>::iterator mi = mapWallet.find(hash);
+            if (mi == mapWallet.end())
+                continue;
+            const CWalletTx& wtx = (*mi).second;
+            if (wtx.IsCoinBase() || !wtx.IsFinal())
+                continue;
+
+            foreach(const CTxOut& txout, wtx.vout)
+                if (setPubKey.count(txout.scriptPubKey))
+                    if (wtx.GetDepthInMainChain() >= nMinDepth)
+                        nAmount += txout.nValue;
+        }
+    }
+    return nAmount;
+}
+
 Value getreceivedbyaddress(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() < 1 || params.size() > 2)
@@ -1016,30 +1130,15 @@ Value getreceivedbyaddress(const Array& params, bool fHelp)
         throw runtime_error("Invalid Bitok address");
     if (!IsMine(scriptPubKey))
         return (double)0.0;
+    set<CScript> setPubKey;
+    setPubKey.insert(scriptPubKey);
 
     // Minimum confirmations
     int nMinDepth = 1;
     if (params.size() > 1)
         nMinDepth = params[1].get_int();
 
-    // Tally
-    int64 nAmount = 0;
-    CRITICAL_BLOCK(cs_mapWallet)
-    {
-        for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx& wtx = (*it).second;
-            if (wtx.IsCoinBase() || !wtx.IsFinal())
-                continue;
-
-            foreach(const CTxOut& txout, wtx.vout)
-                if (txout.scriptPubKey == scriptPubKey)
-                    if (wtx.GetDepthInMainChain() >= nMinDepth)
-                        nAmount += txout.nValue;
-        }
-    }
-
-    return (double)nAmount / (double)COIN;
+    return (double)GetReceivedByScripts(setPubKey, nMinDepth) / (double)COIN;
 }
 
 
@@ -1075,24 +1174,7 @@ Value getreceivedbylabel(const Array& params, bool fHelp)
     if (params.size() > 1)
         nMinDepth = params[1].get_int();
 
-    // Tally
-    int64 nAmount = 0;
-    CRITICAL_BLOCK(cs_mapWallet)
-    {
-        for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx& wtx = (*it).second;
-            if (wtx.IsCoinBase() || !wtx.IsFinal())
-                continue;
-
-            foreach(const CTxOut& txout, wtx.vout)
-                if (setPubKey.count(txout.scriptPubKey))
-                    if (wtx.GetDepthInMainChain() >= nMinDepth)
-                        nAmount += txout.nValue;
-        }
-    }
-
-    return (double)nAmount / (double)COIN;
+    return (double)GetReceivedByScripts(setPubKey, nMinDepth) / (double)COIN;
 }
 
 
@@ -1114,7 +1196,10 @@ Value getbestblockhash(const Array& params, bool fHelp)
             "getbestblockhash\n"
             "Returns the hash of the best (tip) block in the longest block chain.");
 
-    return hashBestChain.ToString();
+    uint256 hash;
+    CRITICAL_BLOCK(cs_main)
+        hash = hashBestChain;
+    return hash.ToString();
 }
 
 
@@ -1153,7 +1238,7 @@ Value getrawtransaction(const Array& params, bool fHelp)
             throw runtime_error("No information available about transaction");
     }
 
-    CDataStream ssTx;
+    CPublicDataStream ssTx;
     ssTx << tx;
     string strHex = HexStr(ssTx.begin(), ssTx.end());
 
@@ -1206,27 +1291,40 @@ Value getrawtransaction(const Array& params, bool fHelp)
 }
 
 
-Value getrawmempool(const Array& params, bool fHelp)
+template<typename T>
+void GetRawMempool(const Array& params, bool fHelp, T& ret)
 {
     if (fHelp || params.size() != 0)
         throw runtime_error(
             "getrawmempool\n"
             "Returns all transaction ids in memory pool.");
 
-    Array ret;
+    vector<uint256> vHash;
     CRITICAL_BLOCK(cs_mapTransactions)
     {
+        vHash.reserve(mapTransactions.size());
         for (map<uint256, CTransaction>::iterator mi = mapTransactions.begin();
              mi != mapTransactions.end(); ++mi)
         {
-            ret.push_back((*mi).first.ToString());
+            vHash.push_back((*mi).first);
         }
     }
+
+    // Written out after cs_mapTransactions is released
+    foreach(const uint256& hash, vHash)
+        ret.push_back(hash.ToString());
+}
+
+Value getrawmempool(const Array& params, bool fHelp)
+{
+    Array ret;
+    GetRawMempool(params, fHelp, ret);
     return ret;
 }
 
 
-Value listunspent(const Array& params, bool fHelp)
+template<typename T>
+void ListUnspent(const Array& params, bool fHelp, T& ret)
 {
     if (fHelp || params.size() > 2)
         throw runtime_error(
@@ -1242,54 +1340,72 @@ Value listunspent(const Array& params, bool fHelp)
     if (params.size() > 1)
         nMaxDepth = params[1].get_int();
 
-    Array results;
     CTxDB txdb("r");
 
-    CRITICAL_BLOCK(cs_mapWallet)
+    uint256 hashNext = 0;
+    bool fMore = true;
+    while (fMore)
     {
-        for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        Array vBatch;
+        CRITICAL_BLOCK(cs_main)
+        CRITICAL_BLOCK(cs_mapWallet)
         {
-            const CWalletTx& wtx = (*it).second;
-
-            if (wtx.IsCoinBase() && wtx.GetBlocksToMaturity() > 0)
-                continue;
-
-            int nDepth = wtx.GetDepthInMainChain();
-            if (nDepth < nMinDepth || nDepth > nMaxDepth)
-                continue;
-
-            for (int i = 0; i < wtx.vout.size(); i++)
+            // Each batch resumes at the first wallet tx the one before didn't reach
+            map<uint256, CWalletTx>::iterator it = mapWallet.lower_bound(hashNext);
+            for (int nTx = 0; it != mapWallet.end() && nTx < RPC_STREAM_BATCH; ++it, nTx++)
             {
-                const CTxOut& txout = wtx.vout[i];
+                const CWalletTx& wtx = (*it).second;
 
-                if (!txout.IsMine())
+                if (wtx.IsCoinBase() && wtx.GetBlocksToMaturity() > 0)
                     continue;
 
-                CTxIndex txindex;
-                if (!txdb.ReadTxIndex(wtx.GetHash(), txindex))
+                int nDepth = wtx.GetDepthInMainChain();
+                if (nDepth < nMinDepth || nDepth > nMaxDepth)
                     continue;
 
-                if (i < txindex.vSpent.size() && !txindex.vSpent[i].IsNull())
-                    continue;
+                for (int i = 0; i < wtx.vout.size(); i++)
+                {
+                    const CTxOut& txout = wtx.vout[i];
+
+                    if (!txout.IsMine())
+                        continue;
+
+                    CTxIndex txindex;
+                    if (!txdb.ReadTxIndex(wtx.GetHash(), txindex))
+                        continue;
+
+                    if (i < txindex.vSpent.size() && !txindex.vSpent[i].IsNull())
+                        continue;
 
-                Object entry;
-                entry.push_back(Pair("txid", wtx.GetHash().ToString()));
-                entry.push_back(Pair("vout", i));
+                    Object entry;
+                    entry.push_back(Pair("txid", wtx.GetHash().ToString()));
+                    entry.push_back(Pair("vout", i));
 
-                string strAddress;
-                if (ExtractAddress(txout.scriptPubKey, strAddress))
-                    entry.push_back(Pair("address", strAddress));
+                    string strAddress;
+                    if (ExtractAddress(txout.scriptPubKey, strAddress))
+                        entry.push_back(Pair("address", strAddress));
 
-                entry.push_back(Pair("scriptPubKey", HexStr(txout.scriptPubKey.begin(), txout.scriptPubKey.end(), false)));
-                entry.push_back(Pair("amount", (double)txout.nValue / (double)COIN));
-                entry.push_back(Pair("confirmations", nDepth));
+                    entry.push_back(Pair("scriptPubKey", HexStr(txout.scriptPubKey.begin(), txout.scriptPubKey.end(), false)));
+                    entry.push_back(Pair("amount", (double)txout.nValue / (double)COIN));
+                    entry.push_back(Pair("confirmations", nDepth));
 
-                results.push_back(entry);
+                    vBatch.push_back(entry);
+                }
             }
+            fMore = (it != mapWallet.end());
+            if (fMore)
+                hashNext = (*it).first;
         }
+        foreach(const Value& entry, vBatch)
+            ret.push_back(entry);
     }
+}
 
-    return results;
+Value listunspent(const Array& params, bool fHelp)
+{
+    Array ret;
+    ListUnspent(params, fHelp, ret);
+    return ret;
 }
 
 
@@ -1321,6 +1437,26 @@ Value getpeerinfo(const Array& params, bool fHelp)
 }
 
 
+Value getrelaycacheinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getrelaycacheinfo\n"
+            "Returns the size and hit counts of the relay message cache.");
+
+    CRelayCacheStats stats = relayCache.GetStats();
+    Object obj;
+    obj.push_back(Pair("entries",       (int)stats.nEntries));
+    obj.push_back(Pair("bytes",         (boost::int64_t)stats.nBytes));
+    obj.push_back(Pair("maxbytes",      (boost::int64_t)stats.nMaxBytes));
+    obj.push_back(Pair("hits",          (boost::int64_t)stats.nHits));
+    obj.push_back(Pair("misses",        (boost::int64_t)stats.nMisses));
+    obj.push_back(Pair("evicted",       (boost::int64_t)stats.nEvicted));
+    obj.push_back(Pair("expired",       (boost::int64_t)stats.nExpired));
+    return obj;
+}
+
+
 Value ListReceived(const Array& params, bool fByLabels)
 {
     // Minimum confirmations
@@ -1335,6 +1471,7 @@ Value ListReceived(const Array& params, bool fByLabels)
 
     // Tally
     map<uint160, tallyitem> mapTally;
+    CRITICAL_BLOCK(cs_main)
     CRITICAL_BLOCK(cs_mapWallet)
     {
         for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
@@ -1343,6 +1480,10 @@ Value ListReceived(const Array& params, bool fByLabels)
             if (wtx.IsCoinBase() || !wtx.IsFinal())
                 continue;
 
+            // Nothing to tally unless some output is ours
+            if (wtx.GetCredit(true) == 0)
+                continue;
+
             int nDepth = wtx.GetDepthInMainChain();
             if (nDepth < nMinDepth)
                 continue;
@@ -1452,9 +1593,103 @@ Value listreceivedbylabel(const Array& params, bool fHelp)
 }
 
 
+static uint160 ParseIndexedAddress(const string& strAddress)
+{
+    if (!fAddrIndex)
+        throw runtime_error("Address index is not enabled, restart with -addrindex");
+    uint160 hash160;
+    if (!AddressToHash160(strAddress, hash160))
+        throw runtime_error("Invalid Bitok address");
+    return hash160;
+}
 
+static void ParseHeightRange(const Array& params, int& nMinHeight, int& nMaxHeight)
+{
+    nMinHeight = 0;
+    nMaxHeight = INT_MAX;
+    if (params.size() > 1)
+        nMinHeight = max(0, params[1].get_int());
+    if (params.size() > 2)
+        nMaxHeight = params[2].get_int();
+}
 
+Value getaddressbalance(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressbalance <bitokaddress>\n"
+            "Returns the confirmed balance of any address and the total it has received.\n"
+            "Requires -addrindex.");
 
+    uint160 hash160 = ParseIndexedAddress(params[0].get_str());
+    CAddrBalance balance;
+    CTxDB("r").ReadAddrBalance(hash160, balance);
+
+    Object result;
+    result.push_back(Pair("balance", (double)balance.nBalance / (double)COIN));
+    result.push_back(Pair("received", (double)balance.nReceived / (double)COIN));
+    return result;
+}
+
+Value getaddresstxids(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 3)
+        throw runtime_error(
+            "getaddresstxids <bitokaddress> [startheight=0] [endheight]\n"
+            "Returns the ids of confirmed transactions paying to or spending from any address,\n"
+            "in block height order, for blocks from [startheight] to [endheight] inclusive.\n"
+            "Requires -addrindex.");
+
+    uint160 hash160 = ParseIndexedAddress(params[0].get_str());
+    int nMinHeight, nMaxHeight;
+    ParseHeightRange(params, nMinHeight, nMaxHeight);
+
+    vector<pair<CAddrIndexKey, int64> > vHistory;
+    if (!CTxDB("r").ReadAddrHistory(hash160, nMinHeight, nMaxHeight, vHistory))
+        throw runtime_error("Error reading address index");
+
+    Array result;
+    for (unsigned int i = 0; i < vHistory.size(); i++)
+        result.push_back(vHistory[i].first.hashTx.GetHex());
+    return result;
+}
+
+Value getaddressutxos(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 3)
+        throw runtime_error(
+            "getaddressutxos <bitokaddress> [startheight=0] [endheight]\n"
+            "Returns the confirmed unspent outputs of any address created in blocks\n"
+            "from [startheight] to [endheight] inclusive, in block height order.\n"
+            "Requires -addrindex.");
+
+    uint160 hash160 = ParseIndexedAddress(params[0].get_str());
+    int nMinHeight, nMaxHeight;
+    ParseHeightRange(params, nMinHeight, nMaxHeight);
+
+    // Read the index and the tip together so confirmations agree with it
+    vector<CAddrUnspent> vUnspent;
+    int nTipHeight = 0;
+    CRITICAL_BLOCK(cs_main)
+    {
+        if (!CTxDB("r").ReadAddrUnspent(hash160, nMinHeight, nMaxHeight, vUnspent))
+            throw runtime_error("Error reading address index");
+        nTipHeight = nBestHeight;
+    }
+
+    Array result;
+    foreach(const CAddrUnspent& unspent, vUnspent)
+    {
+        Object entry;
+        entry.push_back(Pair("txid", unspent.key.hashTx.GetHex()));
+        entry.push_back(Pair("vout", (int)unspent.n));
+        entry.push_back(Pair("amount", (double)unspent.nValue / (double)COIN));
+        entry.push_back(Pair("height", unspent.key.nHeight));
+        entry.push_back(Pair("confirmations", nTipHeight - unspent.key.nHeight + 1));
+        result.push_back(entry);
+    }
+    return result;
+}
 
 
 
@@ -1463,107 +1698,297 @@ Value listreceivedbylabel(const Array& params, bool fHelp)
 
 
 
-//
-// Call Table
-//
 
-pair<string, rpcfn_type> pCallTable[] =
-{
-    make_pair("help",                  &help),
-    make_pair("stop",                  &stop),
-    make_pair("getblockcount",         &getblockcount),
-    make_pair("getblocknumber",        &getblocknumber),
-    make_pair("getblockhash",          &getblockhash),
-    make_pair("getbestblockhash",      &getbestblockhash),
-    make_pair("getblock",              &getblock),
-    make_pair("gettransaction",        &gettransaction),
-    make_pair("getrawtransaction",     &getrawtransaction),
-    make_pair("getrawmempool",         &getrawmempool),
-    make_pair("validateaddress",       &validateaddress),
-    make_pair("getconnectioncount",    &getconnectioncount),
-    make_pair("getpeerinfo",           &getpeerinfo),
-    make_pair("getdifficulty",         &getdifficulty),
-    make_pair("getbalance",            &getbalance),
-    make_pair("getgenerate",           &getgenerate),
-    make_pair("setgenerate",           &setgenerate),
-    make_pair("getmininginfo",         &getmininginfo),
-    make_pair("getblocktemplate",      &getblocktemplate),
-    make_pair("submitblock",           &submitblock),
-    make_pair("getwork",               &getwork),
-    make_pair("getinfo",               &getinfo),
-    make_pair("getnewaddress",         &getnewaddress),
-    make_pair("setlabel",              &setlabel),
-    make_pair("getlabel",              &getlabel),
-    make_pair("getaddressesbylabel",   &getaddressesbylabel),
-    make_pair("sendtoaddress",         &sendtoaddress),
-    make_pair("listtransactions",      &listtransactions),
-    make_pair("listunspent",           &listunspent),
-    make_pair("getamountreceived",     &getreceivedbyaddress), // deprecated, renamed to getreceivedbyaddress
-    make_pair("getallreceived",        &listreceivedbyaddress), // deprecated, renamed to listreceivedbyaddress
-    make_pair("getreceivedbyaddress",  &getreceivedbyaddress),
-    make_pair("getreceivedbylabel",    &getreceivedbylabel),
-    make_pair("listreceivedbyaddress", &listreceivedbyaddress),
-    make_pair("listreceivedbylabel",   &listreceivedbylabel),
-};
-map<string, rpcfn_type> mapCallTable(pCallTable, pCallTable + sizeof(pCallTable)/sizeof(pCallTable[0]));
 
 
 
 
 //
-// HTTP protocol
-//
-// This ain't Apache.  We're just using HTTP header for the length field
-// and to be compatible with other JSON-RPC implementations.
+// Serialized results of calls whose answer can no longer change: blocks and
+// transactions buried RPC_CACHE_DEPTH deep.  Each entry remembers the
+// highest block it depends on and is dropped if a reorg forks below it.
+// Bounded by bytes, least recently used goes first.
 //
+static const int RPC_CACHE_DEPTH = 6;
 
-string EncodeBase64(const string& str);
+// Rough cost of an entry beyond its strings: map and list nodes
+static const unsigned int RPC_CACHE_ENTRY_OVERHEAD = 160;
 
-string HTTPPost(const string& strMsg)
+class CRPCResultCache
 {
-    string strUserPass = GetArg("-rpcuser", "") + ":" + GetArg("-rpcpassword", "");
-    string strAuth;
-    if (strUserPass != ":")
-        strAuth = strprintf("Authorization: Basic %s\r\n", EncodeBase64(strUserPass).c_str());
+protected:
+    struct CEntry
+    {
+        string strResult;
+        int nHeight;
+        list<string>::iterator itLRU;
+    };
+    map<string, CEntry> mapEntries;
+    list<string> listLRU;
+    uint64 nBytes;
+    uint64 nMaxBytes;
+    uint64 nHits;
+    uint64 nMisses;
+    uint64 nEvicted;
+    uint64 nInvalidated;
+    unsigned int nGeneration;
+    CCriticalSection cs;
+
+    void Erase(map<string, CEntry>::iterator mi)
+    {
+        nBytes -= (*mi).first.size() + (*mi).second.strResult.size() + RPC_CACHE_ENTRY_OVERHEAD;
+        listLRU.erase((*mi).second.itLRU);
+        mapEntries.erase(mi);
+    }
 
-    return strprintf(
-            "POST / HTTP/1.1\r\n"
-            "User-Agent: json-rpc/1.0\r\n"
-            "Host: 127.0.0.1\r\n"
-            "Content-Type: application/json\r\n"
-            "Content-Length: %d\r\n"
-            "Accept: application/json\r\n"
-            "%s"
-            "\r\n"
-            "%s",
-        strMsg.size(),
-        strAuth.c_str(),
+public:
+    CRPCResultCache()
+    {
+        nBytes = 0;
+        nMaxBytes = 16 * 1000000;
+        nHits = 0;
+        nMisses = 0;
+        nEvicted = 0;
+        nInvalidated = 0;
+        nGeneration = 0;
+    }
+
+    void SetMaxBytes(uint64 nMaxBytesIn)
+    {
+        CRITICAL_BLOCK(cs)
+            nMaxBytes = nMaxBytesIn;
+    }
+
+    unsigned int GetGeneration()
+    {
+        unsigned int n;
+        CRITICAL_BLOCK(cs)
+            n = nGeneration;
+        return n;
+    }
+
+    bool Find(const string& strKey, string& strResultRet)
+    {
+        CRITICAL_BLOCK(cs)
+        {
+            map<string, CEntry>::iterator mi = mapEntries.find(strKey);
+            if (mi == mapEntries.end())
+            {
+                nMisses++;
+                return false;
+            }
+            listLRU.splice(listLRU.begin(), listLRU, (*mi).second.itLRU);
+            strResultRet = (*mi).second.strResult;
+            nHits++;
+        }
+        return true;
+    }
+
+    // nGenerationIn is from before the result was worked out, so a result
+    // that raced with a reorg isn't kept
+    void Insert(const string& strKey, const string& strResult, int nHeight, unsigned int nGenerationIn)
+    {
+        CRITICAL_BLOCK(cs)
+        {
+            if (nGenerationIn != nGeneration || nMaxBytes == 0 || mapEntries.count(strKey))
+                return;
+            CEntry& entry = mapEntries[strKey];
+            entry.strResult = strResult;
+            entry.nHeight = nHeight;
+            entry.itLRU = listLRU.insert(listLRU.begin(), strKey);
+            nBytes += strKey.size() + strResult.size() + RPC_CACHE_ENTRY_OVERHEAD;
+
+            while (nBytes > nMaxBytes && !listLRU.empty())
+            {
+                Erase(mapEntries.find(listLRU.back()));
+                nEvicted++;
+            }
+        }
+    }
+
+    // Drop everything that depends on blocks above the fork
+    void Invalidate(int nForkHeight)
+    {
+        CRITICAL_BLOCK(cs)
+        {
+            nGeneration++;
+            map<string, CEntry>::iterator mi = mapEntries.begin();
+            while (mi != mapEntries.end())
+            {
+                if ((*mi).second.nHeight > nForkHeight)
+                {
+                    Erase(mi++);
+                    nInvalidated++;
+                }
+                else
+                    mi++;
+            }
+        }
+    }
+
+    Object GetStats()
+    {
+        Object obj;
+        CRITICAL_BLOCK(cs)
+        {
+            obj.push_back(Pair("entries",       (int)mapEntries.size()));
+            obj.push_back(Pair("bytes",         (boost::int64_t)nBytes));
+            obj.push_back(Pair("maxbytes",      (boost::int64_t)nMaxBytes));
+            obj.push_back(Pair("hits",          (boost::int64_t)nHits));
+            obj.push_back(Pair("misses",        (boost::int64_t)nMisses));
+            obj.push_back(Pair("evicted",       (boost::int64_t)nEvicted));
+            obj.push_back(Pair("invalidated",   (boost::int64_t)nInvalidated));
+        }
+        return obj;
+    }
+};
+
+static CRPCResultCache rpcCache;
+
+void RPCCacheInvalidate(int nForkHeight)
+{
+    rpcCache.Invalidate(nForkHeight);
+}
+
+Value getrpccacheinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getrpccacheinfo\n"
+            "Returns the size and hit counts of the RPC response cache.");
+
+    return rpcCache.GetStats();
+}
+
+
+
+
+
+
+
+
+
+
+
+
+
+//
+// Call Table
+//
+
+pair<string, rpcfn_type> pCallTable[] =
+{
+    make_pair("help",                  &help),
+    make_pair("stop",                  &stop),
+    make_pair("getblockcount",         &getblockcount),
+    make_pair("getblocknumber",        &getblocknumber),
+    make_pair("getblockhash",          &getblockhash),
+    make_pair("getbestblockhash",      &getbestblockhash),
+    make_pair("getblock",              &getblock),
+    make_pair("gettransaction",        &gettransaction),
+    make_pair("getrawtransaction",     &getrawtransaction),
+    make_pair("getrawmempool",         &getrawmempool),
+    make_pair("validateaddress",       &validateaddress),
+    make_pair("getconnectioncount",    &getconnectioncount),
+    make_pair("getpeerinfo",           &getpeerinfo),
+    make_pair("getrelaycacheinfo",     &getrelaycacheinfo),
+    make_pair("getrpccacheinfo",       &getrpccacheinfo),
+    make_pair("getdifficulty",         &getdifficulty),
+    make_pair("getbalance",            &getbalance),
+    make_pair("getgenerate",           &getgenerate),
+    make_pair("setgenerate",           &setgenerate),
+    make_pair("getmininginfo",         &getmininginfo),
+    make_pair("getblocktemplate",      &getblocktemplate),
+    make_pair("submitblock",           &submitblock),
+    make_pair("getwork",               &getwork),
+    make_pair("getinfo",               &getinfo),
+    make_pair("getnewaddress",         &getnewaddress),
+    make_pair("setlabel",              &setlabel),
+    make_pair("getlabel",              &getlabel),
+    make_pair("getaddressesbylabel",   &getaddressesbylabel),
+    make_pair("sendtoaddress",         &sendtoaddress),
+    make_pair("listtransactions",      &listtransactions),
+    make_pair("listunspent",           &listunspent),
+    make_pair("getamountreceived",     &getreceivedbyaddress), // deprecated, renamed to getreceivedbyaddress
+    make_pair("getallreceived",        &listreceivedbyaddress), // deprecated, renamed to listreceivedbyaddress
+    make_pair("getreceivedbyaddress",  &getreceivedbyaddress),
+    make_pair("getreceivedbylabel",    &getreceivedbylabel),
+    make_pair("listreceivedbyaddress", &listreceivedbyaddress),
+    make_pair("listreceivedbylabel",   &listreceivedbylabel),
+    make_pair("getaddressbalance",     &getaddressbalance),
+    make_pair("getaddresstxids",       &getaddresstxids),
+    make_pair("getaddressutxos",       &getaddressutxos),
+};
+map<string, rpcfn_type> mapCallTable(pCallTable, pCallTable + sizeof(pCallTable)/sizeof(pCallTable[0]));
+
+
+
+
+//
+// HTTP protocol
+//
+// This ain't Apache.  We're just using HTTP header for the length field
+// and to be compatible with other JSON-RPC implementations.
+//
+
+string EncodeBase64(const string& str);
+
+string HTTPPost(const string& strMsg)
+{
+    string strUserPass = GetArg("-rpcuser", "") + ":" + GetArg("-rpcpassword", "");
+    string strAuth;
+    if (strUserPass != ":")
+        strAuth = strprintf("Authorization: Basic %s\r\n", EncodeBase64(strUserPass).c_str());
+
+    return strprintf(
+            "POST / HTTP/1.1\r\n"
+            "User-Agent: json-rpc/1.0\r\n"
+            "Host: 127.0.0.1\r\n"
+            "Content-Type: application/json\r\n"
+            "Content-Length: %d\r\n"
+            "Accept: application/json\r\n"
+            "%s"
+            "\r\n"
+            "%s",
+        strMsg.size(),
+        strAuth.c_str(),
         strMsg.c_str());
 }
 
-string HTTPReply(const string& strMsg, int nStatus=200)
+// A negative length means the body follows in chunked encoding
+string HTTPReplyHeader(int nStatus, bool fKeepAlive, int nContentLength, const char* pszContentType="application/json")
 {
     string strStatus;
     if (nStatus == 200) strStatus = "OK";
+    if (nStatus == 400) strStatus = "Bad Request";
     if (nStatus == 401) strStatus = "Unauthorized";
     if (nStatus == 403) strStatus = "Forbidden";
+    if (nStatus == 404) strStatus = "Not Found";
     if (nStatus == 500) strStatus = "Internal Server Error";
+    if (nStatus == 503) strStatus = "Service Unavailable";
 
     string strHeaders = strprintf(
             "HTTP/1.1 %d %s\r\n"
-            "Connection: close\r\n"
-            "Content-Length: %d\r\n"
-            "Content-Type: application/json\r\n"
+            "Connection: %s\r\n"
+            "%s"
+            "Content-Type: %s\r\n"
             "Date: Sat, 08 Jul 2006 12:04:08 GMT\r\n"
             "Server: json-rpc/1.0\r\n",
         nStatus,
         strStatus.c_str(),
-        strMsg.size());
+        fKeepAlive ? "keep-alive" : "close",
+        nContentLength >= 0 ? strprintf("Content-Length: %d\r\n", nContentLength).c_str() : "Transfer-Encoding: chunked\r\n",
+        pszContentType);
 
     if (nStatus == 401)
         strHeaders += "WWW-Authenticate: Basic realm=\"jsonrpc\"\r\n";
 
-    return strHeaders + "\r\n" + strMsg;
+    return strHeaders + "\r\n";
+}
+
+string HTTPReply(const string& strMsg, int nStatus=200, bool fKeepAlive=false)
+{
+    return HTTPReplyHeader(nStatus, fKeepAlive, strMsg.size()) + strMsg;
 }
 
 string EncodeBase64(const string& str)
@@ -1659,7 +2084,7 @@ bool ClientAllowed(const string& strAddr)
     return false;
 }
 
-int ReadHTTPHeader(tcp::iostream& stream, map<string, string>& mapHeadersRet)
+int ReadHTTPHeader(std::istream& stream, map<string, string>& mapHeadersRet)
 {
     int nLen = 0;
     loop
@@ -1692,6 +2117,28 @@ inline string ReadHTTP(tcp::iostream& stream, map<string, string>& mapHeadersRet
 {
     mapHeadersRet.clear();
     int nLen = ReadHTTPHeader(stream, mapHeadersRet);
+
+    // Large replies come in chunks, each with its length in hex
+    if (mapHeadersRet["Transfer-Encoding"] == "chunked")
+    {
+        string strRet;
+        loop
+        {
+            string str;
+            std::getline(stream, str);
+            int nChunk = strtol(str.c_str(), NULL, 16);
+            if (nChunk <= 0 || !stream)
+                break;
+            vector<char> vch(nChunk);
+            stream.read(&vch[0], nChunk);
+            strRet.append(vch.begin(), vch.end());
+            std::getline(stream, str);
+        }
+        string str;
+        std::getline(stream, str);
+        return strRet;
+    }
+
     if (nLen <= 0)
         return string();
 
@@ -1718,7 +2165,7 @@ string JSONRPCRequest(const string& strMethod, const Array& params, const Value&
     return write_string(Value(request), false) + "\n";
 }
 
-string JSONRPCReply(const Value& result, const Value& error, const Value& id)
+Object JSONRPCReplyObj(const Value& result, const Value& error, const Value& id)
 {
     Object reply;
     if (error.type() != null_type)
@@ -1727,148 +2174,1316 @@ string JSONRPCReply(const Value& result, const Value& error, const Value& id)
         reply.push_back(Pair("result", result));
     reply.push_back(Pair("error", error));
     reply.push_back(Pair("id", id));
-    return write_string(Value(reply), false) + "\n";
+    return reply;
 }
 
+string JSONRPCReply(const Value& result, const Value& error, const Value& id)
+{
+    return write_string(Value(JSONRPCReplyObj(result, error, id)), false) + "\n";
+}
 
-
-
-void ThreadRPCServer(void* parg)
+// JSON-RPC 2.0 replies carry either a result or an error object, never both
+Object JSONRPC2Reply(const Value& result, int nCode, const string& strMessage, const Value& id)
 {
-    IMPLEMENT_RANDOMIZE_STACK(ThreadRPCServer(parg));
-    try
+    Object reply;
+    reply.push_back(Pair("jsonrpc", "2.0"));
+    if (nCode == 0)
+        reply.push_back(Pair("result", result));
+    else
     {
-        vnThreadsRunning[4]++;
-        ThreadRPCServer2(parg);
-        vnThreadsRunning[4]--;
-    }
-    catch (std::exception& e) {
-        vnThreadsRunning[4]--;
-        PrintException(&e, "ThreadRPCServer()");
-    } catch (...) {
-        vnThreadsRunning[4]--;
-        PrintException(NULL, "ThreadRPCServer()");
+        Object error;
+        error.push_back(Pair("code", nCode));
+        error.push_back(Pair("message", strMessage));
+        reply.push_back(Pair("error", error));
     }
-    printf("ThreadRPCServer exiting\n");
+    reply.push_back(Pair("id", id));
+    return reply;
 }
 
-void ThreadRPCServer2(void* parg)
+
+
+
+//
+// Fast path for reading requests.  Handles the plain JSON that RPC clients
+// send without going through the Spirit grammar, copying each string once
+// straight out of the request buffer.  Anything unusual (escapes, odd
+// number forms, deep nesting) makes it give up so the caller can fall back
+// to json_spirit, which keeps the two in agreement.
+//
+class CRPCRequestParser
 {
-    printf("ThreadRPCServer started\n");
+protected:
+    struct CAssignReal
+    {
+        double& d;
+        CAssignReal(double& dIn) : d(dIn) { }
+        void operator()(double dIn) const { d = dIn; }
+    };
 
-    int nRPCPort = GetIntArg("-rpcport", 8332);
-    string strRPCBind = GetArg("-rpcbind", "127.0.0.1");
+    const char* p;
+    const char* pend;
+    int nDepth;
 
-    boost::asio::ip::address bindAddress;
-    try
+    void SkipSpace()
     {
-#if BOOST_VERSION >= 106600
-        bindAddress = boost::asio::ip::make_address(strRPCBind);
-#else
-        bindAddress = boost::asio::ip::address::from_string(strRPCBind);
-#endif
+        while (p < pend && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+            p++;
     }
-    catch (...)
+
+    bool ParseString(string& strRet)
     {
-        printf("Invalid -rpcbind address: %s, using 127.0.0.1\n", strRPCBind.c_str());
-        bindAddress = boost::asio::ip::address_v4::loopback();
+        if (p >= pend || *p != '"')
+            return false;
+        const char* pbegin = ++p;
+        while (p < pend && *p != '"')
+        {
+            if (*p == '\\' || (unsigned char)*p < 0x20)
+                return false;
+            p++;
+        }
+        if (p >= pend)
+            return false;
+        strRet.assign(pbegin, p++);
+        return true;
     }
 
-    printf("RPC server binding to %s:%d\n", bindAddress.to_string().c_str(), nRPCPort);
-
-#if BOOST_VERSION >= 106600
-    boost::asio::io_context io_service;
-#else
-    boost::asio::io_service io_service;
-#endif
-    tcp::endpoint endpoint(bindAddress, nRPCPort);
-    tcp::acceptor acceptor(io_service, endpoint);
-
-    loop
+    bool ParseNumber(Value& valRet)
     {
-        tcp::iostream stream;
-        tcp::endpoint peer;
-        vnThreadsRunning[4]--;
-#if BOOST_VERSION >= 106600
-        acceptor.accept(stream.rdbuf()->socket(), peer);
-#else
-        acceptor.accept(*stream.rdbuf(), peer);
-#endif
-        vnThreadsRunning[4]++;
-        if (fShutdown)
-            return;
-
-        string strPeerAddr = peer.address().to_string();
-
-        if (!ClientAllowed(strPeerAddr))
+        const char* pbegin = p;
+        bool fNegative = false;
+        if (p < pend && *p == '-')
         {
-            printf("RPC connection from %s denied\n", strPeerAddr.c_str());
-            stream << HTTPReply("Forbidden", 403) << std::flush;
-            continue;
+            fNegative = true;
+            p++;
         }
+        const char* pdigits = p;
+        while (p < pend && *p >= '0' && *p <= '9')
+            p++;
+        int nDigits = p - pdigits;
+        if (nDigits == 0 || (nDigits > 1 && *pdigits == '0'))
+            return false;
 
-        map<string, string> mapHeaders;
-        string strRequest = ReadHTTP(stream, mapHeaders);
+        bool fReal = false;
+        if (p < pend && *p == '.')
+        {
+            fReal = true;
+            const char* pfrac = ++p;
+            while (p < pend && *p >= '0' && *p <= '9')
+                p++;
+            if (p == pfrac)
+                return false;
+        }
+        if (p < pend && (*p == 'e' || *p == 'E'))
+        {
+            fReal = true;
+            p++;
+            if (p < pend && (*p == '+' || *p == '-'))
+                p++;
+            const char* pexp = p;
+            while (p < pend && *p >= '0' && *p <= '9')
+                p++;
+            if (p == pexp)
+                return false;
+        }
 
-        if (!HTTPAuthorized(mapHeaders["Authorization"]))
+        if (fReal)
         {
-            printf("RPC authorization failed from %s\n", strPeerAddr.c_str());
-            stream << HTTPReply("Unauthorized", 401) << std::flush;
-            continue;
+            // Use json_spirit's own real parser, which doesn't always round
+            // the same way strtod does
+            double d = 0;
+            if (!spirit_namespace::parse(pbegin, p, spirit_namespace::strict_real_p[CAssignReal(d)]).full)
+                return false;
+            valRet = d;
+            return true;
         }
 
-        if (fDebug)
-            printf("[RPC] Request from %s\n", strPeerAddr.c_str());
+        // Leave anything that might not fit in 64 bits to json_spirit
+        if (nDigits > 18)
+            return false;
+        int64 n = 0;
+        for (const char* pc = pdigits; pc < p; pc++)
+            n = n * 10 + (*pc - '0');
+        valRet = (boost::int64_t)(fNegative ? -n : n);
+        return true;
+    }
 
-        // Handle multiple invocations per request
-        string::iterator begin = strRequest.begin();
-        while (skipspaces(begin), begin != strRequest.end())
-        {
-            string::iterator prev = begin;
-            Value id;
-            try
-            {
-                // Parse request
-                Value valRequest;
-                if (!read_range(begin, strRequest.end(), valRequest))
-                    throw runtime_error("Parse error.");
-                const Object& request = valRequest.get_obj();
-                if (find_value(request, "method").type() != str_type ||
-                    find_value(request, "params").type() != array_type)
-                    throw runtime_error("Invalid request.");
-
-                string strMethod    = find_value(request, "method").get_str();
-                const Array& params = find_value(request, "params").get_array();
-                id                  = find_value(request, "id");
-
-                // Execute
-                map<string, rpcfn_type>::iterator mi = mapCallTable.find(strMethod);
-                if (mi == mapCallTable.end())
-                    throw runtime_error("Method not found.");
+    bool ParseLiteral(const char* psz, int nLen)
+    {
+        if (pend - p < nLen || memcmp(p, psz, nLen) != 0)
+            return false;
+        p += nLen;
+        return true;
+    }
 
-                int64 nStartTime = GetTimeMillis();
-                Value result = (*(*mi).second)(params, false);
-                int64 nDuration = GetTimeMillis() - nStartTime;
+public:
+    CRPCRequestParser(const char* pbegin, const char* pendIn)
+    {
+        p = pbegin;
+        pend = pendIn;
+        nDepth = 0;
+    }
 
-                if (fDebug)
-                    printf("[RPC] %s (%d params) completed in %lld ms\n", strMethod.c_str(), (int)params.size(), (long long)nDuration);
+    const char* GetPos() const
+    {
+        return p;
+    }
 
-                // Send reply
-                string strReply = JSONRPCReply(result, Value::null, id);
-                stream << HTTPReply(strReply, 200) << std::flush;
+    bool ParseValue(Value& valRet)
+    {
+        SkipSpace();
+        if (p >= pend)
+            return false;
+        switch (*p)
+        {
+        case '"':
+            // Fill in the string held by the value to save a copy
+            valRet = string();
+            return ParseString(const_cast<string&>(valRet.get_str()));
+        case '{':
+        {
+            if (++nDepth > 32)
+                return false;
+            p++;
+            valRet = Object();
+            Object& obj = valRet.get_obj();
+            SkipSpace();
+            if (p < pend && *p == '}')
+            {
+                p++;
+                nDepth--;
+                return true;
             }
-            catch (std::exception& e)
+            loop
+            {
+                SkipSpace();
+                obj.push_back(Pair("", Value()));
+                if (!ParseString(obj.back().name_))
+                    return false;
+                SkipSpace();
+                if (p >= pend || *p++ != ':')
+                    return false;
+                if (!ParseValue(obj.back().value_))
+                    return false;
+                SkipSpace();
+                if (p >= pend)
+                    return false;
+                if (*p == '}')
+                    break;
+                if (*p++ != ',')
+                    return false;
+            }
+            p++;
+            nDepth--;
+            return true;
+        }
+        case '[':
+        {
+            if (++nDepth > 32)
+                return false;
+            p++;
+            valRet = Array();
+            Array& arr = valRet.get_array();
+            SkipSpace();
+            if (p < pend && *p == ']')
+            {
+                p++;
+                nDepth--;
+                return true;
+            }
+            loop
+            {
+                arr.push_back(Value());
+                if (!ParseValue(arr.back()))
+                    return false;
+                SkipSpace();
+                if (p >= pend)
+                    return false;
+                if (*p == ']')
+                    break;
+                if (*p++ != ',')
+                    return false;
+            }
+            p++;
+            nDepth--;
+            return true;
+        }
+        case 't':
+            valRet = true;
+            return ParseLiteral("true", 4);
+        case 'f':
+            valRet = false;
+            return ParseLiteral("false", 5);
+        case 'n':
+            valRet = Value::null;
+            return ParseLiteral("null", 4);
+        default:
+            return ParseNumber(valRet);
+        }
+    }
+};
+
+// Reads one JSON value and moves begin past it, like read_range
+bool ReadRPCRequest(string::iterator& begin, string::iterator end, Value& valRet)
+{
+    if (begin != end)
+    {
+        const char* pbegin = &*begin;
+        CRPCRequestParser parser(pbegin, pbegin + (end - begin));
+        if (parser.ParseValue(valRet))
+        {
+            if (fDebug)
+            {
+                // Check the fast path against json_spirit
+                Value valCheck;
+                string::iterator it = begin;
+                if (!read_range(it, end, valCheck) || write_string(valCheck, false) != write_string(valRet, false))
+                    printf("[RPC] ReadRPCRequest() : fast parser disagrees with json_spirit\n");
+            }
+            begin += parser.GetPos() - pbegin;
+            return true;
+        }
+    }
+    return read_range(begin, end, valRet);
+}
+
+
+
+
+//
+// RPC server.  The RPC thread accepts connections and waits for requests
+// on them with asio, then hands each request to a small pool of worker
+// threads.  Connections are kept open between requests, and calls that
+// only read state run side by side while the rest go one at a time.
+//
+
+#if BOOST_VERSION >= 106600
+typedef boost::asio::io_context rpc_io_service;
+#else
+typedef boost::asio::io_service rpc_io_service;
+#endif
+
+static const int RPC_IDLE_TIMEOUT = 30;
+static const unsigned int RPC_WORK_QUEUE_MAX = 64;
+
+class CRPCConn
+{
+public:
+    tcp::socket socket;
+    boost::asio::streambuf buf;
+    boost::asio::deadline_timer timer;
+    string strPeerAddr;
+    bool fLoopback;
+    int nWait;
+    string strLine;
+    map<string, string> mapHeaders;
+    int nLen;
+
+    CRPCConn(rpc_io_service& io_service) : socket(io_service), buf(MAX_SIZE), timer(io_service)
+    {
+        fLoopback = false;
+        nWait = 0;
+        nLen = 0;
+    }
+};
+typedef boost::shared_ptr<CRPCConn> CRPCConnPtr;
+
+template<typename T>
+static void RPCWriteReply(CRPCConnPtr conn, const T& vchMsg, int nStatus, bool fKeepAlive, const char* pszContentType="application/json")
+{
+    string strHeader = HTTPReplyHeader(nStatus, fKeepAlive, vchMsg.size(), pszContentType);
+    vector<boost::asio::const_buffer> vBuffers;
+    vBuffers.push_back(boost::asio::buffer(strHeader));
+    if (!vchMsg.empty())
+        vBuffers.push_back(boost::asio::buffer(&vchMsg[0], vchMsg.size()));
+    boost::asio::write(conn->socket, vBuffers);
+}
+
+//
+// Writes a reply whose result is an array straight to the connection as
+// the handler produces it.  Elements are serialized one at a time, and
+// once the output passes FLUSH_SIZE it goes out in chunked encoding, so
+// the whole reply never has to sit in memory.
+//
+class CJSONArrayWriter
+{
+protected:
+    CRPCConnPtr conn;
+    bool fKeepAlive;
+    bool fChunked;
+    string strBuf;
+    unsigned int nCount;
+
+public:
+    enum { FLUSH_SIZE = 64 * 1024 };
+
+    CJSONArrayWriter(CRPCConnPtr connIn, bool fKeepAliveIn, const string& strPrefix) : conn(connIn), strBuf(strPrefix)
+    {
+        fKeepAlive = fKeepAliveIn;
+        fChunked = false;
+        nCount = 0;
+        strBuf.reserve(FLUSH_SIZE + 4096);
+    }
+
+    void push_back(const Value& value)
+    {
+        if (nCount++ > 0)
+            strBuf += ',';
+        strBuf += write_string(value, false);
+        if (strBuf.size() >= FLUSH_SIZE)
+            Flush();
+    }
+
+    unsigned int size() const
+    {
+        return nCount;
+    }
+
+    bool IsStarted() const
+    {
+        return fChunked;
+    }
+
+    void Flush()
+    {
+        if (!fChunked)
+        {
+            boost::asio::write(conn->socket, boost::asio::buffer(HTTPReplyHeader(200, fKeepAlive, -1)));
+            fChunked = true;
+        }
+        string strSize = strprintf("%x\r\n", (unsigned int)strBuf.size());
+        vector<boost::asio::const_buffer> vBuffers;
+        vBuffers.push_back(boost::asio::buffer(strSize));
+        vBuffers.push_back(boost::asio::buffer(strBuf));
+        vBuffers.push_back(boost::asio::buffer("\r\n", 2));
+        boost::asio::write(conn->socket, vBuffers);
+        strBuf.clear();
+    }
+
+    void Finish(const string& strSuffix)
+    {
+        strBuf += strSuffix;
+        if (!fChunked)
+        {
+            // Small enough to go out in one piece
+            RPCWriteReply(conn, strBuf, 200, fKeepAlive);
+            return;
+        }
+        Flush();
+        boost::asio::write(conn->socket, boost::asio::buffer("0\r\n\r\n", 5));
+    }
+};
+
+typedef void(*rpcstreamfn_type)(const Array& params, bool fHelp, CJSONArrayWriter& ret);
+
+// Calls with potentially large array results that can be streamed
+pair<string, rpcstreamfn_type> pStreamCallTable[] =
+{
+    make_pair("getrawmempool",         &GetRawMempool<CJSONArrayWriter>),
+    make_pair("listtransactions",      &ListTransactions<CJSONArrayWriter>),
+    make_pair("listunspent",           &ListUnspent<CJSONArrayWriter>),
+};
+map<string, rpcstreamfn_type> mapStreamCallTable(pStreamCallTable, pStreamCallTable + sizeof(pStreamCallTable)/sizeof(pStreamCallTable[0]));
+
+static rpc_io_service* pRPCIOService = NULL;
+static tcp::acceptor* pRPCAcceptor = NULL;
+static deque<boost::function<void()> > dequeRPCWork;
+static CCriticalSection cs_dequeRPCWork;
+static CWaitEvent eventRPCWork;
+static int nRPCWorkers = 0;
+static int nRPCThreads = 4;
+static bool fRESTEnabled = false;
+
+// Calls that only read state and can run alongside each other
+static const char* pszRPCParallel[] =
+{
+    "help",
+    "getblockcount",
+    "getblocknumber",
+    "getblockhash",
+    "getbestblockhash",
+    "getblock",
+    "gettransaction",
+    "getrawtransaction",
+    "getrawmempool",
+    "validateaddress",
+    "getconnectioncount",
+    "getpeerinfo",
+    "getrelaycacheinfo",
+    "getrpccacheinfo",
+    "getdifficulty",
+    "getbalance",
+    "getgenerate",
+    "getmininginfo",
+    "getinfo",
+    "getlabel",
+    "getaddressesbylabel",
+    "listtransactions",
+    "listunspent",
+    "getamountreceived",
+    "getallreceived",
+    "getreceivedbyaddress",
+    "getreceivedbylabel",
+    "listreceivedbyaddress",
+    "listreceivedbylabel",
+    "getaddressbalance",
+    "getaddresstxids",
+    "getaddressutxos",
+};
+static set<string> setRPCParallel(pszRPCParallel, pszRPCParallel + ARRAYLEN(pszRPCParallel));
+static CCriticalSection cs_RPCSerial;
+
+static void RPCWaitRequest(CRPCConnPtr conn);
+static void RPCServeRequest(CRPCConnPtr conn);
+
+static void RPCHandleTimeout(CRPCConnPtr conn, int nWait, const boost::system::error_code& err)
+{
+    // Close a connection that sat idle, unless a request came in since
+    if (err == boost::asio::error::operation_aborted || nWait != conn->nWait)
+        return;
+    boost::system::error_code ignored;
+    conn->socket.close(ignored);
+}
+
+static void RPCArmTimeout(CRPCConnPtr conn)
+{
+    conn->nWait++;
+    conn->timer.expires_from_now(boost::posix_time::seconds(RPC_IDLE_TIMEOUT));
+    conn->timer.async_wait(boost::bind(RPCHandleTimeout, conn, conn->nWait, boost::asio::placeholders::error));
+}
+
+static void RPCHandleBody(CRPCConnPtr conn, const boost::system::error_code& err, size_t nBytes)
+{
+    conn->nWait++;
+    boost::system::error_code ignored;
+    conn->timer.cancel(ignored);
+    if (err)
+        return;
+
+    bool fQueued = false;
+    CRITICAL_BLOCK(cs_dequeRPCWork)
+    {
+        if (dequeRPCWork.size() < RPC_WORK_QUEUE_MAX)
+        {
+            dequeRPCWork.push_back(boost::bind(RPCServeRequest, conn));
+            fQueued = true;
+        }
+    }
+    if (!fQueued)
+    {
+        printf("RPC work queue full, dropping request from %s\n", conn->strPeerAddr.c_str());
+        string strReply = HTTPReply("Work queue depth exceeded", 503);
+        boost::asio::write(conn->socket, boost::asio::buffer(strReply), ignored);
+        conn->socket.close(ignored);
+        return;
+    }
+    eventRPCWork.Set();
+}
+
+static void RPCHandleRead(CRPCConnPtr conn, const boost::system::error_code& err, size_t nBytes)
+{
+    conn->nWait++;
+    boost::system::error_code ignored;
+    conn->timer.cancel(ignored);
+    if (err)
+        return;
+
+    // Parse the header here so a worker is never tied up waiting on a
+    // slow or unauthorized client to send its body
+    std::istream stream(&conn->buf);
+    conn->strLine.clear();
+    conn->mapHeaders.clear();
+    std::getline(stream, conn->strLine);
+    conn->nLen = ReadHTTPHeader(stream, conn->mapHeaders);
+    if (conn->nLen < 0 || conn->nLen > MAX_SIZE)
+    {
+        conn->socket.close(ignored);
+        return;
+    }
+    if (conn->strLine.substr(0, 10) != "GET /rest/" && !HTTPAuthorized(conn->mapHeaders["Authorization"]))
+    {
+        printf("RPC authorization failed from %s\n", conn->strPeerAddr.c_str());
+        string strReply = HTTPReply("Unauthorized", 401);
+        boost::asio::write(conn->socket, boost::asio::buffer(strReply), ignored);
+        conn->socket.close(ignored);
+        return;
+    }
+
+    // Whatever of the body isn't buffered yet is read under the idle timer
+    if ((int)conn->buf.size() < conn->nLen)
+    {
+        RPCArmTimeout(conn);
+        boost::asio::async_read(conn->socket, conn->buf, boost::asio::transfer_exactly(conn->nLen - conn->buf.size()),
+            boost::bind(RPCHandleBody, conn, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+        return;
+    }
+    RPCHandleBody(conn, boost::system::error_code(), 0);
+}
+
+static void RPCWaitRequest(CRPCConnPtr conn)
+{
+    RPCArmTimeout(conn);
+    boost::asio::async_read_until(conn->socket, conn->buf, "\r\n\r\n",
+        boost::bind(RPCHandleRead, conn, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+}
+
+static void RPCAcceptNext();
+
+static void RPCHandleAccept(CRPCConnPtr conn, const boost::system::error_code& err)
+{
+    if (err == boost::asio::error::operation_aborted || fShutdown)
+        return;
+    if (!err)
+    {
+        boost::system::error_code ec;
+        tcp::endpoint peer = conn->socket.remote_endpoint(ec);
+        conn->strPeerAddr = peer.address().to_string();
+        conn->fLoopback = peer.address().is_loopback();
+        if (ec || !ClientAllowed(conn->strPeerAddr))
+        {
+            printf("RPC connection from %s denied\n", conn->strPeerAddr.c_str());
+            string strReply = HTTPReply("Forbidden", 403);
+            boost::asio::write(conn->socket, boost::asio::buffer(strReply), ec);
+            conn->socket.close(ec);
+        }
+        else
+        {
+            RPCWaitRequest(conn);
+        }
+    }
+    RPCAcceptNext();
+}
+
+static void RPCAcceptNext()
+{
+    CRPCConnPtr conn(new CRPCConn(*pRPCIOService));
+    pRPCAcceptor->async_accept(conn->socket, boost::bind(RPCHandleAccept, conn, boost::asio::placeholders::error));
+}
+
+static void RPCCheckShutdown(boost::asio::deadline_timer* ptimer, const boost::system::error_code& err)
+{
+    if (fShutdown)
+    {
+        pRPCIOService->stop();
+        eventRPCWork.Set();
+        return;
+    }
+    ptimer->expires_from_now(boost::posix_time::seconds(1));
+    ptimer->async_wait(boost::bind(RPCCheckShutdown, ptimer, boost::asio::placeholders::error));
+}
+
+static Value RPCExecute(const string& strMethod, const Array& params)
+{
+    map<string, rpcfn_type>::iterator mi = mapCallTable.find(strMethod);
+    if (mi == mapCallTable.end())
+        throw runtime_error("Method not found.");
+
+    int64 nStartTime = GetTimeMillis();
+    Value result;
+    if (setRPCParallel.count(strMethod))
+        result = (*(*mi).second)(params, false);
+    else
+        CRITICAL_BLOCK(cs_RPCSerial)
+            result = (*(*mi).second)(params, false);
+    int64 nDuration = GetTimeMillis() - nStartTime;
+
+    if (fDebug)
+        printf("[RPC] %s (%d params) completed in %lld ms\n", strMethod.c_str(), (int)params.size(), (long long)nDuration);
+    return result;
+}
+
+// Runs one request object.  Returns false for a JSON-RPC 2.0 notification
+// inside a batch, which gets no reply.
+static bool RPCExecOne(const Value& valRequest, bool fBatch, Object& replyRet, bool& fErrorRet)
+{
+    Value id;
+    bool fVersion2 = false;
+    bool fHasId = false;
+    int nCode = -32600;
+    fErrorRet = true;
+    try
+    {
+        if (valRequest.type() != obj_type)
+            throw runtime_error("Invalid request.");
+        const Object& request = valRequest.get_obj();
+        foreach(const Pair& pair, request)
+            if (pair.name_ == "id")
+                fHasId = true;
+        id = find_value(request, "id");
+        const Value& version = find_value(request, "jsonrpc");
+        fVersion2 = (version.type() == str_type && version.get_str() == "2.0");
+
+        Value params = find_value(request, "params");
+        if (fVersion2 && params.type() == null_type)
+            params = Array();
+        if (find_value(request, "method").type() != str_type ||
+            params.type() != array_type)
+            throw runtime_error("Invalid request.");
+        string strMethod = find_value(request, "method").get_str();
+        if (!mapCallTable.count(strMethod))
+        {
+            nCode = -32601;
+            throw runtime_error("Method not found.");
+        }
+
+        nCode = -1;
+        Value result = RPCExecute(strMethod, params.get_array());
+        replyRet = (fVersion2 ? JSONRPC2Reply(result, 0, "", id) : JSONRPCReplyObj(result, Value::null, id));
+        fErrorRet = false;
+    }
+    catch (std::exception& e)
+    {
+        replyRet = (fVersion2 ? JSONRPC2Reply(Value::null, nCode, e.what(), id) : JSONRPCReplyObj(Value::null, e.what(), id));
+    }
+    return !(fBatch && fVersion2 && !fHasId);
+}
+
+//
+// Batch calls that only read state are spread over the worker pool.  The
+// worker that received the batch runs the rest in order and then helps
+// with the parallel ones, so it never waits on work nobody has picked up.
+//
+class CRPCBatch
+{
+public:
+    Array vRequest;
+    vector<Object> vReply;
+    vector<char> vHasReply;
+    vector<int> vParallel;
+    unsigned int nNext;
+    unsigned int nDone;
+    CCriticalSection cs;
+    CWaitEvent eventDone;
+
+    CRPCBatch(const Array& vRequestIn) : vRequest(vRequestIn), vReply(vRequestIn.size()), vHasReply(vRequestIn.size(), false)
+    {
+        nNext = 0;
+        nDone = 0;
+    }
+
+    void Run(unsigned int i)
+    {
+        Object reply;
+        bool fError;
+        vHasReply[i] = RPCExecOne(vRequest[i], true, reply, fError);
+        vReply[i] = reply;
+    }
+};
+typedef boost::shared_ptr<CRPCBatch> CRPCBatchPtr;
+
+static void RPCBatchDrain(CRPCBatchPtr batch)
+{
+    loop
+    {
+        int i = -1;
+        CRITICAL_BLOCK(batch->cs)
+            if (batch->nNext < batch->vParallel.size())
+                i = batch->vParallel[batch->nNext++];
+        if (i == -1)
+            break;
+        batch->Run(i);
+        CRITICAL_BLOCK(batch->cs)
+            batch->nDone++;
+        batch->eventDone.Set();
+    }
+}
+
+static Array RPCExecBatch(const Array& vRequest)
+{
+    CRPCBatchPtr batch(new CRPCBatch(vRequest));
+    vector<int> vSerial;
+    for (unsigned int i = 0; i < vRequest.size(); i++)
+    {
+        const Value& valMethod = (vRequest[i].type() == obj_type ? find_value(vRequest[i].get_obj(), "method") : Value::null);
+        if (valMethod.type() == str_type && setRPCParallel.count(valMethod.get_str()))
+            batch->vParallel.push_back(i);
+        else
+            vSerial.push_back(i);
+    }
+
+    // Get idle workers started on the parallel calls
+    int nHelpers = min(nRPCThreads - 1, (int)batch->vParallel.size() - 1);
+    CRITICAL_BLOCK(cs_dequeRPCWork)
+        for (int i = 0; i < nHelpers && dequeRPCWork.size() < RPC_WORK_QUEUE_MAX; i++)
+            dequeRPCWork.push_back(boost::bind(RPCBatchDrain, batch));
+    if (nHelpers > 0)
+        eventRPCWork.Set();
+
+    foreach(int i, vSerial)
+        batch->Run(i);
+    RPCBatchDrain(batch);
+    loop
+    {
+        bool fDone = false;
+        CRITICAL_BLOCK(batch->cs)
+            fDone = (batch->nDone == batch->vParallel.size());
+        if (fDone)
+            break;
+        batch->eventDone.Wait(100);
+    }
+
+    Array vReply;
+    for (unsigned int i = 0; i < vRequest.size(); i++)
+        if (batch->vHasReply[i])
+            vReply.push_back(batch->vReply[i]);
+    if (fDebug)
+        printf("[RPC] Batch of %d calls, %d in parallel\n", (int)vRequest.size(), (int)batch->vParallel.size());
+    return vReply;
+}
+
+// Runs a request through its streaming handler if it has one.  Returns
+// false if the caller should run it the normal way.
+static bool RPCExecStream(CRPCConnPtr conn, const Value& valRequest, bool fKeepAlive)
+{
+    if (valRequest.type() != obj_type)
+        return false;
+    const Object& request = valRequest.get_obj();
+    const Value& valMethod = find_value(request, "method");
+    const Value& valParams = find_value(request, "params");
+    if (valMethod.type() != str_type || valParams.type() != array_type)
+        return false;
+    map<string, rpcstreamfn_type>::iterator mi = mapStreamCallTable.find(valMethod.get_str());
+    if (mi == mapStreamCallTable.end())
+        return false;
+
+    const Value& id = find_value(request, "id");
+    const Value& version = find_value(request, "jsonrpc");
+    bool fVersion2 = (version.type() == str_type && version.get_str() == "2.0");
+
+    // Same key order as the normal reply, with the result array left open
+    string strPrefix = (fVersion2 ? "{\"jsonrpc\":\"2.0\",\"result\":[" : "{\"result\":[");
+    string strSuffix = (fVersion2 ? "],\"id\":" : "],\"error\":null,\"id\":") + write_string(id, false) + "}\n";
+    CJSONArrayWriter writer(conn, fKeepAlive, strPrefix);
+    try
+    {
+        int64 nStartTime = GetTimeMillis();
+        if (setRPCParallel.count(valMethod.get_str()))
+            (*(*mi).second)(valParams.get_array(), false, writer);
+        else
+            CRITICAL_BLOCK(cs_RPCSerial)
+                (*(*mi).second)(valParams.get_array(), false, writer);
+        if (fDebug)
+            printf("[RPC] %s streamed %u entries in %" PRI64d " ms\n", valMethod.get_str().c_str(), writer.size(), GetTimeMillis() - nStartTime);
+    }
+    catch (std::exception& e)
+    {
+        // Once the reply has started there's no way to report an error
+        // except cutting the connection
+        if (writer.IsStarted())
+            throw;
+        Object reply = (fVersion2 ? JSONRPC2Reply(Value::null, -1, e.what(), id) : JSONRPCReplyObj(Value::null, e.what(), id));
+        RPCWriteReply(conn, write_string(Value(reply), false) + "\n", 500, fKeepAlive);
+        return true;
+    }
+    writer.Finish(strSuffix);
+    return true;
+}
+
+static bool IsHash256(const string& str)
+{
+    return (str.size() == 64 && str.find_first_not_of("0123456789abcdefABCDEF") == string::npos);
+}
+
+// If a call's answer can no longer change, returns the height of the
+// highest block it depends on
+static bool RPCCacheHeight(const string& strMethod, const Array& params, int& nHeightRet)
+{
+    if (strMethod == "getblockhash")
+    {
+        if (params.size() != 1 || params[0].type() != int_type)
+            return false;
+        int nHeight = params[0].get_int();
+        CRITICAL_BLOCK(cs_main)
+        {
+            if (nHeight < 0 || nHeight > nBestHeight - RPC_CACHE_DEPTH)
+                return false;
+            nHeightRet = nHeight;
+        }
+        return true;
+    }
+
+    if (strMethod == "getblock")
+    {
+        if (params.size() != 1 || params[0].type() != str_type || !IsHash256(params[0].get_str()))
+            return false;
+        uint256 hash(params[0].get_str());
+        CRITICAL_BLOCK(cs_main)
+        {
+            auto mi = mapBlockIndex.find(hash);
+            if (mi == mapBlockIndex.end() || !(*mi).second->IsInMainChain())
+                return false;
+            CBlockIndex* pindex = (*mi).second;
+            if (nBestHeight - pindex->nHeight < RPC_CACHE_DEPTH)
+                return false;
+            // The reply names the next block too
+            nHeightRet = pindex->nHeight + 1;
+        }
+        return true;
+    }
+
+    if (strMethod == "getrawtransaction")
+    {
+        if (params.size() < 1 || params.size() > 2 || params[0].type() != str_type || !IsHash256(params[0].get_str()))
+            return false;
+        uint256 hash(params[0].get_str());
+
+        // Only transactions in the main chain are in the tx index
+        CTxIndex txindex;
+        if (!CTxDB("r").ReadTxIndex(hash, txindex))
+            return false;
+        CRITICAL_BLOCK(cs_main)
+        {
+            int nDepth = 0;
+            for (CBlockIndex* pindex = pindexBest; pindex && nDepth < RPC_CACHE_DEPTH; pindex = pindex->pprev, nDepth++)
+                if (pindex->nFile == txindex.pos.nFile && pindex->nBlockPos == txindex.pos.nBlockPos)
+                    return false;
+            nHeightRet = nBestHeight - RPC_CACHE_DEPTH;
+        }
+        return true;
+    }
+
+    return false;
+}
+
+// Answers getblock, getblockhash and getrawtransaction for buried blocks and
+// transactions from the response cache.  Returns false if the request
+// should take the normal path.
+static bool RPCExecCached(CRPCConnPtr conn, const Value& valRequest, bool fKeepAlive)
+{
+    if (valRequest.type() != obj_type)
+        return false;
+    const Object& request = valRequest.get_obj();
+    const Value& valMethod = find_value(request, "method");
+    const Value& valParams = find_value(request, "params");
+    if (valMethod.type() != str_type || valParams.type() != array_type)
+        return false;
+    const string& strMethod = valMethod.get_str();
+    if (strMethod != "getblock" && strMethod != "getblockhash" && strMethod != "getrawtransaction")
+        return false;
+    const Array& params = valParams.get_array();
+
+    string strKey = strMethod + write_string(valParams, false);
+    string strResult;
+    if (!rpcCache.Find(strKey, strResult))
+    {
+        unsigned int nGeneration = rpcCache.GetGeneration();
+        int nHeight;
+        if (!RPCCacheHeight(strMethod, params, nHeight))
+            return false;
+        try
+        {
+            strResult = write_string(RPCExecute(strMethod, params), false);
+        }
+        catch (std::exception&)
+        {
+            return false;
+        }
+        rpcCache.Insert(strKey, strResult, nHeight, nGeneration);
+    }
+    else if (fDebug)
+        printf("[RPC] %s served from cache\n", strMethod.c_str());
+
+    // Same key order as the normal reply
+    const Value& id = find_value(request, "id");
+    const Value& version = find_value(request, "jsonrpc");
+    bool fVersion2 = (version.type() == str_type && version.get_str() == "2.0");
+    string strReply = (fVersion2 ? "{\"jsonrpc\":\"2.0\",\"result\":" : "{\"result\":") + strResult +
+                      (fVersion2 ? ",\"id\":" : ",\"error\":null,\"id\":") + write_string(id, false) + "}\n";
+    RPCWriteReply(conn, strReply, 200, fKeepAlive);
+    return true;
+}
+
+static void RPCServeJSON(CRPCConnPtr conn, string& strRequest, bool fKeepAlive, bool fHTTP11)
+{
+    if (fDebug)
+        printf("[RPC] Request from %s\n", conn->strPeerAddr.c_str());
+
+    string::iterator begin = strRequest.begin();
+    skipspaces(begin);
+    if (begin != strRequest.end() && *begin == '[')
+    {
+        // Batch, one array in and one array out
+        Value valRequest;
+        Value valReply;
+        if (!ReadRPCRequest(begin, strRequest.end(), valRequest) || valRequest.type() != array_type)
+            valReply = JSONRPC2Reply(Value::null, -32700, "Parse error.", Value::null);
+        else if (valRequest.get_array().empty())
+            valReply = JSONRPC2Reply(Value::null, -32600, "Invalid request.", Value::null);
+        else
+            valReply = RPCExecBatch(valRequest.get_array());
+
+        // A batch of only notifications gets an empty body
+        string strReply;
+        if (valReply.type() != array_type || !valReply.get_array().empty())
+            strReply = write_string(valReply, false) + "\n";
+        RPCWriteReply(conn, strReply, 200, fKeepAlive);
+    }
+    else
+    {
+        // Handle multiple invocations per request
+        while (skipspaces(begin), begin != strRequest.end())
+        {
+            string::iterator prev = begin;
+            Value valRequest;
+            Object reply;
+            bool fError = true;
+            bool fParsed = ReadRPCRequest(begin, strRequest.end(), valRequest);
+
+            // Large array results are streamed to HTTP/1.1 clients, buried
+            // blocks and transactions come from the cache
+            if (fParsed && ((fHTTP11 && RPCExecStream(conn, valRequest, fKeepAlive)) || RPCExecCached(conn, valRequest, fKeepAlive)))
             {
-                // Send error reply
-                string strReply = JSONRPCReply(Value::null, e.what(), id);
-                stream << HTTPReply(strReply, 500) << std::flush;
+                if (begin == prev)
+                    break;
+                continue;
             }
+
+            if (!fParsed)
+                reply = JSONRPCReplyObj(Value::null, "Parse error.", Value::null);
+            else
+                RPCExecOne(valRequest, false, reply, fError);
+
+            // Send reply
+            RPCWriteReply(conn, write_string(Value(reply), false) + "\n", fError ? 500 : 200, fKeepAlive);
             if (begin == prev)
                 break;
         }
     }
 }
 
+// Reads a block's serialization straight out of the block file
+static bool ReadRawBlock(unsigned int nFile, unsigned int nBlockPos, vector<char>& vchRet)
+{
+    if (nBlockPos < 8)
+        return false;
+    CAutoFile filein = OpenBlockFile(nFile, nBlockPos - 8, "rb");
+    if (!filein)
+        return false;
+    char pchMessage[4];
+    unsigned int nSize;
+    filein >> FLATDATA(pchMessage) >> nSize;
+    if (memcmp(pchMessage, pchMessageStart, sizeof(pchMessage)) != 0 || nSize > MAX_BLOCK_SIZE)
+        return error("ReadRawBlock() : bad block header at %u:%u", nFile, nBlockPos);
+    vchRet.resize(nSize);
+    return (nSize == 0 || fread(&vchRet[0], 1, nSize, filein) == nSize);
+}
+
+//
+// REST interface, plain HTTP GETs for chain data:
+//   /rest/block/<hash>.<bin|hex|json>
+//   /rest/tx/<txid>.<bin|hex|json>
+//   /rest/headers/<count>/<hash>.<bin|hex|json>
+// Blocks are sent as they sit in the block file without being parsed.
+//
+static void RPCServeREST(CRPCConnPtr conn, const string& strPath, bool fKeepAlive)
+{
+    string strURI = strPath.substr(6);
+    string strFormat = "json";
+    string::size_type nDot = strURI.rfind('.');
+    if (nDot != string::npos)
+    {
+        strFormat = strURI.substr(nDot + 1);
+        strURI.erase(nDot);
+    }
+    vector<string> vParts;
+    boost::algorithm::split(vParts, strURI, boost::algorithm::is_any_of("/"));
+
+    if (fDebug)
+        printf("[REST] %s from %s\n", strPath.c_str(), conn->strPeerAddr.c_str());
+
+    if (strFormat != "bin" && strFormat != "hex" && strFormat != "json")
+    {
+        RPCWriteReply(conn, string("Unknown format, use .bin, .hex or .json\n"), 400, fKeepAlive, "text/plain");
+        return;
+    }
+
+    vector<char> vchData;
+    Value valData;
+    try
+    {
+        if (vParts.size() == 2 && vParts[0] == "block" && IsHash256(vParts[1]))
+        {
+            uint256 hash(vParts[1]);
+            if (strFormat == "json")
+            {
+                Array params;
+                params.push_back(vParts[1]);
+                valData = getblock(params, false);
+            }
+            else
+            {
+                bool fFound = false;
+                unsigned int nFile = 0, nBlockPos = 0;
+                CRITICAL_BLOCK(cs_main)
+                {
+                    auto mi = mapBlockIndex.find(hash);
+                    if (mi != mapBlockIndex.end())
+                    {
+                        fFound = true;
+                        nFile = (*mi).second->nFile;
+                        nBlockPos = (*mi).second->nBlockPos;
+                    }
+                }
+                if (!fFound)
+                    throw runtime_error("Block not found");
+                if (!ReadRawBlock(nFile, nBlockPos, vchData))
+                    throw runtime_error("Block read failed");
+            }
+        }
+        else if (vParts.size() == 2 && vParts[0] == "tx" && IsHash256(vParts[1]))
+        {
+            if (strFormat == "json")
+            {
+                Array params;
+                params.push_back(vParts[1]);
+                params.push_back(1);
+                valData = getrawtransaction(params, false);
+            }
+            else
+            {
+                uint256 hash(vParts[1]);
+                CTransaction tx;
+                CRITICAL_BLOCK(cs_mapTransactions)
+                {
+                    if (mapTransactions.count(hash))
+                        tx = mapTransactions[hash];
+                }
+                CTxIndex txindex;
+                if (tx.IsNull() && !CTxDB("r").ReadDiskTx(hash, tx, txindex))
+                    throw runtime_error("No information available about transaction");
+                CPublicDataStream ssTx;
+                ssTx << tx;
+                vchData.assign(ssTx.begin(), ssTx.end());
+            }
+        }
+        else if (vParts.size() == 3 && vParts[0] == "headers" && IsHash256(vParts[2]))
+        {
+            int nCount = atoi(vParts[1]);
+            if (nCount < 1 || nCount > (int)MAX_HEADERS_RESULTS)
+            {
+                RPCWriteReply(conn, strprintf("Header count must be 1 to %d\n", MAX_HEADERS_RESULTS), 400, fKeepAlive, "text/plain");
+                return;
+            }
+
+            // Follow the main chain forward from the given block
+            CPublicDataStream ss(SER_NETWORK | SER_BLOCKHEADERONLY);
+            Array headers;
+            CRITICAL_BLOCK(cs_main)
+            {
+                auto mi = mapBlockIndex.find(uint256(vParts[2]));
+                if (mi == mapBlockIndex.end())
+                    throw runtime_error("Block not found");
+                for (CBlockIndex* pindex = (*mi).second; pindex && nCount-- > 0; pindex = pindex->pnext)
+                {
+                    CBlock block = pindex->GetBlockHeader();
+                    if (strFormat != "json")
+                    {
+                        ss << block;
+                        continue;
+                    }
+                    Object entry;
+                    entry.push_back(Pair("hash", pindex->GetBlockHash().ToString()));
+                    entry.push_back(Pair("version", block.nVersion));
+                    entry.push_back(Pair("previousblockhash", block.hashPrevBlock.ToString()));
+                    entry.push_back(Pair("merkleroot", block.hashMerkleRoot.ToString()));
+                    entry.push_back(Pair("time", (boost::int64_t)block.nTime));
+                    entry.push_back(Pair("bits", (boost::int64_t)block.nBits));
+                    entry.push_back(Pair("nonce", (boost::int64_t)block.nNonce));
+                    entry.push_back(Pair("height", pindex->nHeight));
+                    headers.push_back(entry);
+                }
+            }
+            valData = headers;
+            vchData.assign(ss.begin(), ss.end());
+        }
+        else
+        {
+            RPCWriteReply(conn, string("Unknown REST request\n"), 400, fKeepAlive, "text/plain");
+            return;
+        }
+    }
+    catch (std::exception& e)
+    {
+        RPCWriteReply(conn, string(e.what()) + "\n", 404, fKeepAlive, "text/plain");
+        return;
+    }
+
+    if (strFormat == "bin")
+        RPCWriteReply(conn, vchData, 200, fKeepAlive, "application/octet-stream");
+    else if (strFormat == "hex")
+        RPCWriteReply(conn, HexStr(vchData.begin(), vchData.end()) + "\n", 200, fKeepAlive, "text/plain");
+    else
+        RPCWriteReply(conn, write_string(valData, false) + "\n", 200, fKeepAlive);
+}
+
+static void RPCServeRequest(CRPCConnPtr conn)
+{
+    // The header was parsed and the whole body buffered on the RPC thread
+    const string& strLine = conn->strLine;
+    map<string, string>& mapHeaders = conn->mapHeaders;
+    int nLen = conn->nLen;
+    std::istream stream(&conn->buf);
+    string strRequest(nLen, '\0');
+    if (nLen > 0)
+        stream.read(&strRequest[0], nLen);
+
+    // HTTP/1.1 keeps the connection unless told otherwise, 1.0 only if asked
+    string strConnection;
+    for (map<string, string>::iterator mi = mapHeaders.begin(); mi != mapHeaders.end(); ++mi)
+        if (boost::algorithm::iequals((*mi).first, "Connection"))
+            strConnection = (*mi).second;
+    bool fKeepAlive;
+    bool fHTTP11 = (strLine.find("HTTP/1.1") != string::npos);
+    if (fHTTP11)
+        fKeepAlive = !boost::algorithm::iequals(strConnection, "close");
+    else
+        fKeepAlive = boost::algorithm::iequals(strConnection, "keep-alive");
+
+    // REST requests carry no credentials, so they are only answered when
+    // turned on with -rest and only to clients on this machine
+    if (strLine.substr(0, 10) == "GET /rest/")
+    {
+        if (!fRESTEnabled || !conn->fLoopback)
+        {
+            printf("REST request from %s denied\n", conn->strPeerAddr.c_str());
+            boost::asio::write(conn->socket, boost::asio::buffer(HTTPReply("Forbidden", 403)));
+            return;
+        }
+        string::size_type nEnd = strLine.find(' ', 4);
+        RPCServeREST(conn, strLine.substr(4, nEnd == string::npos ? string::npos : nEnd - 4), fKeepAlive);
+    }
+    else
+    {
+        RPCServeJSON(conn, strRequest, fKeepAlive, fHTTP11);
+    }
+
+    // Go back to waiting for the next request on the RPC thread
+    if (fKeepAlive && !fShutdown)
+    {
+#if BOOST_VERSION >= 106600
+        boost::asio::post(*pRPCIOService, boost::bind(RPCWaitRequest, conn));
+#else
+        pRPCIOService->post(boost::bind(RPCWaitRequest, conn));
+#endif
+    }
+}
+
+void ThreadRPCWorker(void* parg)
+{
+    printf("ThreadRPCWorker started\n");
+    CRITICAL_BLOCK(cs_dequeRPCWork)
+        nRPCWorkers++;
+    while (!fShutdown)
+    {
+        boost::function<void()> work;
+        bool fMore = false;
+        CRITICAL_BLOCK(cs_dequeRPCWork)
+        {
+            if (!dequeRPCWork.empty())
+            {
+                work = dequeRPCWork.front();
+                dequeRPCWork.pop_front();
+                fMore = !dequeRPCWork.empty();
+                vnThreadsRunning[4]++;
+            }
+        }
+        if (!work)
+        {
+            eventRPCWork.Wait(1000);
+            continue;
+        }
+
+        // Wake another worker if there's more waiting
+        if (fMore)
+            eventRPCWork.Set();
+
+        try
+        {
+            work();
+        }
+        catch (std::exception& e) {
+            PrintException(&e, "ThreadRPCWorker()");
+        } catch (...) {
+            PrintException(NULL, "ThreadRPCWorker()");
+        }
+        CRITICAL_BLOCK(cs_dequeRPCWork)
+            vnThreadsRunning[4]--;
+    }
+    CRITICAL_BLOCK(cs_dequeRPCWork)
+        nRPCWorkers--;
+    printf("ThreadRPCWorker exiting\n");
+}
+
+void ThreadRPCServer(void* parg)
+{
+    IMPLEMENT_RANDOMIZE_STACK(ThreadRPCServer(parg));
+    try
+    {
+        vnThreadsRunning[4]++;
+        ThreadRPCServer2(parg);
+        vnThreadsRunning[4]--;
+    }
+    catch (std::exception& e) {
+        vnThreadsRunning[4]--;
+        PrintException(&e, "ThreadRPCServer()");
+    } catch (...) {
+        vnThreadsRunning[4]--;
+        PrintException(NULL, "ThreadRPCServer()");
+    }
+    printf("ThreadRPCServer exiting\n");
+}
+
+void ThreadRPCServer2(void* parg)
+{
+    printf("ThreadRPCServer started\n");
+
+    int nRPCPort = GetIntArg("-rpcport", 8332);
+    string strRPCBind = GetArg("-rpcbind", "127.0.0.1");
+
+    boost::asio::ip::address bindAddress;
+    try
+    {
+#if BOOST_VERSION >= 106600
+        bindAddress = boost::asio::ip::make_address(strRPCBind);
+#else
+        bindAddress = boost::asio::ip::address::from_string(strRPCBind);
+#endif
+    }
+    catch (...)
+    {
+        printf("Invalid -rpcbind address: %s, using 127.0.0.1\n", strRPCBind.c_str());
+        bindAddress = boost::asio::ip::address_v4::loopback();
+    }
+
+    printf("RPC server binding to %s:%d\n", bindAddress.to_string().c_str(), nRPCPort);
+
+    rpc_io_service io_service;
+    tcp::endpoint endpoint(bindAddress, nRPCPort);
+    tcp::acceptor acceptor(io_service, endpoint);
+    pRPCIOService = &io_service;
+    pRPCAcceptor = &acceptor;
+
+    nRPCThreads = (int)max((int64)1, GetIntArg("-rpcthreads", 4));
+    rpcCache.SetMaxBytes(max((int64)0, GetIntArg("-rpccachesize", 16)) * 1000000);
+    fRESTEnabled = GetBoolArg("-rest");
+    for (int i = 0; i < nRPCThreads; i++)
+        if (!CreateThread(ThreadRPCWorker, NULL))
+            printf("Error: CreateThread(ThreadRPCWorker) failed\n");
+
+    RPCAcceptNext();
+    boost::asio::deadline_timer timerShutdown(io_service);
+    RPCCheckShutdown(&timerShutdown, boost::system::error_code());
+
+    vnThreadsRunning[4]--;
+    io_service.run();
+
+    // Let the workers finish before the sockets they hold go away
+    while (nRPCWorkers > 0)
+        Sleep(20);
+    CRITICAL_BLOCK(cs_dequeRPCWork)
+        dequeRPCWork.clear();
+    vnThreadsRunning[4]++;
+}
+
 
 
 
@@ -1972,6 +3587,7 @@ int CommandLineRPC(int argc, char *argv[])
             if (strMethod == "sendtoaddress"          && n > 1) ConvertTo<double>(params[1]);
             if (strMethod == "listtransactions"       && n > 0) ConvertTo<boost::int64_t>(params[0]);
             if (strMethod == "listtransactions"       && n > 1) ConvertTo<bool>(params[1]);
+            if (strMethod == "listtransactions"       && n > 2) ConvertTo<boost::int64_t>(params[2]);
             if (strMethod == "listunspent"            && n > 0) ConvertTo<boost::int64_t>(params[0]);
             if (strMethod == "listunspent"            && n > 1) ConvertTo<boost::int64_t>(params[1]);
             if (strMethod == "getamountreceived"      && n > 1) ConvertTo<boost::int64_t>(params[1]); // deprecated
@@ -1983,6 +3599,10 @@ int CommandLineRPC(int argc, char *argv[])
             if (strMethod == "listreceivedbyaddress"  && n > 1) ConvertTo<bool>(params[1]);
             if (strMethod == "listreceivedbylabel"    && n > 0) ConvertTo<boost::int64_t>(params[0]);
             if (strMethod == "listreceivedbylabel"    && n > 1) ConvertTo<bool>(params[1]);
+            if (strMethod == "getaddresstxids"        && n > 1) ConvertTo<boost::int64_t>(params[1]);
+            if (strMethod == "getaddresstxids"        && n > 2) ConvertTo<boost::int64_t>(params[2]);
+            if (strMethod == "getaddressutxos"        && n > 1) ConvertTo<boost::int64_t>(params[1]);
+            if (strMethod == "getaddressutxos"        && n > 2) ConvertTo<boost::int64_t>(params[2]);
 
             // Execute
             result = CallRPC(strMethod, params);
@@ -871,7 +871,7 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
     }
 
     // Serialize and hash
-    CDataStream ss(SER_GETHASH);
+    CPublicDataStream ss(SER_GETHASH);
     ss.reserve(10000);
     ss << txTmp << nHashType;
     return Hash(ss.begin(), ss.end());
@@ -1086,6 +1086,32 @@ bool ExtractHash160(const CScript& scriptPubKey, uint160& hash160Ret)
 }
 
 
+// Same as ExtractHash160, but also gives the address of a pay-to-pubkey output
+bool ExtractAddressHash160(const CScript& scriptPubKey, uint160& hash160Ret)
+{
+    hash160Ret = 0;
+
+    vector<pair<opcodetype, valtype> > vSolution;
+    if (!Solver(scriptPubKey, vSolution))
+        return false;
+
+    foreach(PAIRTYPE(opcodetype, valtype)& item, vSolution)
+    {
+        if (item.first == OP_PUBKEYHASH)
+        {
+            hash160Ret = uint160(item.second);
+            return true;
+        }
+        if (item.first == OP_PUBKEY)
+        {
+            hash160Ret = Hash160(item.second);
+            return true;
+        }
+    }
+    return false;
+}
+
+
 bool SignSignature(const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType, CScript scriptPrereq)
 {
     assert(nIn < txTo.vin.size());
@@ -605,7 +605,7 @@ bool CMainFrame::InsertTransaction(const CWalletTx& wtx, bool fNew, int nIndex)
 {
     int64 nTime = wtx.nTimeDisplayed = wtx.GetTxTime();
     int64 nCredit = wtx.GetCredit(true);
-    int64 nDebit = wtx.GetDebit();
+    int64 nDebit = wtx.GetDebit(true);
     int64 nNet = nCredit - nDebit;
     uint256 hash = wtx.GetHash();
     string strStatus = FormatTxStatus(wtx);
@@ -2231,12 +2231,12 @@ void CSendingDialog::StartTransfer()
     pnode->PushRequest("checkorder", wtx, SendingDialogOnReply2, this);
 }
 
-void SendingDialogOnReply2(void* parg, CDataStream& vRecv)
+void SendingDialogOnReply2(void* parg, CPublicDataStream& vRecv)
 {
     ((CSendingDialog*)parg)->OnReply2(vRecv);
 }
 
-void CSendingDialog::OnReply2(CDataStream& vRecv)
+void CSendingDialog::OnReply2(CPublicDataStream& vRecv)
 {
     if (!Status(_STR("Received public key...")))
         return;
@@ -2339,12 +2339,12 @@ void CSendingDialog::OnReply2(CDataStream& vRecv)
     }
 }
 
-void SendingDialogOnReply3(void* parg, CDataStream& vRecv)
+void SendingDialogOnReply3(void* parg, CPublicDataStream& vRecv)
 {
     ((CSendingDialog*)parg)->OnReply3(vRecv);
 }
 
-void CSendingDialog::OnReply3(CDataStream& vRecv)
+void CSendingDialog::OnReply3(CPublicDataStream& vRecv)
 {
     int nRet;
     try
@@ -268,13 +268,13 @@ public:
     bool Status(const string& str);
     bool Error(const string& str);
     void StartTransfer();
-    void OnReply2(CDataStream& vRecv);
-    void OnReply3(CDataStream& vRecv);
+    void OnReply2(CPublicDataStream& vRecv);
+    void OnReply3(CPublicDataStream& vRecv);
 };
 
 void SendingDialogStartTransfer(void* parg);
-void SendingDialogOnReply2(void* parg, CDataStream& vRecv);
-void SendingDialogOnReply3(void* parg, CDataStream& vRecv);
+void SendingDialogOnReply2(void* parg, CPublicDataStream& vRecv);
+void SendingDialogOnReply3(void* parg, CPublicDataStream& vRecv);
 
 
 
@@ -817,3 +817,91 @@ void AddTimeData(unsigned int ip, int64 nTime)
         printf("|  nTimeOffset = %+" PRI64d "  (%+" PRI64d " minutes)\n", nTimeOffset, nTimeOffset/60);
     }
 }
+
+
+
+
+
+
+
+
+
+CRollingBloomFilter::CRollingBloomFilter(unsigned int nElements, double dFPRate)
+{
+    // Three generations of nElements/2 entries, two bits per slot hold the
+    // generation an entry was added in
+    double dLogFPRate = log(dFPRate);
+    nHashFuncs = max(1, min((int)floor(dLogFPRate / log(0.5) + 0.5), 50));
+    nEntriesPerGeneration = (nElements + 1) / 2;
+    unsigned int nMaxElements = nEntriesPerGeneration * 3;
+    unsigned int nFilterBits = (unsigned int)ceil(-1.0 * nHashFuncs * nMaxElements / log(1.0 - exp(dLogFPRate / nHashFuncs)));
+    vData.resize(((nFilterBits + 63) / 64) << 1);
+    reset();
+}
+
+unsigned int CRollingBloomFilter::HashN(int n, const uint256& hash) const
+{
+    // The input is already a hash, mix one word of it with the secret tweak
+    uint64 x;
+    memcpy(&x, (const char*)&hash + 8 * (n & 3), sizeof(x));
+    x ^= ((uint64)nTweak << 32) ^ (n * 0x9E3779B97F4A7C15ULL);
+    x ^= x >> 33;
+    x *= 0xFF51AFD7ED558CCDULL;
+    x ^= x >> 33;
+    x *= 0xC4CEB9FE1A85EC53ULL;
+    x ^= x >> 33;
+    return (unsigned int)x;
+}
+
+void CRollingBloomFilter::insert(const uint256& hash)
+{
+    if (nEntriesThisGeneration == nEntriesPerGeneration)
+    {
+        nEntriesThisGeneration = 0;
+        nGeneration++;
+        if (nGeneration == 4)
+            nGeneration = 1;
+
+        // Wipe the entries of the generation we're about to reuse
+        uint64 nMask1 = 0 - (uint64)(nGeneration & 1);
+        uint64 nMask2 = 0 - (uint64)(nGeneration >> 1);
+        for (unsigned int i = 0; i < vData.size(); i += 2)
+        {
+            uint64 p1 = vData[i], p2 = vData[i + 1];
+            uint64 nMask = (p1 ^ nMask1) | (p2 ^ nMask2);
+            vData[i] = p1 & nMask;
+            vData[i + 1] = p2 & nMask;
+        }
+    }
+    nEntriesThisGeneration++;
+
+    for (int n = 0; n < nHashFuncs; n++)
+    {
+        unsigned int h = HashN(n, hash);
+        int nBit = h & 0x3F;
+        unsigned int nPos = (unsigned int)(((uint64)h * vData.size()) >> 32);
+        vData[nPos & ~1U] = (vData[nPos & ~1U] & ~((uint64)1 << nBit)) | ((uint64)(nGeneration & 1)) << nBit;
+        vData[nPos | 1] = (vData[nPos | 1] & ~((uint64)1 << nBit)) | ((uint64)(nGeneration >> 1)) << nBit;
+    }
+}
+
+bool CRollingBloomFilter::contains(const uint256& hash) const
+{
+    for (int n = 0; n < nHashFuncs; n++)
+    {
+        unsigned int h = HashN(n, hash);
+        int nBit = h & 0x3F;
+        unsigned int nPos = (unsigned int)(((uint64)h * vData.size()) >> 32);
+        if (!(((vData[nPos & ~1U] | vData[nPos | 1]) >> nBit) & 1))
+            return false;
+    }
+    return true;
+}
+
+void CRollingBloomFilter::reset()
+{
+    nTweak = (unsigned int)GetRand(0xFFFFFFFF);
+    nEntriesThisGeneration = 0;
+    nGeneration = 1;
+    fill(vData.begin(), vData.end(), 0);
+}
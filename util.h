@@ -238,6 +238,85 @@ public:
     for (bool fcriticalblockonce=true; fcriticalblockonce; assert(("break caught by TRY_CRITICAL_BLOCK!", !fcriticalblockonce)), fcriticalblockonce=false)  \
     for (CTryCriticalBlock criticalblock(cs); fcriticalblockonce && (fcriticalblockonce = criticalblock.Entered()) && (cs.pszFile=__FILE__, cs.nLine=__LINE__, true); fcriticalblockonce=false, cs.pszFile=NULL, cs.nLine=0)
 
+// Auto-reset event: Wait returns when Set has been called since the last
+// wait, or after nMilliseconds.
+class CWaitEvent
+{
+#if defined(_WIN32) || defined(__MINGW32__) || defined(__WXMSW__)
+protected:
+    HANDLE hEvent;
+public:
+    CWaitEvent() { hEvent = CreateEvent(NULL, FALSE, FALSE, NULL); }
+    ~CWaitEvent() { CloseHandle(hEvent); }
+    void Set() { SetEvent(hEvent); }
+    void Wait(int64 nMilliseconds) { WaitForSingleObject(hEvent, (DWORD)nMilliseconds); }
+#else
+protected:
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool fSet;
+public:
+    CWaitEvent() : fSet(false)
+    {
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&cond, NULL);
+    }
+    ~CWaitEvent()
+    {
+        pthread_cond_destroy(&cond);
+        pthread_mutex_destroy(&mutex);
+    }
+    void Set()
+    {
+        pthread_mutex_lock(&mutex);
+        fSet = true;
+        pthread_cond_signal(&cond);
+        pthread_mutex_unlock(&mutex);
+    }
+    void Wait(int64 nMilliseconds)
+    {
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        int64 nNanoseconds = (int64)now.tv_usec * 1000 + nMilliseconds * 1000000;
+        struct timespec deadline;
+        deadline.tv_sec = now.tv_sec + nNanoseconds / 1000000000;
+        deadline.tv_nsec = nNanoseconds % 1000000000;
+        pthread_mutex_lock(&mutex);
+        while (!fSet)
+            if (pthread_cond_timedwait(&cond, &mutex, &deadline) != 0)
+                break;
+        fSet = false;
+        pthread_mutex_unlock(&mutex);
+    }
+#endif
+private:
+    CWaitEvent(const CWaitEvent&);
+    void operator=(const CWaitEvent&);
+};
+
+
+// Fixed-size set of recently inserted hashes.  Remembers at least the last
+// nElements and forgets older ones a generation at a time, answering
+// contains with the given false positive rate.
+class CRollingBloomFilter
+{
+protected:
+    vector<uint64> vData;
+    int nHashFuncs;
+    int nEntriesPerGeneration;
+    int nEntriesThisGeneration;
+    int nGeneration;
+    unsigned int nTweak;
+
+    unsigned int HashN(int n, const uint256& hash) const;
+
+public:
+    CRollingBloomFilter(unsigned int nElements, double dFPRate);
+    void insert(const uint256& hash);
+    bool contains(const uint256& hash) const;
+    void reset();
+};
+
 
 
 
@@ -472,7 +551,7 @@ uint256 SerializeHash(const T& obj, int nType=SER_GETHASH, int nVersion=VERSION)
     // Most of the time is spent allocating and deallocating CDataStream's
     // buffer.  If this ever needs to be optimized further, make a CStaticStream
     // class with its buffer on the stack.
-    CDataStream ss(nType, nVersion);
+    CPublicDataStream ss(nType, nVersion);
     ss.reserve(10000);
     ss << obj;
     return Hash(ss.begin(), ss.end());